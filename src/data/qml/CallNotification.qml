@@ -18,7 +18,6 @@
  */
 
 import QtQuick 2.3
-import QtMultimedia 5.4
 import wiLink 2.5
 import 'scripts/utils.js' as Utils
 
@@ -38,10 +37,11 @@ NotificationDialog {
 
             jid: Qt.isQtObject(call) ? call.jid : ''
         },
-        SoundEffect {
-            loops: SoundEffect.Infinite
-            source: 'sounds/call-incoming.wav'
-            Component.onCompleted: play()
+        QtObject {
+            property int soundId: 0
+
+            Component.onCompleted: soundId = appSoundPlayer.play(Qt.resolvedUrl('sounds/call-incoming.wav'), true)
+            Component.onDestruction: appSoundPlayer.stop(soundId)
         },
         Connections {
             target: call
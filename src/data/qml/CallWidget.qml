@@ -19,7 +19,6 @@
 
 import QtQuick 2.3
 import QtQuick.Window 2.2
-import QtMultimedia 5.4
 import wiLink 2.5
 import 'scripts/utils.js' as Utils
 
@@ -39,11 +38,24 @@ Item {
     height: video.openMode != CallVideoHelper.NotOpen ? (240 + 2 * appStyle.margin.normal) : frame.height
     z: 5
 
-    SoundEffect {
+    QtObject {
         id: soundLoader
 
-        loops: SoundEffect.Infinite
-        source: 'sounds/call-outgoing.wav'
+        property int soundId: 0
+
+        function play() {
+            stop();
+            soundId = appSoundPlayer.play(Qt.resolvedUrl('sounds/call-outgoing.wav'), true);
+        }
+
+        function stop() {
+            if (soundId) {
+                appSoundPlayer.stop(soundId);
+                soundId = 0;
+            }
+        }
+
+        Component.onDestruction: stop()
     }
 
     Rectangle {
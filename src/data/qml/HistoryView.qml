@@ -45,11 +45,27 @@ Item {
         id: clipboard
     }
 
+    Timer {
+        id: prefetchTimer
+
+        interval: 100
+
+        onTriggered: {
+            // let the model prefetch and evict pages
+            var row = historyView.indexAt(0, historyView.contentY);
+            if (historyView.model && row >= 0 && row != historyView.prefetchRow) {
+                historyView.prefetchRow = row;
+                historyView.model.prefetch(row);
+            }
+        }
+    }
+
     ListView {
         id: historyView
 
         property bool scrollBarAtBottom
         property bool bottomChanging: false
+        property int prefetchRow: -1
         property int selectionStart: -1
 
         anchors.top: parent.top
@@ -61,6 +77,13 @@ Item {
         header: Rectangle { height: 2 }
         spacing: 6
 
+        onContentYChanged: {
+            if (!prefetchTimer.running)
+                prefetchTimer.start();
+        }
+
+        onModelChanged: prefetchRow = -1
+
         highlight: Item {
             id: highlight
 
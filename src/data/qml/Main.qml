@@ -20,7 +20,6 @@
 import QtQuick 2.3
 import QtQuick.LocalStorage 2.0
 import QtQuick.Window 2.2
-import QtMultimedia 5.4
 
 import wiLink 2.5
 import 'scripts/storage.js' as Storage
@@ -69,14 +68,22 @@ FocusScope {
         property string wifirstBaseUrl: 'https://apps.wifirst.net'
     }
 
-    SoundEffect {
+    QtObject {
         id: incomingMessageSound
-        source: appSettings.incomingMessageSound ? 'sounds/message-incoming.wav' : ''
+
+        function play() {
+            if (appSettings.incomingMessageSound)
+                appSoundPlayer.play(Qt.resolvedUrl('sounds/message-incoming.wav'));
+        }
     }
 
-    SoundEffect {
+    QtObject {
         id: outgoingMessageSound
-        source: appSettings.outgoingMessageSound ? 'sounds/message-outgoing.wav' : ''
+
+        function play() {
+            if (appSettings.outgoingMessageSound)
+                appSoundPlayer.play(Qt.resolvedUrl('sounds/message-outgoing.wav'));
+        }
     }
 
     SoundPlayer {
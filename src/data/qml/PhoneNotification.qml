@@ -18,7 +18,6 @@
  */
 
 import QtQuick 2.3
-import QtMultimedia 5.4
 import wiLink 2.5
 
 NotificationDialog {
@@ -33,10 +32,11 @@ NotificationDialog {
     title: qsTr('Call from %1').replace('%1', caller)
 
     resources: [
-        SoundEffect {
-            loops: SoundEffect.Infinite
-            source: 'sounds/call-incoming.wav'
-            Component.onCompleted: play()
+        QtObject {
+            property int soundId: 0
+
+            Component.onCompleted: soundId = appSoundPlayer.play(Qt.resolvedUrl('sounds/call-incoming.wav'), true)
+            Component.onDestruction: appSoundPlayer.stop(soundId)
         },
         Connections {
             target: call
@@ -0,0 +1,442 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <QCache>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QUrl>
+#include <QVector>
+
+#include "archive.h"
+
+#define ARCHIVE_CACHE_RECORDS 100000
+#define ARCHIVE_DUPLICATE_MSECS 2000
+#define ARCHIVE_MAGIC 0x574c4841
+#define ARCHIVE_VERSION 1
+
+static HistoryArchive *theArchive = 0;
+static QString theDataPath;
+
+/** The HistoryArchiveRecord class locates a message in a log.
+ */
+class HistoryArchiveRecord
+{
+public:
+    qint64 msecs;
+    qint64 offset;
+    // hash of the sender and body, used to detect duplicates
+    uint hash;
+};
+
+static bool recordLessThan(const HistoryArchiveRecord &a, const HistoryArchiveRecord &b)
+{
+    return a.msecs < b.msecs;
+}
+
+static bool recordBeforeMsecs(const HistoryArchiveRecord &record, qint64 msecs)
+{
+    return record.msecs < msecs;
+}
+
+static bool msecsBeforeRecord(qint64 msecs, const HistoryArchiveRecord &record)
+{
+    return msecs < record.msecs;
+}
+
+static uint messageHash(const HistoryMessage &message)
+{
+    return qHash(qMakePair(message.jid, message.body));
+}
+
+static bool readMessage(QDataStream &stream, HistoryMessage *message)
+{
+    qint64 msecs;
+    stream >> msecs >> message->jid >> message->body >> message->received;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+    message->archived = true;
+    message->date = QDateTime::fromMSecsSinceEpoch(msecs).toUTC();
+    return true;
+}
+
+/** The HistoryArchiveLog class indexes the messages of a single
+ *  conversation, which are read from disk when they are requested.
+ */
+class HistoryArchiveLog
+{
+public:
+    HistoryArchiveLog(const QString &path);
+    QList<HistoryMessage> add(const QList<HistoryMessage> &newMessages, QList<qint64> *offsets);
+    QList<HistoryMessage> read(int start, int end, QList<qint64> *offsets = 0) const;
+
+    // message locations in chronological order
+    QVector<HistoryArchiveRecord> records;
+
+private:
+    bool isDuplicate(const HistoryMessage &message, uint hash, QFile *file) const;
+
+    QString m_path;
+};
+
+/** Indexes the log at the given path.
+ *
+ * A truncated record at the end of the log, such as one left by a crash,
+ * is ignored.
+ */
+HistoryArchiveLog::HistoryArchiveLog(const QString &path)
+    : m_path(path)
+{
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic, version;
+    stream >> magic >> version;
+    if (magic != ARCHIVE_MAGIC || version != ARCHIVE_VERSION) {
+        qWarning("Could not read message archive %s", qPrintable(m_path));
+        return;
+    }
+
+    HistoryArchiveRecord record;
+    HistoryMessage message;
+    record.offset = file.pos();
+    while (!stream.atEnd() && readMessage(stream, &message)) {
+        record.msecs = message.date.toMSecsSinceEpoch();
+        record.hash = messageHash(message);
+        records << record;
+        record.offset = file.pos();
+    }
+
+    // records are mostly in chronological order, but not always
+    std::stable_sort(records.begin(), records.end(), recordLessThan);
+}
+
+/** Adds messages to the log, skipping duplicates.
+ *
+ * Returns the messages which were actually added, and stores their
+ * offsets in the log.
+ */
+QList<HistoryMessage> HistoryArchiveLog::add(const QList<HistoryMessage> &newMessages, QList<qint64> *offsets)
+{
+    QList<HistoryMessage> added;
+
+    QFile file(m_path);
+    const bool isNew = !file.exists();
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning("Could not write message archive %s", qPrintable(m_path));
+        return added;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    if (isNew)
+        stream << quint32(ARCHIVE_MAGIC) << quint32(ARCHIVE_VERSION);
+
+    foreach (HistoryMessage message, newMessages) {
+        if (!message.date.isValid())
+            continue;
+
+        HistoryArchiveRecord record;
+        record.hash = messageHash(message);
+        record.msecs = message.date.toMSecsSinceEpoch();
+        if (isDuplicate(message, record.hash, &file))
+            continue;
+
+        record.offset = file.pos();
+        stream << record.msecs << message.jid << message.body << message.received;
+        records.insert(std::upper_bound(records.begin(), records.end(), record, recordLessThan), record);
+
+        message.archived = true;
+        added << message;
+        *offsets << record.offset;
+    }
+    return added;
+}
+
+/** Returns true if a message with the same sender and body was stored
+ *  at about the same date.
+ */
+bool HistoryArchiveLog::isDuplicate(const HistoryMessage &message, uint hash, QFile *file) const
+{
+    const qint64 msecs = message.date.toMSecsSinceEpoch();
+    QVector<HistoryArchiveRecord>::const_iterator it = std::upper_bound(records.constBegin(), records.constEnd(), msecs - ARCHIVE_DUPLICATE_MSECS, msecsBeforeRecord);
+    for ( ; it != records.constEnd() && it->msecs < msecs + ARCHIVE_DUPLICATE_MSECS; ++it) {
+        if (it->hash != hash)
+            continue;
+
+        // confirm the match, the log may have pending writes
+        file->flush();
+        const QList<HistoryMessage> stored = read(it - records.constBegin(), it - records.constBegin() + 1);
+        if (!stored.isEmpty() && stored.first().jid == message.jid && stored.first().body == message.body)
+            return true;
+    }
+    return false;
+}
+
+/** Reads the messages between the given positions in the index, along with
+ *  their offsets in the log if requested.
+ */
+QList<HistoryMessage> HistoryArchiveLog::read(int start, int end, QList<qint64> *offsets) const
+{
+    QList<HistoryMessage> messages;
+    QFile file(m_path);
+    if (start >= end || !file.open(QIODevice::ReadOnly))
+        return messages;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    for (int i = start; i < end; ++i) {
+        HistoryMessage message;
+        if (!file.seek(records.at(i).offset) || !readMessage(stream, &message))
+            break;
+        messages << message;
+        if (offsets)
+            *offsets << records.at(i).offset;
+    }
+    return messages;
+}
+
+class HistoryArchivePrivate
+{
+public:
+    QString accountPath(const QString &account) const;
+    HistoryArchiveLog *log(const QString &account, const QString &with);
+    QString logPath(const QString &account, const QString &with) const;
+    void updateCost(const QString &path);
+
+    // recently used logs, weighed by their number of records
+    QCache<QString, HistoryArchiveLog> logs;
+};
+
+/** Returns the log of a conversation, indexing it if needed.
+ *
+ * The log belongs to the cache, so the returned pointer must not be used
+ * after another call to log() or updateCost(), which may evict it.
+ */
+HistoryArchiveLog *HistoryArchivePrivate::log(const QString &account, const QString &with)
+{
+    if (theDataPath.isEmpty() || account.isEmpty() || with.isEmpty())
+        return 0;
+
+    const QString path = logPath(account, with);
+    HistoryArchiveLog *log = logs.object(path);
+    if (!log) {
+        log = new HistoryArchiveLog(path);
+        logs.insert(path, log, qBound(1, log->records.size(), logs.maxCost()));
+    }
+    return log;
+}
+
+/** Weighs a log again after records were added to it, evicting other logs
+ *  if needed.
+ *
+ * The cost is capped so that the log itself is never evicted.
+ */
+void HistoryArchivePrivate::updateCost(const QString &path)
+{
+    HistoryArchiveLog *log = logs.take(path);
+    if (log)
+        logs.insert(path, log, qBound(1, log->records.size(), logs.maxCost()));
+}
+
+QString HistoryArchivePrivate::accountPath(const QString &account) const
+{
+    return QDir(theDataPath).filePath(QString::fromLatin1(QUrl::toPercentEncoding(account)));
+}
+
+QString HistoryArchivePrivate::logPath(const QString &account, const QString &with) const
+{
+    return QDir(accountPath(account)).filePath(QString::fromLatin1(QUrl::toPercentEncoding(with)) + ".log");
+}
+
+HistoryArchive::HistoryArchive(QObject *parent)
+    : QObject(parent)
+{
+    d = new HistoryArchivePrivate;
+    d->logs.setMaxCost(ARCHIVE_CACHE_RECORDS);
+}
+
+HistoryArchive::~HistoryArchive()
+{
+    delete d;
+}
+
+/** Returns the HistoryArchive instance.
+ */
+HistoryArchive *HistoryArchive::instance()
+{
+    if (!theArchive)
+        theArchive = new HistoryArchive;
+    return theArchive;
+}
+
+/** Returns the directory in which messages are stored.
+ */
+QString HistoryArchive::dataPath()
+{
+    return theDataPath;
+}
+
+/** Sets the directory in which messages are stored.
+ *
+ * If no directory is set, messages are not stored.
+ *
+ * @param dataPath
+ */
+void HistoryArchive::setDataPath(const QString &dataPath)
+{
+    theDataPath = dataPath;
+}
+
+/** Stores a message exchanged with the given contact or room.
+ *
+ * @param account the bare JID of the local account
+ * @param with the bare JID of the contact or room
+ * @param message
+ */
+void HistoryArchive::addMessage(const QString &account, const QString &with, const HistoryMessage &message)
+{
+    addMessages(account, with, QList<HistoryMessage>() << message);
+}
+
+/** Stores messages exchanged with the given contact or room, skipping
+ *  those which are already stored.
+ *
+ * @param account the bare JID of the local account
+ * @param with the bare JID of the contact or room
+ * @param messages
+ */
+void HistoryArchive::addMessages(const QString &account, const QString &with, const QList<HistoryMessage> &messages)
+{
+    if (messages.isEmpty())
+        return;
+    HistoryArchiveLog *log = d->log(account, with);
+    if (!log)
+        return;
+
+    QDir().mkpath(d->accountPath(account));
+    QList<qint64> offsets;
+    const QList<HistoryMessage> added = log->add(messages, &offsets);
+    if (added.isEmpty())
+        return;
+
+    d->updateCost(d->logPath(account, with));
+    emit messagesAdded(account, with, added, offsets);
+}
+
+/** Returns the most recent messages exchanged with the given contact or
+ *  room before the given date, in chronological order.
+ *
+ * @param account the bare JID of the local account
+ * @param with the bare JID of the contact or room
+ * @param before if valid, only messages older than this date are returned
+ * @param limit the maximum number of messages to return, or -1 for no limit
+ * @param offsets if not null, receives the offsets of the messages, which can be passed to message()
+ */
+QList<HistoryMessage> HistoryArchive::messages(const QString &account, const QString &with, const QDateTime &before, int limit, QList<qint64> *offsets)
+{
+    HistoryArchiveLog *log = d->log(account, with);
+    if (!log)
+        return QList<HistoryMessage>();
+
+    const int end = before.isValid() ?
+        std::lower_bound(log->records.constBegin(), log->records.constEnd(), before.toMSecsSinceEpoch(), recordBeforeMsecs) - log->records.constBegin() :
+        log->records.size();
+    const int start = limit < 0 ? 0 : qMax(0, end - limit);
+    return log->read(start, end, offsets);
+}
+
+/** Reads a single message exchanged with the given contact or room.
+ *
+ * Returns false if the message could not be read, for instance because
+ * the conversation was removed.
+ *
+ * @param account the bare JID of the local account
+ * @param with the bare JID of the contact or room
+ * @param offset the offset of the message, as returned by messages() or messagesAdded()
+ * @param message
+ */
+bool HistoryArchive::message(const QString &account, const QString &with, qint64 offset, HistoryMessage *message) const
+{
+    if (theDataPath.isEmpty() || account.isEmpty() || with.isEmpty())
+        return false;
+
+    QFile file(d->logPath(account, with));
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(offset))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    return readMessage(stream, message);
+}
+
+/** Returns the date of the most recent message exchanged with the given
+ *  contact or room.
+ *
+ * @param account the bare JID of the local account
+ * @param with the bare JID of the contact or room
+ */
+QDateTime HistoryArchive::lastDate(const QString &account, const QString &with)
+{
+    HistoryArchiveLog *log = d->log(account, with);
+    if (!log || log->records.isEmpty())
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(log->records.last().msecs).toUTC();
+}
+
+/** Removes all the messages exchanged with the given contact or room.
+ *
+ * @param account the bare JID of the local account
+ * @param with the bare JID of the contact or room
+ */
+void HistoryArchive::removeMessages(const QString &account, const QString &with)
+{
+    if (theDataPath.isEmpty() || account.isEmpty() || with.isEmpty())
+        return;
+
+    const QString path = d->logPath(account, with);
+    d->logs.remove(path);
+    QFile::remove(path);
+    emit messagesRemoved(account, with);
+}
+
+/** Returns the bare JIDs of the contacts and rooms for which messages are
+ *  stored.
+ *
+ * @param account the bare JID of the local account
+ */
+QStringList HistoryArchive::conversations(const QString &account) const
+{
+    QStringList jids;
+    if (theDataPath.isEmpty() || account.isEmpty())
+        return jids;
+
+    const QDir dir(d->accountPath(account));
+    foreach (const QString &fileName, dir.entryList(QStringList() << "*.log", QDir::Files)) {
+        const QString with = QUrl::fromPercentEncoding(fileName.left(fileName.size() - 4).toLatin1());
+        if (!with.isEmpty())
+            jids << with;
+    }
+    return jids;
+}
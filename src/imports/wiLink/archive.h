@@ -0,0 +1,72 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_CHAT_ARCHIVE_H__
+#define __WILINK_CHAT_ARCHIVE_H__
+
+#include <QDateTime>
+#include <QObject>
+#include <QStringList>
+
+#include "history.h"
+
+class HistoryArchivePrivate;
+
+/** The HistoryArchive class stores chat messages on disk, so that the
+ *  history of a conversation can be displayed without waiting for the
+ *  server's archives.
+ *
+ *  Each conversation is stored as an append-only log. The date and
+ *  position of its messages are indexed the first time the conversation is
+ *  accessed, and messages are only read from disk when they are requested.
+ *  The indexes of conversations which have not been used recently are
+ *  dropped.
+ */
+class HistoryArchive : public QObject
+{
+    Q_OBJECT
+
+public:
+    static HistoryArchive *instance();
+    ~HistoryArchive();
+
+    static QString dataPath();
+    static void setDataPath(const QString &dataPath);
+
+    void addMessage(const QString &account, const QString &with, const HistoryMessage &message);
+    void addMessages(const QString &account, const QString &with, const QList<HistoryMessage> &messages);
+    QStringList conversations(const QString &account) const;
+    QList<HistoryMessage> messages(const QString &account, const QString &with, const QDateTime &before = QDateTime(), int limit = -1, QList<qint64> *offsets = 0);
+    bool message(const QString &account, const QString &with, qint64 offset, HistoryMessage *message) const;
+    QDateTime lastDate(const QString &account, const QString &with);
+    void removeMessages(const QString &account, const QString &with);
+
+signals:
+    /// This signal is emitted when new messages are stored at the given offsets.
+    void messagesAdded(const QString &account, const QString &with, const QList<HistoryMessage> &messages, const QList<qint64> &offsets);
+
+    /// This signal is emitted when the messages of a conversation are removed.
+    void messagesRemoved(const QString &account, const QString &with);
+
+private:
+    HistoryArchive(QObject *parent = 0);
+    HistoryArchivePrivate *d;
+};
+
+#endif
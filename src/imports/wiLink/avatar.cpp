@@ -0,0 +1,178 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QBuffer>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QImageReader>
+#include <QMutex>
+#include <QStandardPaths>
+
+#include "avatar.h"
+
+// thumbnail sizes, which match the icon sizes used in QML
+static const int avatarSizes[] = { 16, 24, 32, 48, 64, 128 };
+static const int avatarSizeCount = sizeof(avatarSizes) / sizeof(avatarSizes[0]);
+
+// maximum memory used by thumbnails, in kilobytes
+static const int AVATAR_CACHE_KB = 8192;
+
+class AvatarCachePrivate
+{
+public:
+    QString filePath(const QByteArray &hash) const;
+
+    QMutex mutex;
+    QHash<QString, QByteArray> hashes;
+    QCache<QString, QImage> images;
+    QString path;
+};
+
+QString AvatarCachePrivate::filePath(const QByteArray &hash) const
+{
+    return QDir(path).filePath(QString::fromLatin1(hash.toHex()) + ".png");
+}
+
+/** Returns the smallest thumbnail size which covers the requested size.
+ */
+static int avatarSize(const QSize &requestedSize)
+{
+    const int size = qMax(requestedSize.width(), requestedSize.height());
+    for (int i = 0; i < avatarSizeCount; ++i) {
+        if (avatarSizes[i] >= size)
+            return avatarSizes[i];
+    }
+    return avatarSizes[avatarSizeCount - 1];
+}
+
+Q_GLOBAL_STATIC(AvatarCache, theAvatarCache)
+
+AvatarCache::AvatarCache()
+{
+    const QString dataPath = QStandardPaths::standardLocations(QStandardPaths::DataLocation)[0];
+
+    d = new AvatarCachePrivate;
+    d->images.setMaxCost(AVATAR_CACHE_KB);
+    d->path = QDir(dataPath).filePath("avatars");
+    QDir().mkpath(d->path);
+}
+
+AvatarCache::~AvatarCache()
+{
+    delete d;
+}
+
+/** Returns the AvatarCache instance.
+ */
+AvatarCache *AvatarCache::instance()
+{
+    return theAvatarCache();
+}
+
+/** Decodes a photo and stores its largest thumbnail, unless it is already
+ *  stored.
+ *
+ * Returns the photo's hash, or an empty array if there is no photo.
+ *
+ * @param photo the encoded photo
+ */
+QByteArray AvatarCache::addPhoto(const QByteArray &photo)
+{
+    if (photo.isEmpty())
+        return QByteArray();
+
+    const QByteArray hash = QCryptographicHash::hash(photo, QCryptographicHash::Sha1);
+    const QString path = d->filePath(hash);
+    if (QFile::exists(path))
+        return hash;
+
+    QBuffer buffer;
+    buffer.setData(photo);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader imageReader(&buffer);
+    const int maxSize = avatarSizes[avatarSizeCount - 1];
+    const QSize size = imageReader.size();
+    if (size.width() > maxSize || size.height() > maxSize)
+        imageReader.setScaledSize(size.scaled(maxSize, maxSize, Qt::KeepAspectRatio));
+
+    const QImage image = imageReader.read();
+    if (image.isNull() || !image.save(path, "PNG")) {
+        qWarning("Could not store avatar %s", qPrintable(path));
+        return QByteArray();
+    }
+    return hash;
+}
+
+/** Sets the hash of a contact's photo.
+ *
+ * @param jid
+ * @param hash
+ */
+void AvatarCache::setPhotoHash(const QString &jid, const QByteArray &hash)
+{
+    QMutexLocker locker(&d->mutex);
+    if (hash.isEmpty())
+        d->hashes.remove(jid);
+    else
+        d->hashes.insert(jid, hash);
+}
+
+/** Returns a contact's photo, scaled to fit the requested size.
+ *
+ * If the requested size is invalid, the largest thumbnail is returned.
+ *
+ * @param jid
+ * @param requestedSize
+ */
+QImage AvatarCache::image(const QString &jid, const QSize &requestedSize)
+{
+    const int size = avatarSize(requestedSize);
+    QByteArray hash;
+    QString key;
+    QImage image;
+    {
+        QMutexLocker locker(&d->mutex);
+        hash = d->hashes.value(jid);
+        if (hash.isEmpty())
+            return QImage();
+
+        key = QString::fromLatin1(hash.toHex()) + QLatin1Char('/') + QString::number(size);
+        QImage *cached = d->images.object(key);
+        if (cached)
+            image = *cached;
+    }
+
+    if (image.isNull()) {
+        image = QImage(d->filePath(hash));
+        if (image.isNull())
+            return image;
+        if (image.width() > size || image.height() > size)
+            image = image.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+        QMutexLocker locker(&d->mutex);
+        d->images.insert(key, new QImage(image), image.byteCount() / 1024 + 1);
+    }
+
+    if (!requestedSize.isEmpty() && (requestedSize.width() < image.width() || requestedSize.height() < image.height()))
+        image = image.scaled(requestedSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    return image;
+}
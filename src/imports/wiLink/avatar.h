@@ -0,0 +1,52 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_AVATAR_H__
+#define __WILINK_AVATAR_H__
+
+#include <QImage>
+
+class AvatarCachePrivate;
+
+/** The AvatarCache class holds decoded contact photos.
+ *
+ *  Photos are decoded once, when their vCard is received, and stored as
+ *  thumbnails keyed by the photo's hash. Thumbnails for the requested
+ *  sizes are kept in a memory-bounded cache.
+ *
+ *  All methods are thread-safe.
+ */
+class AvatarCache
+{
+public:
+    AvatarCache();
+    ~AvatarCache();
+
+    static AvatarCache *instance();
+
+    QByteArray addPhoto(const QByteArray &photo);
+    void setPhotoHash(const QString &jid, const QByteArray &hash);
+    QImage image(const QString &jid, const QSize &requestedSize);
+
+private:
+    Q_DISABLE_COPY(AvatarCache)
+    AvatarCachePrivate *d;
+};
+
+#endif
@@ -24,6 +24,7 @@
 #include "QXmppMessage.h"
 #include "QXmppUtils.h"
 
+#include "archive.h"
 #include "client.h"
 #include "conversations.h"
 #include "history.h"
@@ -130,6 +131,7 @@ void Conversation::messageReceived(const QXmppMessage &msg)
         message.date = m_client->serverTime();
     message.jid = m_jid;
     message.received = true;
+    HistoryArchive::instance()->addMessage(m_client->configuration().jidBare(), m_jid, message);
     if (m_historyModel)
         m_historyModel->addMessage(message);
 }
@@ -154,14 +156,14 @@ bool Conversation::sendMessage(const QString &body)
     }
 
     // add message to history
-    if (m_historyModel) {
-        HistoryMessage message;
-        message.body = body;
-        message.date = m_client->serverTime();
-        message.jid = m_client->configuration().jidBare();
-        message.received = false;
-        m_historyModel->addMessage(message);
-    }
+    HistoryMessage historyMessage;
+    historyMessage.body = body;
+    historyMessage.date = m_client->serverTime();
+    historyMessage.jid = m_client->configuration().jidBare();
+    historyMessage.received = false;
+    HistoryArchive::instance()->addMessage(m_client->configuration().jidBare(), m_jid, historyMessage);
+    if (m_historyModel)
+        m_historyModel->addMessage(historyMessage);
 
     return true;
 }
@@ -36,6 +36,7 @@
 #include "wallet.h"
 
 #include "accounts.h"
+#include "archive.h"
 #include "idle/idle.h"
 #include "calls.h"
 #include "client.h"
@@ -52,6 +53,7 @@
 #include "phone/sip.h"
 #include "rooms.h"
 #include "roster.h"
+#include "search.h"
 #include "settings.h"
 #include "translations.h"
 #include "updater.h"
@@ -135,6 +137,9 @@ void Plugin::initializeEngine(QQmlEngine *engine, const char *uri)
     const QString dataPath = QStandardPaths::standardLocations(QStandardPaths::DataLocation)[0];
     QDir().mkpath(dataPath);
     QNetIO::Wallet::setDataPath(QDir(dataPath).filePath("wallet"));
+
+    // initialise message archive
+    HistoryArchive::setDataPath(QDir(dataPath).filePath("archive"));
 }
 
 void Plugin::registerTypes(const char *uri)
@@ -151,6 +156,7 @@ void Plugin::registerTypes(const char *uri)
     qmlRegisterUncreatableType<DiagnosticManager>(uri, 2, 5, "DiagnosticManager", "");
     qmlRegisterType<DiscoveryModel>(uri, 2, 5, "DiscoveryModel");
     qmlRegisterUncreatableType<HistoryModel>(uri, 2, 5, "HistoryModel", "");
+    qmlRegisterType<HistorySearchModel>(uri, 2, 5, "HistorySearchModel");
     qmlRegisterType<Idle>(uri, 2, 5, "Idle");
     qmlRegisterType<ListHelper>(uri, 2, 5, "ListHelper");
     qmlRegisterType<LogModel>(uri, 2, 5, "LogModel");
@@ -99,12 +99,13 @@ void DiscoveryModel::itemsReceived(const QXmppDiscoveryIq &disco)
         return;
 
     removeRows(0, rootItem->children.size());
+    QList<ChatModelItem*> items;
     foreach (const QXmppDiscoveryIq::Item &item, disco.items()) {
         DiscoveryItem *ptr = new DiscoveryItem;
         ptr->jid = item.jid();
         ptr->node = item.node();
         ptr->name = item.name();
-        addItem(ptr, rootItem, rootItem->children.size());
+        items << ptr;
 
         // request information
         if (m_details) {
@@ -113,6 +114,7 @@ void DiscoveryModel::itemsReceived(const QXmppDiscoveryIq &disco)
                 m_requests.append(id);
         }
     }
+    addItems(items, rootItem);
 }
 
 void DiscoveryModel::refresh()
@@ -17,24 +17,39 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
+#include <QDomElement>
+#include <QElapsedTimer>
 #include <QUrl>
 
 #include "QXmppArchiveIq.h"
 #include "QXmppArchiveManager.h"
 #include "QXmppUtils.h"
 
+#include "archive.h"
 #include "client.h"
 #include "history.h"
 #include "roster.h"
 
 #define HISTORY_DAYS 365
+#define HISTORY_LOCAL_PAGE 50
+#define HISTORY_MAX_BUBBLES 300
 #define HISTORY_PAGE 2
+#define HISTORY_PAGE_MAX 16
+#define HISTORY_PAGE_MESSAGES 50
+#define HISTORY_PREFETCH_ROWS 10
+#define HISTORY_SCROLL_MSECS 3000
+#define HISTORY_WINDOW 4
+#define HISTORY_DUPLICATE_MSECS 2000
 #define SMILEY_ROOT "qrc:/images/32x32"
 
 typedef QPair<QRegExp, QString> TextTransform;
 static QList<TextTransform> textTransforms;
+static int textTransformsGeneration = 0;
 
 static const QRegExp meRegex = QRegExp("^/me[ \t]+(.*)");
+static const QRegExp spaceRegex = QRegExp("[ \t]+");
 
 enum PageDirection {
     PageForwards = 0,
@@ -44,11 +59,9 @@ enum PageDirection {
 class HistoryItem : public ChatModelItem
 {
 public:
-    HistoryItem() : selected(false) {}
     ~HistoryItem();
 
     QList<HistoryMessage*> messages;
-    bool selected;
 };
 
 HistoryItem::~HistoryItem()
@@ -60,7 +73,7 @@ HistoryItem::~HistoryItem()
 /** Constructs a new HistoryMessage.
  */
 HistoryMessage::HistoryMessage()
-    : archived(false), received(true)
+    : archived(false), received(true), m_htmlGeneration(-1)
 {
 }
 
@@ -72,6 +85,7 @@ HistoryMessage::HistoryMessage()
 void HistoryMessage::addTransform(const QRegExp &match, const QString &replacement)
 {
     textTransforms.append(qMakePair(match, replacement));
+    textTransformsGeneration++;
 }
 
 /** Returns true if the two messages should be grouped in the same bubble.
@@ -86,33 +100,58 @@ bool HistoryMessage::groupWith(const HistoryMessage &other) const
         qAbs(date.secsTo(other.date)) < 3600; // 1 hour
 }
 
+/** The TokenMatcher class recognises smileys and links using a single
+ *  regular expression, which is built once.
+ */
+class TokenMatcher
+{
+public:
+    TokenMatcher();
+
+    QHash<QString, QString> smileys;
+    QRegExp regex;
+};
+
+TokenMatcher::TokenMatcher()
+{
+    QMap<QString, QStringList> images;
+    images["face-angry.png"] = QStringList() << ":@" << ":-@";
+    images["face-cool.png"] = QStringList() << "8-)" << "B-)";
+    images["face-crying.png"] = QStringList() << ";(" << ";-(" << ";'-(" << ":'(" << ":'-(";
+    images["face-embarrassed.png"] = QStringList() << ":$";
+    images["face-laughing.png"] = QStringList() << ":D" << ":-D";
+    images["face-plain.png"] = QStringList() << ":|" << ":-|";
+    images["face-raspberry.png"] = QStringList() << ":p" << ":-p" << ":P" << ":-P";
+    images["face-sad.png"] = QStringList() << ":(" << ":-(";
+    images["face-sleeping.png"] = QStringList() << "|-)";
+    images["face-smile.png"] = QStringList() << ":)" << ":-)";
+    images["face-surprise.png"] = QStringList() << ":o" << ":-o" << ":O" << ":-O";
+    images["face-uncertain.png"] = QStringList() << ":s" << ":-s" << ":S" << ":-S" << ":/" << ":-/";
+    images["face-wink.png"] = QStringList() << ";)" << ";-)";
+
+    QStringList alternatives;
+    foreach (const QString &image, images.keys()) {
+        foreach (const QString &smiley, images.value(image)) {
+            smileys.insert(smiley, image);
+            alternatives << QRegExp::escape(smiley);
+        }
+    }
+
+    // the first group captures smileys, the second one links
+    regex = QRegExp(QString("(%1)|((ftp|http|https)://.+)").arg(alternatives.join("|")));
+}
+
+Q_GLOBAL_STATIC(TokenMatcher, tokenMatcher)
+
 static QString transformToken(const QString &token)
 {
-    QMap<QString, QStringList> smileys;
-    smileys["face-angry.png"] = QStringList() << ":@" << ":-@";
-    smileys["face-cool.png"] = QStringList() << "8-)" << "B-)";
-    smileys["face-crying.png"] = QStringList() << ";(" << ";-(" << ";'-(" << ":'(" << ":'-(";
-    smileys["face-embarrassed.png"] = QStringList() << ":$";
-    smileys["face-laughing.png"] = QStringList() << ":D" << ":-D";
-    smileys["face-plain.png"] = QStringList() << ":|" << ":-|";
-    smileys["face-raspberry.png"] = QStringList() << ":p" << ":-p" << ":P" << ":-P";
-    smileys["face-sad.png"] = QStringList() << ":(" << ":-(";
-    smileys["face-sleeping.png"] = QStringList() << "|-)";
-    smileys["face-smile.png"] = QStringList() << ":)" << ":-)";
-    smileys["face-surprise.png"] = QStringList() << ":o" << ":-o" << ":O" << ":-O";
-    smileys["face-uncertain.png"] = QStringList() << ":s" << ":-s" << ":S" << ":-S" << ":/" << ":-/";
-    smileys["face-wink.png"] = QStringList() << ";)" << ";-)";
-
-    const QRegExp linkRegex("(ftp|http|https)://.+");
-
-    // handle smileys
-    foreach (const QString &smiley, smileys.keys()) {
-        if (smileys.value(smiley).contains(token))
-            return QString("<img alt=\"%1\" src=\"%2/%3\" height=\"16\" width=\"16\" />").arg(token, SMILEY_ROOT, smiley);
-    }
-
-    // handle links
-    if (linkRegex.exactMatch(token)) {
+    TokenMatcher *matcher = tokenMatcher();
+    if (matcher->regex.exactMatch(token)) {
+        // handle smileys
+        if (!matcher->regex.cap(1).isEmpty())
+            return QString("<img alt=\"%1\" src=\"%2/%3\" height=\"16\" width=\"16\" />").arg(token, SMILEY_ROOT, matcher->smileys.value(token));
+
+        // handle links
         QUrl url;
         url.setUrl(token);
         return QString("<a href=\"%1\">%2</a>").arg(url.toString(), url.toString());
@@ -123,16 +162,32 @@ static QString transformToken(const QString &token)
 }
 
 /** Returns the HTML for the message body.
+ *
+ * The HTML is cached until the body, the transforms or, for "action"
+ * messages, the name changes.
  *
  * @param meName
  */
 QString HistoryMessage::html(const QString &meName) const
 {
+    const bool action = !meName.isEmpty() && body.startsWith(QLatin1String("/me")) && isAction();
+    const QString actionName = action ? meName : QString();
+    if (m_htmlGeneration == textTransformsGeneration &&
+        m_htmlBody == body &&
+        m_htmlMeName == actionName)
+        return m_html;
+
+    m_htmlBody = body;
+    m_htmlGeneration = textTransformsGeneration;
+    m_htmlMeName = actionName;
+
     // me
-    QRegExp re(meRegex);
-    if (!meName.isEmpty() && re.exactMatch(body)) {
+    if (action) {
+        QRegExp re(meRegex);
+        re.exactMatch(body);
         const QString meBody = re.cap(1).toHtmlEscaped();
-        return QString("<b>%1 %2</b>").arg(meName, meBody);
+        m_html = QString("<b>%1 %2</b>").arg(meName, meBody);
+        return m_html;
     }
 
     // remove trailing whitespace
@@ -144,7 +199,7 @@ QString HistoryMessage::html(const QString &meName) const
     QStringList htmlLines;
     foreach (const QString &textLine, body.left(pos+1).split('\n')) {
         QStringList output;
-        const QStringList input = textLine.split(QRegExp("[ \t]+"));
+        const QStringList input = textLine.split(spaceRegex);
         foreach (const QString &token, input) {
             QString tokenHtml = transformToken(token);
             foreach (const TextTransform &transform, textTransforms)
@@ -154,7 +209,8 @@ QString HistoryMessage::html(const QString &meName) const
         htmlLines << output.join(" ");
     }
 
-    return htmlLines.join("<br/>");
+    m_html = htmlLines.join("<br/>");
+    return m_html;
 }
 
 /** Returns true if the message is an "action" message, such
@@ -165,6 +221,21 @@ bool HistoryMessage::isAction() const
     return meRegex.exactMatch(body);
 }
 
+static bool historyMessageLessThan(const HistoryMessage &a, const HistoryMessage &b)
+{
+    return a.date < b.date;
+}
+
+static bool historyDateLessThan(const QDateTime &date, const HistoryMessage *message)
+{
+    return date < message->date;
+}
+
+static bool historyMessageDateLessThan(const HistoryMessage *message, const QDateTime &date)
+{
+    return message->date < date;
+}
+
 class HistoryQueueItem
 {
 public:
@@ -172,22 +243,114 @@ public:
     QDateTime start;
 };
 
+/** Returns the observer of the given client, installing it if needed.
+ *
+ * @param client
+ */
+HistoryListObserver *HistoryListObserver::instance(ChatClient *client)
+{
+    HistoryListObserver *observer = client->findExtension<HistoryListObserver>();
+    if (!observer) {
+        // the observer must see responses before the archive manager
+        observer = new HistoryListObserver;
+        client->insertExtension(0, observer);
+    }
+    return observer;
+}
+
+/** Returns the id of the archive list response being handled.
+ */
+QString HistoryListObserver::currentId() const
+{
+    return m_currentId;
+}
+
+/** Requests the list of collections exchanged with the given JID, and
+ *  returns the id of the request.
+ *
+ * @param jid
+ * @param start
+ * @param rsmQuery
+ */
+QString HistoryListObserver::listCollections(const QString &jid, const QDateTime &start, const QXmppResultSetQuery &rsmQuery)
+{
+    QXmppArchiveListIq packet;
+    packet.setResultSetQuery(rsmQuery);
+    packet.setWith(jid);
+    packet.setStart(start);
+    client()->sendPacket(packet);
+    return packet.id();
+}
+
+bool HistoryListObserver::handleStanza(const QDomElement &stanza)
+{
+    // let the archive manager handle the response
+    if (stanza.tagName() == QLatin1String("iq") && QXmppArchiveListIq::isArchiveListIq(stanza))
+        m_currentId = stanza.attribute("id");
+    return false;
+}
+
 class HistoryModelPrivate
 {
 public:
     HistoryModelPrivate(HistoryModel *qq);
+    QString account() const;
     void fetchArchives();
+    bool fetchLocalPage();
     void fetchMessages();
+    void fetchServerPage(const QDateTime &start);
+    int serverPageSize() const;
+
+    void indexMessage(HistoryMessage *message, int pos, HistoryItem *bubble);
+    void unindexBubble(HistoryItem *bubble);
+    bool isDuplicate(const HistoryMessage &message) const;
+
+    bool isSelected(const HistoryItem *bubble) const;
+    QPair<int, int> selectedRows() const;
+    void trim();
+
+    // all messages in chronological order
+    QList<HistoryMessage*> messages;
+    // the bubble containing each message
+    QHash<HistoryMessage*, HistoryItem*> bubbles;
+    // messages by sender and body, to detect duplicates
+    QMultiHash<QPair<QString, QString>, HistoryMessage*> bodies;
+    // bubbles by sender, to notify name changes
+    QHash<QString, QSet<HistoryItem*> > senders;
 
     QString archiveFirst;
     QString archiveLast;
     bool archivesFetched;
     ChatClient *client;
+    bool deltaSync;
     bool hasPreviousPage;
+    bool localExhausted;
     QList<HistoryQueueItem> messageQueue;
     PageDirection pageDirection;
+
+    // id of the collection list request awaiting a response
+    QString listId;
+
+    // server page being fetched
+    bool pageRequested;
+    int pageMessages;
+    QElapsedTimer pageTimer;
+    int pendingCollections;
+
+    // density of the server's collections so far
+    int collectionsReceived;
+    int messagesReceived;
+
     QString jid;
-    QMap<QString, VCard*> rosterCards;
+    QString localAccount;
+
+    // bubbles kept in memory, and the topmost visible row if known
+    int maximumBubbles;
+    int viewportRow;
+
+    // dates of the first and last selected messages
+    QDateTime selectionStart;
+    QDateTime selectionEnd;
 
 private:
     HistoryModel *q;
@@ -196,32 +359,222 @@ private:
 HistoryModelPrivate::HistoryModelPrivate(HistoryModel *qq)
     : archivesFetched(false)
     , client(0)
+    , deltaSync(false)
     , hasPreviousPage(false)
+    , localExhausted(true)
     , pageDirection(PageBackwards)
+    , pageRequested(false)
+    , pageMessages(0)
+    , pendingCollections(0)
+    , collectionsReceived(0)
+    , messagesReceived(0)
+    , maximumBubbles(HISTORY_MAX_BUBBLES)
+    , viewportRow(-1)
     , q(qq)
 {
 }
 
+/** Returns the bare JID of the local account.
+ */
+QString HistoryModelPrivate::account() const
+{
+    return client ? client->configuration().jidBare() : localAccount;
+}
+
 void HistoryModelPrivate::fetchArchives()
 {
     if (archivesFetched || !client || jid.isEmpty())
         return;
 
-    // fetch last page
     archivesFetched = true;
     archiveFirst = QString("");
     messageQueue.clear();
-    q->fetchPreviousPage();
+
+    // show the stored messages at once
+    localExhausted = false;
+    fetchLocalPage();
+
+    // only retrieve the server's archives since the last stored message
+    const QDateTime lastDate = HistoryArchive::instance()->lastDate(account(), jid);
+    deltaSync = lastDate.isValid();
+    fetchServerPage(deltaSync ? lastDate.addDays(-1) : client->serverTime().addDays(-HISTORY_DAYS));
+}
+
+/** Adds the stored messages which precede the displayed ones.
+ *
+ * Returns true if any message was added.
+ */
+bool HistoryModelPrivate::fetchLocalPage()
+{
+    if (localExhausted)
+        return false;
+
+    const QDateTime before = messages.isEmpty() ? QDateTime() : messages.first()->date;
+    const QList<HistoryMessage> page = HistoryArchive::instance()->messages(account(), jid, before, HISTORY_LOCAL_PAGE);
+    localExhausted = page.size() < HISTORY_LOCAL_PAGE;
+    if (page.isEmpty())
+        return false;
+
+    q->addMessages(page);
+    return true;
+}
+
+/** Requests the previous page of the server's archives.
+ *
+ * @param start the date of the oldest collection to list
+ */
+void HistoryModelPrivate::fetchServerPage(const QDateTime &start)
+{
+    pageDirection = PageBackwards;
+    QXmppResultSetQuery rsmQuery;
+    rsmQuery.setBefore(archiveFirst);
+    rsmQuery.setMax(serverPageSize());
+    listId = HistoryListObserver::instance(client)->listCollections(jid, start, rsmQuery);
+
+    pageRequested = true;
+    pageMessages = 0;
+    pageTimer.start();
+}
+
+/** Returns the number of collections to request for the next server page.
+ *
+ * The page holds about HISTORY_PAGE_MESSAGES messages given the density of
+ * the collections received so far, and doubles when the user is scrolling
+ * back quickly.
+ */
+int HistoryModelPrivate::serverPageSize() const
+{
+    int size = HISTORY_PAGE;
+    if (messagesReceived > 0)
+        size = (HISTORY_PAGE_MESSAGES * collectionsReceived + messagesReceived - 1) / messagesReceived;
+    else if (collectionsReceived > 0)
+        size = HISTORY_PAGE_MAX;
+
+    if (pageTimer.isValid() && pageTimer.elapsed() < HISTORY_SCROLL_MSECS)
+        size *= 2;
+    return qBound(HISTORY_PAGE, size, HISTORY_PAGE_MAX);
 }
 
+/** Requests queued collections, keeping at most HISTORY_WINDOW requests
+ *  in flight.
+ */
 void HistoryModelPrivate::fetchMessages()
 {
-    if (messageQueue.isEmpty())
+    while (pendingCollections < HISTORY_WINDOW && !messageQueue.isEmpty()) {
+        HistoryQueueItem item = messageQueue.takeFirst();
+        // FIXME: setting max to -2 is a hack!
+        client->archiveManager()->retrieveCollection(item.with, item.start, -2);
+        pendingCollections++;
+    }
+
+    // the page is complete
+    if (pageRequested && !pendingCollections && messageQueue.isEmpty()) {
+        pageRequested = false;
+        emit q->pageFetched(pageMessages, pageTimer.elapsed());
+    }
+}
+
+/** Adds a message to the chronological index, at the given position.
+ */
+void HistoryModelPrivate::indexMessage(HistoryMessage *message, int pos, HistoryItem *bubble)
+{
+    messages.insert(pos, message);
+    bubbles.insert(message, bubble);
+    bodies.insert(qMakePair(message->jid, message->body), message);
+    senders[message->jid].insert(bubble);
+}
+
+/** Removes a bubble's messages from the chronological index.
+ *
+ * The messages of a bubble are contiguous in the index.
+ */
+void HistoryModelPrivate::unindexBubble(HistoryItem *bubble)
+{
+    if (bubble->messages.isEmpty())
+        return;
+
+    HistoryMessage *first = bubble->messages.first();
+    QList<HistoryMessage*>::iterator it = std::lower_bound(messages.begin(), messages.end(), first->date, historyMessageDateLessThan);
+    while (it != messages.end() && *it != first)
+        ++it;
+    Q_ASSERT(it != messages.end());
+    messages.erase(it, it + bubble->messages.size());
+
+    QHash<QString, QSet<HistoryItem*> >::iterator senderIt = senders.find(first->jid);
+    if (senderIt != senders.end()) {
+        senderIt->remove(bubble);
+        if (senderIt->isEmpty())
+            senders.erase(senderIt);
+    }
+
+    foreach (HistoryMessage *message, bubble->messages) {
+        bubbles.remove(message);
+        bodies.remove(qMakePair(message->jid, message->body), message);
+    }
+}
+
+/** Returns true if all the messages of a bubble lie in the selection.
+ */
+bool HistoryModelPrivate::isSelected(const HistoryItem *bubble) const
+{
+    return selectionStart.isValid() &&
+        bubble->messages.first()->date >= selectionStart &&
+        bubble->messages.last()->date <= selectionEnd;
+}
+
+/** Returns the first and last rows which may hold selected bubbles,
+ *  or (-1, -1) if nothing is selected.
+ */
+QPair<int, int> HistoryModelPrivate::selectedRows() const
+{
+    if (!selectionStart.isValid() || messages.isEmpty())
+        return qMakePair(-1, -1);
+
+    QList<HistoryMessage*>::const_iterator first = std::lower_bound(messages.constBegin(), messages.constEnd(), selectionStart, historyMessageDateLessThan);
+    QList<HistoryMessage*>::const_iterator last = std::upper_bound(messages.constBegin(), messages.constEnd(), selectionEnd, historyDateLessThan);
+    if (first == messages.constEnd() || last == messages.constBegin())
+        return qMakePair(-1, -1);
+    return qMakePair(bubbles.value(*first)->row(), bubbles.value(*(last - 1))->row());
+}
+
+/** Evicts the oldest bubbles beyond maximumBubbles, keeping those around
+ *  the viewport.
+ *
+ * Evicted messages remain in the HistoryArchive and are fetched again as
+ * the previous page.
+ */
+void HistoryModelPrivate::trim()
+{
+    int count = q->rootItem->children.size() - maximumBubbles;
+    if (viewportRow >= 0)
+        count = qMin(count, viewportRow - 2 * HISTORY_PREFETCH_ROWS);
+    if (count <= 0 || account().isEmpty() || jid.isEmpty())
         return;
 
-    HistoryQueueItem item = messageQueue.takeFirst();
-    // FIXME: setting max to -2 is a hack!
-    client->archiveManager()->retrieveCollection(item.with, item.start, -2);
+    q->removeRows(0, count);
+    if (viewportRow >= 0)
+        viewportRow -= count;
+
+    localExhausted = false;
+    if (!hasPreviousPage) {
+        hasPreviousPage = true;
+        emit q->pagesChanged();
+    }
+}
+
+/** Returns true if a message with the same sender and body was already
+ *  received at about the same time.
+ */
+bool HistoryModelPrivate::isDuplicate(const HistoryMessage &message) const
+{
+    const QPair<QString, QString> key = qMakePair(message.jid, message.body);
+    QMultiHash<QPair<QString, QString>, HistoryMessage*>::const_iterator it = bodies.constFind(key);
+    while (it != bodies.constEnd() && it.key() == key) {
+        if (qAbs(message.date.msecsTo(it.value()->date)) < HISTORY_DUPLICATE_MSECS)
+            return true;
+        ++it;
+    }
+    return false;
 }
 
 /** Constructs a new HistoryModel.
@@ -231,7 +584,14 @@ void HistoryModelPrivate::fetchMessages()
 HistoryModel::HistoryModel(QObject *parent)
     : ChatModel(parent)
 {
+    bool check;
+    Q_UNUSED(check);
+
     d = new HistoryModelPrivate(this);
+
+    check = connect(VCardCache::instance(), SIGNAL(cardChanged(QString)),
+                    this, SLOT(_q_cardChanged(QString)));
+    Q_ASSERT(check);
 }
 
 /** Adds a message in the chat history.
@@ -250,6 +610,24 @@ void HistoryModel::addMessage(const HistoryMessage &message)
     emit bottomAboutToChange();
 
     addMessage_worker(message);
+    d->trim();
+
+    // notify bottom change
+    emit bottomChanged();
+}
+
+/** Adds several messages in the chat history.
+ *
+ * @param messages
+ */
+void HistoryModel::addMessages(const QList<HistoryMessage> &messages)
+{
+    // notify bottom is about to change
+    emit bottomAboutToChange();
+
+    beginBuffering();
+    addMessages_worker(messages);
+    endBuffering();
 
     // notify bottom change
     emit bottomChanged();
@@ -257,36 +635,21 @@ void HistoryModel::addMessage(const HistoryMessage &message)
 
 void HistoryModel::addMessage_worker(const HistoryMessage &message)
 {
-    // position cursor
-    HistoryItem *prevBubble = 0;
-    HistoryItem *nextBubble = 0;
-    HistoryMessage *prevMsg = 0;
-    HistoryMessage *nextMsg = 0;
-    foreach (ChatModelItem *bubblePtr, rootItem->children) {
-        HistoryItem *bubble = static_cast<HistoryItem*>(bubblePtr);
-        foreach (HistoryMessage *curMessage, bubble->messages) {
-
-            // check for duplicate
-            if (message.archived &&
-                message.jid == curMessage->jid &&
-                message.body == curMessage->body &&
-                message.date.msecsTo(curMessage->date) < 2000)
-                return;
-
-            // we use greater or equal comparison (and not strictly greater) dates
-            // because messages are usually received in chronological order
-            if (message.date >= curMessage->date) {
-                prevBubble = bubble;
-                prevMsg = curMessage;
-            } else if (!nextMsg) {
-                nextBubble = bubble;
-                nextMsg = curMessage;
-            }
-        }
-    }
+    // check for duplicate
+    if (message.archived && d->isDuplicate(message))
+        return;
+
+    // position cursor after any message with the same date, because
+    // messages are usually received in chronological order
+    const int pos = std::upper_bound(d->messages.begin(), d->messages.end(), message.date, historyDateLessThan) - d->messages.begin();
+    HistoryMessage *prevMsg = pos > 0 ? d->messages.at(pos - 1) : 0;
+    HistoryMessage *nextMsg = pos < d->messages.size() ? d->messages.at(pos) : 0;
+    HistoryItem *prevBubble = d->bubbles.value(prevMsg);
+    HistoryItem *nextBubble = d->bubbles.value(nextMsg);
 
     // prepare message
     HistoryMessage *msg = new HistoryMessage(message);
+    HistoryItem *msgBubble = 0;
 
     if (prevMsg && prevMsg->groupWith(message) &&
         nextMsg && nextMsg->groupWith(message) &&
@@ -298,9 +661,12 @@ void HistoryModel::addMessage_worker(const HistoryMessage &message)
         for (int i = lastRow; i >= 0; --i) {
             HistoryMessage *item = nextBubble->messages.takeAt(i);
             prevBubble->messages.insert(row, item);
+            d->bubbles.insert(item, prevBubble);
         }
+        d->senders[msg->jid].remove(nextBubble);
         removeRow(nextBubble->row());
         changeItem(prevBubble);
+        msgBubble = prevBubble;
     }
     else if (prevMsg && prevMsg->groupWith(message))
     {
@@ -308,6 +674,7 @@ void HistoryModel::addMessage_worker(const HistoryMessage &message)
         const int row = prevBubble->messages.indexOf(prevMsg) + 1;
         prevBubble->messages.insert(row, msg);
         changeItem(prevBubble);
+        msgBubble = prevBubble;
     }
     else if (nextMsg && nextMsg->groupWith(message))
     {
@@ -315,6 +682,7 @@ void HistoryModel::addMessage_worker(const HistoryMessage &message)
         const int row = nextBubble->messages.indexOf(nextMsg);
         nextBubble->messages.insert(row, msg);
         changeItem(nextBubble);
+        msgBubble = nextBubble;
     }
     else
     {
@@ -332,8 +700,11 @@ void HistoryModel::addMessage_worker(const HistoryMessage &message)
                 for (int i = lastRow; i >= firstRow; --i) {
                     HistoryMessage *item = prevBubble->messages.takeAt(i);
                     bubble->messages.prepend(item);
+                    d->bubbles.insert(item, bubble);
                 }
+                d->senders[prevMsg->jid].insert(bubble);
                 addItem(bubble, rootItem, bubblePos);
+                changeItem(prevBubble);
             }
         }
 
@@ -341,13 +712,88 @@ void HistoryModel::addMessage_worker(const HistoryMessage &message)
         HistoryItem *bubble = new HistoryItem;
         bubble->messages.append(msg);
         addItem(bubble, rootItem, bubblePos);
+        msgBubble = bubble;
     }
+    d->indexMessage(msg, pos, msgBubble);
 
     // notify message
     if (msg->received && !msg->archived)
         emit messageReceived(msg->jid, msg->body);
 }
 
+/** Adds a page of messages to the chat history.
+ *
+ * When the page lies entirely before or after the existing messages, the
+ * new bubbles are inserted at once. Archived messages which duplicate a
+ * message of the history or of the page itself are skipped.
+ *
+ * @param messages
+ */
+void HistoryModel::addMessages_worker(const QList<HistoryMessage> &messages)
+{
+    QList<HistoryMessage> page;
+    foreach (const HistoryMessage &message, messages) {
+        if (!message.archived || !d->isDuplicate(message))
+            page << message;
+    }
+    if (page.isEmpty())
+        return;
+    std::stable_sort(page.begin(), page.end(), historyMessageLessThan);
+
+    // drop archived messages which duplicate an earlier one of the page
+    QHash<QPair<QString, QString>, QDateTime> lastDates;
+    QList<HistoryMessage>::iterator it = page.begin();
+    while (it != page.end()) {
+        const QPair<QString, QString> key = qMakePair(it->jid, it->body);
+        QHash<QPair<QString, QString>, QDateTime>::iterator last = lastDates.find(key);
+        if (last != lastDates.end() && it->archived &&
+            last.value().msecsTo(it->date) < HISTORY_DUPLICATE_MSECS) {
+            it = page.erase(it);
+        } else {
+            lastDates.insert(key, it->date);
+            ++it;
+        }
+    }
+
+    const bool append = d->messages.isEmpty() || page.first().date >= d->messages.last()->date;
+    const bool prepend = !append && page.last().date < d->messages.first()->date;
+    if (!append && !prepend) {
+        foreach (const HistoryMessage &message, page)
+            addMessage_worker(message);
+        return;
+    }
+
+    // messages which join an existing bubble are added individually
+    if (append) {
+        while (!page.isEmpty() && !d->messages.isEmpty() && d->messages.last()->groupWith(page.first()))
+            addMessage_worker(page.takeFirst());
+    } else {
+        while (!page.isEmpty() && page.last().groupWith(*d->messages.first()))
+            addMessage_worker(page.takeLast());
+    }
+
+    // group the remaining messages into new bubbles
+    QList<ChatModelItem*> newBubbles;
+    HistoryItem *bubble = 0;
+    int pos = append ? d->messages.size() : 0;
+    foreach (const HistoryMessage &message, page) {
+        HistoryMessage *msg = new HistoryMessage(message);
+        if (!bubble || !bubble->messages.last()->groupWith(*msg)) {
+            bubble = new HistoryItem;
+            newBubbles << bubble;
+        }
+        bubble->messages << msg;
+        d->indexMessage(msg, pos++, bubble);
+    }
+    addItems(newBubbles, rootItem, append ? -1 : 0);
+
+    // notify messages
+    foreach (const HistoryMessage &message, page) {
+        if (message.received && !message.archived)
+            emit messageReceived(message.jid, message.body);
+    }
+}
+
 /** Clears all messages.
  */
 void HistoryModel::clear()
@@ -358,8 +804,11 @@ void HistoryModel::clear()
         removeRows(0, rows);
 
     // clear archives
-    if (d->client && !d->jid.isEmpty())
+    if (d->client && !d->jid.isEmpty()) {
         d->client->archiveManager()->removeCollections(d->jid);
+        HistoryArchive::instance()->removeMessages(d->account(), d->jid);
+    }
+    d->localExhausted = true;
 }
 
 /** Fetches the next page.
@@ -370,25 +819,98 @@ void HistoryModel::fetchNextPage()
     QXmppResultSetQuery rsmQuery;
     rsmQuery.setAfter(d->archiveLast);
     rsmQuery.setMax(HISTORY_PAGE);
-    d->client->archiveManager()->listCollections(d->jid,
-        d->client->serverTime().addDays(-HISTORY_DAYS), QDateTime(), rsmQuery);
+    d->listId = HistoryListObserver::instance(d->client)->listCollections(d->jid,
+        d->client->serverTime().addDays(-HISTORY_DAYS), rsmQuery);
 }
 
 /** Fetches the previous page.
  */
 void HistoryModel::fetchPreviousPage()
 {
+    if (d->pageRequested)
+        return;
+
     if (d->hasPreviousPage) {
         d->hasPreviousPage = false;
         emit pagesChanged();
     }
 
-    d->pageDirection = PageBackwards;
-    QXmppResultSetQuery rsmQuery;
-    rsmQuery.setBefore(d->archiveFirst);
-    rsmQuery.setMax(HISTORY_PAGE);
-    d->client->archiveManager()->listCollections(d->jid,
-        d->client->serverTime().addDays(-HISTORY_DAYS), QDateTime(), rsmQuery);
+    // stored messages come first
+    if (d->fetchLocalPage()) {
+        d->hasPreviousPage = true;
+        emit pagesChanged();
+        return;
+    }
+
+    if (d->client)
+        d->fetchServerPage(d->client->serverTime().addDays(-HISTORY_DAYS));
+}
+
+/** Tells the model which row is at the top of the viewport.
+ *
+ * The previous page is fetched ahead of time when the row nears the top
+ * of the history, and bubbles beyond maximumBubbles are evicted when it
+ * is far enough from the top.
+ *
+ * @param row the topmost visible row
+ */
+void HistoryModel::prefetch(int row)
+{
+    if (row < 0)
+        return;
+
+    d->viewportRow = row;
+    if (row < HISTORY_PREFETCH_ROWS && d->hasPreviousPage && !d->pageRequested)
+        fetchPreviousPage();
+    else
+        d->trim();
+}
+
+/** Returns the number of messages held in memory.
+ */
+int HistoryModel::messageCount() const
+{
+    return d->messages.size();
+}
+
+/** Returns the maximum number of bubbles kept in memory while the
+ *  viewport is away from the top.
+ */
+int HistoryModel::maximumBubbles() const
+{
+    return d->maximumBubbles;
+}
+
+void HistoryModel::setMaximumBubbles(int maximumBubbles)
+{
+    if (maximumBubbles != d->maximumBubbles) {
+        d->maximumBubbles = maximumBubbles;
+        emit maximumBubblesChanged(d->maximumBubbles);
+        d->trim();
+    }
+}
+
+/** Shows the messages stored locally for the given account, without
+ *  retrieving the server's archives.
+ *
+ * This is used for chat rooms, which have no client.
+ *
+ * @param account the bare JID of the local account
+ */
+void HistoryModel::setLocalAccount(const QString &account)
+{
+    if (account == d->localAccount)
+        return;
+
+    d->localAccount = account;
+    if (!d->client && !d->jid.isEmpty()) {
+        d->localExhausted = false;
+        d->fetchLocalPage();
+        if (d->hasPreviousPage != !d->localExhausted) {
+            d->hasPreviousPage = !d->localExhausted;
+            emit pagesChanged();
+        }
+    }
 }
 
 ChatClient *HistoryModel::client() const
@@ -485,14 +1007,7 @@ QVariant HistoryModel::data(const QModelIndex &index, int role) const
             return resource;
 
         // conversations
-        if (!d->rosterCards.contains(jid)) {
-            VCard *card = new VCard((QObject*)this);
-            card->setJid(jid);
-            connect(card, SIGNAL(nameChanged(QString)),
-                    this, SLOT(_q_cardChanged()));
-            d->rosterCards.insert(jid, card);
-        }
-        return d->rosterCards.value(jid)->name();
+        return VCardCache::instance()->name(jid);
     } else if (role == HtmlRole) {
         const QString meName = data(index, FromRole).toString();
         QString bodies;
@@ -504,12 +1019,30 @@ QVariant HistoryModel::data(const QModelIndex &index, int role) const
     } else if (role == ReceivedRole) {
         return msg->received;
     } else if (role == SelectedRole) {
-        return item->selected;
+        return d->isSelected(item);
     }
 
     return QVariant();
 }
 
+bool HistoryModel::removeRows(int row, int count, const QModelIndex &parent)
+{
+    if (!parent.isValid()) {
+        const int first = qMax(0, row);
+        const int last = qMin(row + count, rootItem->children.size()) - 1;
+        if (first == 0 && last == rootItem->children.size() - 1) {
+            d->messages.clear();
+            d->bubbles.clear();
+            d->bodies.clear();
+            d->senders.clear();
+        } else {
+            for (int i = first; i <= last; ++i)
+                d->unindexBubble(static_cast<HistoryItem*>(rootItem->children.at(i)));
+        }
+    }
+    return ChatModel::removeRows(row, count, parent);
+}
+
 QHash<int, QByteArray> HistoryModel::roleNames() const
 {
     QHash<int, QByteArray> roleNames;
@@ -525,34 +1058,52 @@ QHash<int, QByteArray> HistoryModel::roleNames() const
     return roleNames;
 }
 
+/** Selects the bubbles between the given rows, or clears the selection
+ *  if a row is negative.
+ *
+ * The selection is held as a range of dates, so that it follows the
+ * bubbles as rows are inserted or evicted.
+ *
+ * @param from
+ * @param to
+ */
 void HistoryModel::select(int from, int to)
 {
+    const int rows = rootItem->children.size();
     const int lo = qMin(from, to);
-    const int hi = qMax(from, to);
-
-    int i = 0;
-    foreach (ChatModelItem *it, rootItem->children) {
-        HistoryItem *item = static_cast<HistoryItem*>(it);
-        const bool selected = (i >= lo && i <= hi);
-        if (selected != item->selected) {
-            item->selected = selected;
-            changeItem(item);
-        }
-        ++i;
+    const int hi = qMin(qMax(from, to), rows - 1);
+    const QPair<int, int> oldRows = d->selectedRows();
+
+    if (lo < 0 || lo > hi) {
+        d->selectionStart = QDateTime();
+        d->selectionEnd = QDateTime();
+    } else {
+        d->selectionStart = static_cast<HistoryItem*>(rootItem->children.at(lo))->messages.first()->date;
+        d->selectionEnd = static_cast<HistoryItem*>(rootItem->children.at(hi))->messages.last()->date;
+    }
+    const QPair<int, int> newRows = d->selectedRows();
+
+    // only the bubbles of the old and new selections may have changed
+    beginBuffering();
+    QList<QPair<int, int> > ranges;
+    ranges << oldRows << newRows;
+    foreach (const QPair<int, int> &range, ranges) {
+        for (int i = qMax(0, range.first); i <= range.second && i < rows; ++i)
+            changeItem(rootItem->children.at(i), QVector<int>() << SelectedRole);
     }
+    endBuffering();
 }
 
-void HistoryModel::_q_cardChanged()
+void HistoryModel::_q_cardChanged(const QString &jid)
 {
-    VCard *card = qobject_cast<VCard*>(sender());
-    if (!card)
+    const QSet<HistoryItem*> items = d->senders.value(jid);
+    if (items.isEmpty())
         return;
-    const QString jid = card->jid();
-    foreach (ChatModelItem *it, rootItem->children) {
-        HistoryItem *item = static_cast<HistoryItem*>(it);
-        if (item->messages.first()->jid == jid)
-            changeItem(item);
-    }
+
+    beginBuffering();
+    foreach (HistoryItem *item, items)
+        changeItem(item, QVector<int>() << FromRole << HtmlRole);
+    endBuffering();
 }
 
 void HistoryModel::_q_archiveChatReceived(const QXmppArchiveChat &chat, const QXmppResultSetReply &rsmReply)
@@ -563,10 +1114,13 @@ void HistoryModel::_q_archiveChatReceived(const QXmppArchiveChat &chat, const QX
     if (QXmppUtils::jidToBareJid(chat.with()) != d->jid)
         return;
 
+    if (d->pendingCollections > 0)
+        d->pendingCollections--;
+
     // notify bottom is about to change
     emit bottomAboutToChange();
 
-    beginBuffering();
+    QList<HistoryMessage> messages;
     foreach (const QXmppArchiveMessage &msg, chat.messages()) {
         if (msg.body().isEmpty())
             continue;
@@ -577,8 +1131,15 @@ void HistoryModel::_q_archiveChatReceived(const QXmppArchiveChat &chat, const QX
         message.date = msg.date();
         message.jid = msg.isReceived() ? QXmppUtils::jidToBareJid(chat.with()) : d->client->configuration().jidBare();
         message.received = msg.isReceived();
-        addMessage_worker(message);
+        messages << message;
     }
+    HistoryArchive::instance()->addMessages(d->account(), d->jid, messages);
+    d->collectionsReceived++;
+    d->messagesReceived += messages.size();
+    d->pageMessages += messages.size();
+
+    beginBuffering();
+    addMessages_worker(messages);
     endBuffering();
 
     // notify bottom change
@@ -592,8 +1153,22 @@ void HistoryModel::_q_archiveListReceived(const QList<QXmppArchiveChat> &chats,
 {
     Q_ASSERT(d->client);
 
-    if (chats.isEmpty() || QXmppUtils::jidToBareJid(chats.first().with()) != d->jid)
+    // every model receives the lists requested by the others
+    if (d->listId.isEmpty() || HistoryListObserver::instance(d->client)->currentId() != d->listId)
         return;
+    d->listId.clear();
+
+    if (chats.isEmpty()) {
+        // the server holds no more collections
+        const bool hasPreviousPage = !d->localExhausted || d->deltaSync;
+        d->deltaSync = false;
+        if (hasPreviousPage != d->hasPreviousPage) {
+            d->hasPreviousPage = hasPreviousPage;
+            emit pagesChanged();
+        }
+        d->fetchMessages();
+        return;
+    }
 
     // update boundaries
     if (d->archiveFirst.isEmpty() || d->pageDirection == PageBackwards)
@@ -602,7 +1177,9 @@ void HistoryModel::_q_archiveListReceived(const QList<QXmppArchiveChat> &chats,
         d->archiveLast = rsmReply.last();
 
     //qDebug("received page %i - %i (of 0 - %i)", rsmReply.index(), rsmReply.index() + chats.size() - 1, rsmReply.count() - 1);
-    const bool hasPreviousPage = rsmReply.index() > 0;
+    // after a partial synchronisation, the server may hold older collections
+    const bool hasPreviousPage = rsmReply.index() > 0 || !d->localExhausted || d->deltaSync;
+    d->deltaSync = false;
     if (hasPreviousPage != d->hasPreviousPage) {
         d->hasPreviousPage = hasPreviousPage;
         emit pagesChanged();
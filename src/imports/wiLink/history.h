@@ -24,9 +24,12 @@
 #include <QTextCursor>
 #include <QTextDocument>
 
+#include "QXmppClientExtension.h"
+
 #include "model.h"
 
 class QXmppArchiveChat;
+class QXmppResultSetQuery;
 class QXmppResultSetReply;
 class QUrl;
 
@@ -34,6 +37,27 @@ class ChatClient;
 class HistoryModel;
 class HistoryModelPrivate;
 
+/** The HistoryListObserver class records the id of the archive list
+ *  response being handled, so that a HistoryModel can tell whether the
+ *  QXmppArchiveManager::archiveListReceived() signal answers its request.
+ */
+class HistoryListObserver : public QXmppClientExtension
+{
+    Q_OBJECT
+
+public:
+    static HistoryListObserver *instance(ChatClient *client);
+
+    QString currentId() const;
+    QString listCollections(const QString &jid, const QDateTime &start, const QXmppResultSetQuery &rsmQuery);
+
+    // QXmppClientExtension
+    bool handleStanza(const QDomElement &stanza);
+
+private:
+    QString m_currentId;
+};
+
 /** The HistoryMessage class represents the data for a single chat history message.
  */
 class HistoryMessage
@@ -51,6 +75,13 @@ public:
     QDateTime date;
     QString jid;
     bool received;
+
+private:
+    // cached HTML, along with the inputs it was rendered from
+    mutable QString m_html;
+    mutable QString m_htmlBody;
+    mutable QString m_htmlMeName;
+    mutable int m_htmlGeneration;
 };
 
 /** The HistoryModel class represents a conversation history with
@@ -62,6 +93,7 @@ class HistoryModel : public ChatModel
     Q_PROPERTY(bool hasPreviousPage READ hasPreviousPage NOTIFY pagesChanged)
     Q_PROPERTY(ChatClient* client READ client WRITE setClient NOTIFY clientChanged)
     Q_PROPERTY(QString jid READ jid WRITE setJid NOTIFY jidChanged)
+    Q_PROPERTY(int maximumBubbles READ maximumBubbles WRITE setMaximumBubbles NOTIFY maximumBubblesChanged)
 
 public:
     enum HistoryRole {
@@ -76,6 +108,7 @@ public:
 
     HistoryModel(QObject *parent = 0);
     void addMessage(const HistoryMessage &message);
+    void addMessages(const QList<HistoryMessage> &messages);
 
     ChatClient *client() const;
     void setClient(ChatClient *client);
@@ -85,9 +118,17 @@ public:
     QString jid() const;
     void setJid(const QString &jid);
 
+    void setLocalAccount(const QString &account);
+
+    int maximumBubbles() const;
+    void setMaximumBubbles(int maximumBubbles);
+
+    int messageCount() const;
+
     // QAbstractItemModel
     int columnCount(const QModelIndex &parent = QModelIndex()) const;
     QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    bool removeRows(int row, int count, const QModelIndex &parent = QModelIndex());
     QHash<int, QByteArray> roleNames() const;
 
 signals:
@@ -95,7 +136,9 @@ signals:
     void bottomAboutToChange();
     void clientChanged(ChatClient *client);
     void jidChanged(const QString &jid);
+    void maximumBubblesChanged(int maximumBubbles);
     void messageReceived(const QString &jid, const QString &text);
+    void pageFetched(int messages, int msecs);
     void pagesChanged();
     void participantModelChanged(QObject *participantModel);
 
@@ -103,15 +146,17 @@ public slots:
     void clear();
     void fetchNextPage();
     void fetchPreviousPage();
+    void prefetch(int row);
     void select(int from, int to);
 
 private slots:
-    void _q_cardChanged();
+    void _q_cardChanged(const QString &jid);
     void _q_archiveChatReceived(const QXmppArchiveChat &chat, const QXmppResultSetReply &rsmReply);
     void _q_archiveListReceived(const QList<QXmppArchiveChat> &chats, const QXmppResultSetReply &rsmReply);
 
 private:
     void addMessage_worker(const HistoryMessage &message);
+    void addMessages_worker(const QList<HistoryMessage> &messages);
     friend class HistoryModelPrivate;
     HistoryModelPrivate *d;
 };
@@ -17,10 +17,57 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
+#include <QJSValue>
+#include <QMap>
+#include <QQmlEngine>
+
 #include "model.h"
 
+// role names of a model class, along with the reverse mapping
+class ChatModelRoles
+{
+public:
+    QHash<int, QByteArray> names;
+    QHash<QByteArray, int> roles;
+};
+
+typedef QHash<const QMetaObject*, ChatModelRoles> ChatModelRolesCache;
+Q_GLOBAL_STATIC(ChatModelRolesCache, rolesCache)
+
+// given the role names, returns a constructor for objects whose properties
+// are read from a model item on access
+static const char *proxyFactory =
+    "(function(names) {\n"
+    "    return function(handle) {\n"
+    "        var item = {};\n"
+    "        Object.defineProperty(item, 'index', {\n"
+    "            enumerable: true,\n"
+    "            get: function() { return handle.row(); }\n"
+    "        });\n"
+    "        names.forEach(function(name) {\n"
+    "            Object.defineProperty(item, name, {\n"
+    "                enumerable: true,\n"
+    "                get: function() { return handle.data(name); }\n"
+    "            });\n"
+    "        });\n"
+    "        return item;\n"
+    "    };\n"
+    "})";
+
+class ChatModelChangeGroup
+{
+public:
+    ChatModelItem *parent;
+    QVector<int> roles;
+    QList<int> rows;
+};
+
 ChatModelItem::ChatModelItem()
     : parent(0)
+    , m_row(-1)
+    , m_validRows(0)
 {
 }
 
@@ -30,11 +77,107 @@ ChatModelItem::~ChatModelItem()
         delete item;
 }
 
+/** Marks the cached row numbers of the children starting at the given row
+ *  as stale.
+ */
+void ChatModelItem::invalidateRows(int from)
+{
+    m_validRows = qMin(m_validRows, from);
+}
+
+/** Returns the item's row within its parent.
+ *
+ * Row numbers are cached and only recomputed for the siblings which
+ * follow an insertion or removal, so this is constant time in the usual
+ * case.
+ */
 int ChatModelItem::row() const
 {
     if (!parent)
         return -1;
-    return parent->children.indexOf((ChatModelItem*)this);
+
+    const QList<ChatModelItem*> &siblings = parent->children;
+    if (m_row >= 0 && m_row < siblings.size() && siblings.at(m_row) == this)
+        return m_row;
+
+    // renumber the siblings which follow the last valid row
+    for (int i = qMin(parent->m_validRows, siblings.size()); i < siblings.size(); ++i) {
+        siblings.at(i)->m_row = i;
+        if (siblings.at(i) == this) {
+            parent->m_validRows = i + 1;
+            return i;
+        }
+    }
+
+    // the children were modified directly, renumber them all
+    for (int i = 0; i < siblings.size(); ++i)
+        siblings.at(i)->m_row = i;
+    parent->m_validRows = siblings.size();
+    return siblings.value(m_row) == this ? m_row : -1;
+}
+
+ChatModelProxyCache::ChatModelProxyCache(QQmlEngine *engine)
+    : QObject(engine)
+    , m_engine(engine)
+{
+}
+
+/** Returns the cache of the given engine, creating it if needed.
+ *
+ * The cache is a child of the engine, so that it is destroyed along with
+ * it and a new engine starts with an empty cache.
+ *
+ * @param engine
+ */
+ChatModelProxyCache *ChatModelProxyCache::instance(QQmlEngine *engine)
+{
+    ChatModelProxyCache *cache = engine->findChild<ChatModelProxyCache*>(QString(), Qt::FindDirectChildrenOnly);
+    if (!cache)
+        cache = new ChatModelProxyCache(engine);
+    return cache;
+}
+
+/** Returns the proxy constructor for the given model class, creating it if
+ *  needed.
+ *
+ * @param metaObject
+ * @param roles
+ */
+QJSValue ChatModelProxyCache::factory(const QMetaObject *metaObject, const ChatModelRoles &roles)
+{
+    QHash<const QMetaObject*, QJSValue>::iterator it = m_factories.find(metaObject);
+    if (it == m_factories.end()) {
+        QJSValue names = m_engine->newArray(roles.roles.size());
+        int i = 0;
+        foreach (const QByteArray &name, roles.roles.keys())
+            names.setProperty(i++, QString::fromLatin1(name));
+
+        it = m_factories.insert(metaObject, m_engine->evaluate(QLatin1String(proxyFactory)).call(QJSValueList() << names));
+    }
+    return *it;
+}
+
+ChatModelItemHandle::ChatModelItemHandle(const QModelIndex &index)
+    : m_index(index)
+{
+}
+
+/** Returns the given role of the item, or an invalid value if the item
+ *  was removed.
+ *
+ * @param name
+ */
+QVariant ChatModelItemHandle::data(const QString &name) const
+{
+    const ChatModel *model = qobject_cast<const ChatModel*>(m_index.model());
+    return model ? model->dataForName(m_index, name) : QVariant();
+}
+
+/** Returns the item's current row, or -1 if the item was removed.
+ */
+int ChatModelItemHandle::row() const
+{
+    return m_index.row();
 }
 
 ChatModel::ChatModel(QObject *parent)
@@ -79,6 +222,38 @@ void ChatModel::addItem(ChatModelItem *item, ChatModelItem *parentItem, int pos)
     beginInsertRows(createIndex(parentItem, 0), pos, pos);
     item->parent = parentItem;
     parentItem->children.insert(pos, item);
+    parentItem->invalidateRows(pos);
+    endInsertRows();
+}
+
+/** Inserts several items at the given position, emitting a single row
+ *  insertion.
+ *
+ * @param items
+ * @param parentItem
+ * @param pos
+ */
+void ChatModel::addItems(const QList<ChatModelItem*> &items, ChatModelItem *parentItem, int pos)
+{
+    if (items.isEmpty())
+        return;
+
+    // emit any pending changes
+    emitChanges();
+
+    QList<ChatModelItem*> &children = parentItem->children;
+    if (pos < 0 || pos > children.size())
+        pos = children.size();
+    beginInsertRows(createIndex(parentItem, 0), pos, pos + items.size() - 1);
+    foreach (ChatModelItem *item, items) {
+        Q_ASSERT(!item->parent);
+        item->parent = parentItem;
+    }
+    if (pos == children.size())
+        children += items;
+    else
+        children = children.mid(0, pos) + items + children.mid(pos);
+    parentItem->invalidateRows(pos);
     endInsertRows();
 }
 
@@ -87,16 +262,50 @@ void ChatModel::beginBuffering()
     m_buffering = true;
 }
 
+/** Emits the buffered changes, combining the items which have the same
+ *  parent and changed roles into ranges of contiguous rows.
+ */
 void ChatModel::emitChanges()
 {
-    if (!m_changedItems.isEmpty()) {
-        //qDebug("combined %i changes into %i", m_changedCount, m_changedItems.size());
-        foreach (ChatModelItem *item, m_changedItems) {
-            const QModelIndex index = createIndex(item);
-            emit dataChanged(index, index);
+    if (m_changedItems.isEmpty())
+        return;
+
+    const QHash<ChatModelItem*, QVector<int> > changedItems = m_changedItems;
+    m_changedCount = 0;
+    m_changedItems.clear();
+
+    // group rows by parent and changed roles
+    QList<ChatModelChangeGroup> groups;
+    QHash<ChatModelItem*, QVector<int> >::const_iterator it;
+    for (it = changedItems.constBegin(); it != changedItems.constEnd(); ++it) {
+        ChatModelItem *item = it.key();
+        int i = 0;
+        while (i < groups.size() && (groups[i].parent != item->parent || groups[i].roles != it.value()))
+            ++i;
+        if (i == groups.size()) {
+            ChatModelChangeGroup group;
+            group.parent = item->parent;
+            group.roles = it.value();
+            groups << group;
+        }
+        groups[i].rows << item->row();
+    }
+
+    // emit one signal per range of rows
+    //qDebug("combined %i changes into %i groups", changedItems.size(), groups.size());
+    foreach (ChatModelChangeGroup group, groups) {
+        std::sort(group.rows.begin(), group.rows.end());
+        const QModelIndex parentIndex = createIndex(group.parent);
+        int first = 0;
+        while (first < group.rows.size()) {
+            int last = first;
+            while (last + 1 < group.rows.size() && group.rows.at(last + 1) == group.rows.at(last) + 1)
+                ++last;
+            emit dataChanged(index(group.rows.at(first), 0, parentIndex),
+                             index(group.rows.at(last), 0, parentIndex),
+                             group.roles);
+            first = last + 1;
         }
-        m_changedCount = 0;
-        m_changedItems.clear();
     }
 }
 
@@ -108,14 +317,36 @@ void ChatModel::endBuffering()
     m_buffering = false;
 }
 
-void ChatModel::changeItem(ChatModelItem *item)
+/** Notifies views that an item changed.
+ *
+ * While buffering, changes are accumulated until endBuffering() is called.
+ *
+ * @param item
+ * @param roles the roles which changed, or an empty list if all roles changed
+ */
+void ChatModel::changeItem(ChatModelItem *item, const QVector<int> &roles)
 {
     if (m_buffering) {
         m_changedCount++;
-        m_changedItems << item;
+        QHash<ChatModelItem*, QVector<int> >::iterator it = m_changedItems.find(item);
+        if (it == m_changedItems.end()) {
+            QVector<int> &changed = m_changedItems[item];
+            changed = roles;
+            std::sort(changed.begin(), changed.end());
+        } else if (!it->isEmpty()) {
+            if (roles.isEmpty()) {
+                it->clear();
+            } else {
+                foreach (int role, roles) {
+                    QVector<int>::iterator pos = std::lower_bound(it->begin(), it->end(), role);
+                    if (pos == it->end() || *pos != role)
+                        it->insert(pos, role);
+                }
+            }
+        }
     } else {
         const QModelIndex index = createIndex(item);
-        emit dataChanged(index, index);
+        emit dataChanged(index, index, roles);
     }
 }
 
@@ -133,30 +364,81 @@ QModelIndex ChatModel::createIndex(ChatModelItem *item, int column) const
         return QModelIndex();
 }
 
-QVariant ChatModel::get(int row) const
+/** Returns the role names of the model's class, computing them on first
+ *  use.
+ */
+const ChatModelRoles &ChatModel::cachedRoles() const
 {
-    const QModelIndex idx = index(row, 0);
-    if (idx.isValid()) {
-        QVariantMap result;
-        const QHash<int, QByteArray> roleMap = roleNames();
-        foreach (int role, roleMap.keys()) {
-            const QString name = QString::fromLatin1(roleMap.value(role));
-            result.insert(name, idx.data(role));
-        }
-        result.insert("index", row);
-        return result;
+    ChatModelRolesCache *cache = rolesCache();
+    ChatModelRolesCache::iterator it = cache->find(metaObject());
+    if (it == cache->end()) {
+        ChatModelRoles roles;
+        roles.names = roleNames();
+        QHash<int, QByteArray>::const_iterator name;
+        for (name = roles.names.constBegin(); name != roles.names.constEnd(); ++name)
+            roles.roles.insert(name.value(), name.key());
+        it = cache->insert(metaObject(), roles);
+    }
+    return *it;
+}
+
+/** Returns the role with the given name for the item at the given index.
+ *
+ * @param index
+ * @param name
+ */
+QVariant ChatModel::dataForName(const QModelIndex &index, const QString &name) const
+{
+    if (index.isValid()) {
+        const QHash<QByteArray, int> &roles = cachedRoles().roles;
+        QHash<QByteArray, int>::const_iterator it = roles.find(name.toLatin1());
+        if (it != roles.constEnd())
+            return data(index, it.value());
     }
     return QVariant();
 }
 
-QVariant ChatModel::getProperty(int row, const QString &name) const
+/** Returns the item at the given row, as an object with one property per
+ *  role.
+ *
+ * When the model is used from QML, the properties are only read from the
+ * model when they are accessed, and they keep referring to the same item
+ * when rows are inserted, removed or moved.
+ *
+ * @param row
+ */
+QVariant ChatModel::get(int row) const
 {
     const QModelIndex idx = index(row, 0);
-    if (idx.isValid()) {
-        const int role = roleNames().key(name.toLatin1());
-        return idx.data(role);
+    if (!idx.isValid())
+        return QVariant();
+
+    const ChatModelRoles &roles = cachedRoles();
+
+    // models without a parent would be handed over to the JavaScript engine
+    QQmlEngine *engine = 0;
+    for (const QObject *obj = this; obj && !engine; obj = obj->parent())
+        engine = qmlEngine(obj);
+    if (engine && parent()) {
+        QJSValue factory = ChatModelProxyCache::instance(engine)->factory(metaObject(), roles);
+
+        // the handle is owned by the JavaScript engine
+        QJSValueList args;
+        args << engine->newQObject(new ChatModelItemHandle(idx));
+        return QVariant::fromValue(factory.call(args));
     }
-    return QVariant();
+
+    QVariantMap result;
+    QHash<int, QByteArray>::const_iterator it;
+    for (it = roles.names.constBegin(); it != roles.names.constEnd(); ++it)
+        result.insert(QString::fromLatin1(it.value()), idx.data(it.key()));
+    result.insert("index", row);
+    return result;
+}
+
+QVariant ChatModel::getProperty(int row, const QString &name) const
+{
+    return dataForName(index(row, 0), name);
 }
 
 QModelIndex ChatModel::index(int row, int column, const QModelIndex &parent) const
@@ -177,6 +459,32 @@ QModelIndex ChatModel::parent(const QModelIndex &index) const
     return createIndex(item->parent);
 }
 
+/** Moves an item to the given row within its parent, so that views can
+ *  keep the item's delegate.
+ *
+ * @param item
+ * @param pos the item's row once it has been moved
+ */
+void ChatModel::moveItem(ChatModelItem *item, int pos)
+{
+    Q_ASSERT(item && item->parent);
+
+    // emit any pending changes
+    emitChanges();
+
+    ChatModelItem *parentItem = item->parent;
+    const int row = item->row();
+    pos = qBound(0, pos, parentItem->children.size() - 1);
+    if (pos == row)
+        return;
+
+    const QModelIndex parentIndex = createIndex(parentItem, 0);
+    beginMoveRows(parentIndex, row, row, parentIndex, pos > row ? pos + 1 : pos);
+    parentItem->children.move(row, pos);
+    parentItem->invalidateRows(qMin(row, pos));
+    endMoveRows();
+}
+
 bool ChatModel::removeRows(int row, int count, const QModelIndex &parent)
 {
     ChatModelItem *parentItem = parent.isValid() ? static_cast<ChatModelItem*>(parent.internalPointer()) : rootItem;
@@ -186,11 +494,15 @@ bool ChatModel::removeRows(int row, int count, const QModelIndex &parent)
 
     const int minIndex = qMax(0, row);
     const int maxIndex = qMin(row + count, parentItem->children.size()) - 1;
+    if (minIndex > maxIndex)
+        return false;
+
     beginRemoveRows(parent, minIndex, maxIndex);
-    for (int i = maxIndex; i >= minIndex; --i) {
-        ChatModelItem *item = parentItem->children.takeAt(i);
-        delete item;
-    }
+    QList<ChatModelItem*> &children = parentItem->children;
+    const QList<ChatModelItem*> removed = children.mid(minIndex, maxIndex - minIndex + 1);
+    children = children.mid(0, minIndex) + children.mid(maxIndex + 1);
+    parentItem->invalidateRows(minIndex);
+    qDeleteAll(removed);
     endRemoveRows();
 
     return true;
@@ -199,12 +511,49 @@ bool ChatModel::removeRows(int row, int count, const QModelIndex &parent)
 void ChatModel::removeItem(ChatModelItem *item)
 {
     Q_ASSERT(item && item->parent);
-    beginRemoveRows(createIndex(item->parent, 0), item->row(), item->row());
-    item->parent->children.removeAll(item);
+
+    // emit any pending changes
+    emitChanges();
+
+    const int row = item->row();
+    beginRemoveRows(createIndex(item->parent, 0), row, row);
+    item->parent->children.removeAt(row);
+    item->parent->invalidateRows(row);
     delete item;
     endRemoveRows();
 }
 
+/** Removes several items, emitting a single row removal for each
+ *  contiguous range of rows.
+ *
+ * @param items
+ */
+void ChatModel::removeItems(const QList<ChatModelItem*> &items)
+{
+    // group the rows to remove by parent
+    QMap<ChatModelItem*, QList<int> > rowsByParent;
+    foreach (ChatModelItem *item, items) {
+        Q_ASSERT(item && item->parent);
+        rowsByParent[item->parent] << item->row();
+    }
+
+    QMap<ChatModelItem*, QList<int> >::iterator it;
+    for (it = rowsByParent.begin(); it != rowsByParent.end(); ++it) {
+        QList<int> &rows = it.value();
+        std::sort(rows.begin(), rows.end());
+
+        // remove ranges starting from the end, so rows stay valid
+        int last = rows.size() - 1;
+        while (last >= 0) {
+            int first = last;
+            while (first > 0 && rows.at(first - 1) >= rows.at(first) - 1)
+                --first;
+            removeRows(rows.at(first), rows.at(last) - rows.at(first) + 1, createIndex(it.key(), 0));
+            last = first - 1;
+        }
+    }
+}
+
 int ChatModel::rowCount(const QModelIndex &parent) const
 {
     ChatModelItem *parentItem = parent.isValid() ? static_cast<ChatModelItem*>(parent.internalPointer()) : rootItem;
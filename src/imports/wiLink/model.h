@@ -21,7 +21,14 @@
 #define CHAT_MODEL_H
 
 #include <QAbstractItemModel>
+#include <QHash>
+#include <QJSValue>
+#include <QPersistentModelIndex>
 #include <QSet>
+#include <QVector>
+
+class QQmlEngine;
+class ChatModelRoles;
 
 class ChatModelItem
 {
@@ -35,6 +42,48 @@ public:
 
 private:
     friend class ChatModel;
+    void invalidateRows(int from);
+
+    // cached row number, verified before use
+    mutable int m_row;
+    // number of leading children whose cached row is known to be valid
+    mutable int m_validRows;
+};
+
+/** Per-engine cache of the constructors of the objects which
+ *  ChatModel::get() hands over to QML, one for each model class.
+ */
+class ChatModelProxyCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    static ChatModelProxyCache *instance(QQmlEngine *engine);
+    QJSValue factory(const QMetaObject *metaObject, const ChatModelRoles &roles);
+
+private:
+    ChatModelProxyCache(QQmlEngine *engine);
+
+    QQmlEngine *m_engine;
+    QHash<const QMetaObject*, QJSValue> m_factories;
+};
+
+/** Reference to a model item which follows the item when rows are
+ *  inserted, removed or moved, used by the objects which ChatModel::get()
+ *  hands over to QML.
+ */
+class ChatModelItemHandle : public QObject
+{
+    Q_OBJECT
+
+public:
+    ChatModelItemHandle(const QModelIndex &index);
+
+    Q_INVOKABLE QVariant data(const QString &name) const;
+    Q_INVOKABLE int row() const;
+
+private:
+    QPersistentModelIndex m_index;
 };
 
 /** Base class for tree-like models to avoid some of the tedium of
@@ -74,9 +123,12 @@ public slots:
 
 protected:
     void addItem(ChatModelItem *item, ChatModelItem *parentItem, int pos = -1);
-    void changeItem(ChatModelItem *item);
+    void addItems(const QList<ChatModelItem*> &items, ChatModelItem *parentItem, int pos = -1);
+    void changeItem(ChatModelItem *item, const QVector<int> &roles = QVector<int>());
     QModelIndex createIndex(ChatModelItem *item, int column = 0) const;
+    void moveItem(ChatModelItem *item, int pos);
     void removeItem(ChatModelItem *item);
+    void removeItems(const QList<ChatModelItem*> &items);
 
     void beginBuffering();
     void endBuffering();
@@ -84,11 +136,15 @@ protected:
     ChatModelItem *rootItem;
 
 private:
+    friend class ChatModelItemHandle;
+    const ChatModelRoles &cachedRoles() const;
+    QVariant dataForName(const QModelIndex &index, const QString &name) const;
     void emitChanges();
 
     bool m_buffering;
     int m_changedCount;
-    QSet<ChatModelItem*> m_changedItems;
+    // changed roles for each item, an empty list meaning all roles
+    QHash<ChatModelItem*, QVector<int> > m_changedItems;
 };
 
 #endif
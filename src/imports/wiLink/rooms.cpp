@@ -17,6 +17,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
+#include <QTimer>
 #include <QUrl>
 
 #include "QXmppClient.h"
@@ -26,33 +29,49 @@
 #include "QXmppMucManager.h"
 #include "QXmppUtils.h"
 
+#include "archive.h"
 #include "client.h"
 #include "history.h"
 #include "rooms.h"
 #include "roster.h"
 
+
 RoomConfigurationModel::RoomConfigurationModel(QObject *parent)
     : QAbstractListModel(parent),
     m_room(0)
 {
 }
 
+/** Removes all the fields.
+ */
+void RoomConfigurationModel::clear()
+{
+    if (!m_fields.isEmpty()) {
+        beginRemoveRows(QModelIndex(), 0, m_fields.size() - 1);
+        m_fields.clear();
+        m_changes.clear();
+        endRemoveRows();
+    }
+}
+
 QVariant RoomConfigurationModel::data(const QModelIndex &index, int role) const
 {
-    if (!index.isValid())
+    if (!index.isValid() || index.row() >= m_fields.size())
         return QVariant();
 
-    const QXmppDataForm::Field field = m_form.fields()[index.row()];
+    const RoomConfigurationField &field = m_fields.at(index.row());
     if (role == DescriptionRole)
-        return field.description();
+        return field.description;
     else if (role == KeyRole)
-        return field.key();
+        return field.key;
     else if (role == LabelRole)
-        return field.label();
+        return field.label;
+    else if (role == OptionsRole)
+        return field.options;
     else if (role == TypeRole)
-        return field.type();
+        return field.type;
     else if (role == ValueRole)
-        return field.value();
+        return m_changes.value(index.row(), field.value);
 
     return QVariant();
 }
@@ -71,6 +90,7 @@ QHash<int, QByteArray> RoomConfigurationModel::roleNames() const
     roleNames.insert(DescriptionRole, "description");
     roleNames.insert(KeyRole, "key");
     roleNames.insert(LabelRole, "label");
+    roleNames.insert(OptionsRole, "options");
     roleNames.insert(TypeRole, "type");
     roleNames.insert(ValueRole, "value");
     return roleNames;
@@ -90,13 +110,7 @@ void RoomConfigurationModel::setRoom(QXmppMucRoom *room)
         if (m_room)
             m_room->disconnect(this);
 
-        if (m_form.fields().size() > 0) {
-            beginRemoveRows(QModelIndex(), 0, m_form.fields().size() - 1);
-            m_form = QXmppDataForm();
-            endRemoveRows();
-        } else {
-            m_form = QXmppDataForm();
-        }
+        clear();
         m_room = room;
 
         if (m_room) {
@@ -115,35 +129,95 @@ void RoomConfigurationModel::setRoom(QXmppMucRoom *room)
 
 int RoomConfigurationModel::rowCount(const QModelIndex &parent) const
 {
-    return parent.isValid() ? 0 : m_form.fields().size();
+    return parent.isValid() ? 0 : m_fields.size();
 }
 
+/** Changes the value of a field, remembering only the values which differ
+ *  from the received form.
+ *
+ * @param row
+ * @param value
+ */
 void RoomConfigurationModel::setValue(int row, const QVariant &value)
 {
-    if (row > 0 && row <  m_form.fields().size() &&
-        value != m_form.fields()[row].value()) {
-        m_form.fields()[row].setValue(value);
-        emit dataChanged(index(row), index(row));
-    }
+    if (row < 0 || row >= m_fields.size() ||
+        value == m_changes.value(row, m_fields.at(row).value))
+        return;
+
+    if (value == m_fields.at(row).value)
+        m_changes.remove(row);
+    else
+        m_changes.insert(row, value);
+    emit dataChanged(index(row), index(row));
 }
 
+/** Submits the fields which were changed.
+ */
 bool RoomConfigurationModel::submit()
 {
-    if (m_room) {
-        return m_room->setConfiguration(m_form);
-    } else {
+    if (!m_room)
         return false;
+    if (m_changes.isEmpty())
+        return true;
+
+    // the form type is always sent, followed by the changed fields
+    QList<QXmppDataForm::Field> fields;
+    for (int row = 0; row < m_fields.size(); ++row) {
+        const RoomConfigurationField &field = m_fields.at(row);
+        QMap<int, QVariant>::const_iterator it = m_changes.constFind(row);
+        if (it == m_changes.constEnd() && field.key != QLatin1String("FORM_TYPE"))
+            continue;
+
+        QXmppDataForm::Field submitField;
+        submitField.setKey(field.key);
+        submitField.setType(field.type);
+        submitField.setValue(it != m_changes.constEnd() ? it.value() : field.value);
+        fields << submitField;
     }
+
+    QXmppDataForm form;
+    form.setType(QXmppDataForm::Submit);
+    form.setFields(fields);
+    if (!m_room->setConfiguration(form))
+        return false;
+
+    // the submitted values are now the room's values
+    QMap<int, QVariant>::const_iterator it;
+    for (it = m_changes.constBegin(); it != m_changes.constEnd(); ++it)
+        m_fields[it.key()].value = it.value();
+    m_changes.clear();
+    return true;
 }
 
 void RoomConfigurationModel::_q_configurationReceived(const QXmppDataForm &configuration)
 {
-    if (!m_form.fields().size()) {
-        beginInsertRows(QModelIndex(), 0, configuration.fields().size() - 1);
-        m_form = configuration;
-        m_form.setType(QXmppDataForm::Submit);
-        endInsertRows();
+    const QList<QXmppDataForm::Field> formFields = configuration.fields();
+    if (!m_fields.isEmpty() || formFields.isEmpty())
+        return;
+
+    QVector<RoomConfigurationField> fields;
+    fields.reserve(formFields.size());
+    foreach (const QXmppDataForm::Field &formField, formFields) {
+        RoomConfigurationField field;
+        field.description = formField.description();
+        field.key = formField.key();
+        field.label = formField.label();
+        field.type = formField.type();
+        field.value = formField.value();
+
+        typedef QPair<QString, QString> Option;
+        foreach (const Option &formOption, formField.options()) {
+            QVariantMap option;
+            option.insert("label", formOption.first);
+            option.insert("value", formOption.second);
+            field.options << option;
+        }
+        fields << field;
     }
+
+    beginInsertRows(QModelIndex(), 0, fields.size() - 1);
+    m_fields = fields;
+    endInsertRows();
 }
 
 class ChatRoomItem : public ChatModelItem
@@ -154,15 +228,59 @@ public:
     QXmppMucItem::Affiliation affiliation;
 };
 
+// participants are sorted by decreasing affiliation, then by JID
+static bool participantLessThan(const ChatRoomItem *a, const ChatRoomItem *b)
+{
+    if (a->affiliation != b->affiliation)
+        return a->affiliation > b->affiliation;
+    return a->jid.compare(b->jid, Qt::CaseInsensitive) < 0;
+}
+
+/** Returns the row at which a participant belongs, not counting the
+ *  participant itself if it is already in the list.
+ */
+static int participantRow(const QList<ChatModelItem*> &children, const ChatRoomItem *item)
+{
+    const int skip = item->parent ? item->row() : -1;
+    int first = 0;
+    int last = children.size() - (skip >= 0 ? 1 : 0);
+    while (first < last) {
+        const int middle = (first + last) / 2;
+        const ChatRoomItem *other = static_cast<ChatRoomItem*>(children.at(skip >= 0 && middle >= skip ? middle + 1 : middle));
+        if (participantLessThan(other, item))
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first;
+}
+
 RoomModel::RoomModel(QObject *parent)
     : ChatModel(parent)
     , m_manager(0)
     , m_room(0)
 {
+    bool check;
+    Q_UNUSED(check);
+
     m_historyModel = new HistoryModel(this);
 
-    connect(VCardCache::instance(), SIGNAL(cardChanged(QString)),
-            this, SLOT(_q_participantChanged(QString)));
+    // participants which join together are inserted together
+    m_pendingTimer = new QTimer(this);
+    m_pendingTimer->setInterval(0);
+    m_pendingTimer->setSingleShot(true);
+    check = connect(m_pendingTimer, SIGNAL(timeout()),
+                    this, SLOT(_q_participantFlush()));
+    Q_ASSERT(check);
+
+    check = connect(VCardCache::instance(), SIGNAL(cardChanged(QString)),
+                    this, SLOT(_q_participantChanged(QString)));
+    Q_ASSERT(check);
+}
+
+RoomModel::~RoomModel()
+{
+    qDeleteAll(m_pendingItems);
 }
 
 QVariant RoomModel::data(const QModelIndex &index, int role) const
@@ -227,6 +345,16 @@ void RoomModel::setManager(QXmppMucManager *manager)
     }
 }
 
+bool RoomModel::removeRows(int row, int count, const QModelIndex &parent)
+{
+    if (!parent.isValid()) {
+        const int last = qMin(row + count, rootItem->children.size());
+        for (int i = qMax(0, row); i < last; ++i)
+            m_items.remove(static_cast<ChatRoomItem*>(rootItem->children.at(i))->jid);
+    }
+    return ChatModel::removeRows(row, count, parent);
+}
+
 QHash<int, QByteArray> RoomModel::roleNames() const
 {
     QHash<int, QByteArray> roleNames;
@@ -244,12 +372,12 @@ void RoomModel::_q_messageReceived(const QXmppMessage &msg)
         return;
 
     // handle message body
+    ChatClient *client = m_manager ? qobject_cast<ChatClient*>(m_manager->parent()) : 0;
     HistoryMessage message;
     message.archived = !m_room->isJoined();
     message.body = msg.body();
     message.date = msg.stamp();
     if (!message.date.isValid()) {
-        ChatClient *client = m_manager ? qobject_cast<ChatClient*>(m_manager->parent()) : 0;
         if (client)
             message.date = client->serverTime();
         else
@@ -257,6 +385,8 @@ void RoomModel::_q_messageReceived(const QXmppMessage &msg)
     }
     message.jid = msg.from();
     message.received = QXmppUtils::jidToResource(msg.from()) != m_room->nickName();
+    if (client)
+        HistoryArchive::instance()->addMessage(client->configuration().jidBare(), m_jid, message);
     m_historyModel->addMessage(message);
 }
 
@@ -265,24 +395,19 @@ void RoomModel::_q_participantAdded(const QString &jid)
     Q_ASSERT(m_room);
     //qDebug("participant added %s", qPrintable(jid));
 
-    const QXmppMucItem::Affiliation affiliation = m_room->participantPresence(jid).mucItem().affiliation();
-    int row = rootItem->children.size();
-    foreach (ChatModelItem *ptr, rootItem->children) {
-        ChatRoomItem *item = static_cast<ChatRoomItem*>(ptr);
-        if (item->jid == jid) {
-            qWarning("participant added twice %s", qPrintable(jid));
-            return;
-        } else if (affiliation > item->affiliation ||
-                   (affiliation == item->affiliation && item->jid.compare(jid, Qt::CaseInsensitive) > 0)) {
-            row = item->row();
-            break;
-        }
+    if (m_items.contains(jid)) {
+        qWarning("participant added twice %s", qPrintable(jid));
+        return;
     }
 
+    const QXmppPresence presence = m_room->participantPresence(jid);
     ChatRoomItem *item = new ChatRoomItem;
     item->jid = jid;
-    item->affiliation = affiliation;
-    addItem(item, rootItem, row);
+    item->affiliation = presence.mucItem().affiliation();
+    item->status = presence.availableStatusType();
+    m_items.insert(jid, item);
+    m_pendingItems << item;
+    m_pendingTimer->start();
 }
 
 void RoomModel::_q_participantChanged(const QString &jid)
@@ -290,18 +415,46 @@ void RoomModel::_q_participantChanged(const QString &jid)
     Q_ASSERT(m_room);
     //qDebug("participant changed %s", qPrintable(jid));
 
-    foreach (ChatModelItem *ptr, rootItem->children) {
-        ChatRoomItem *item = static_cast<ChatRoomItem*>(ptr);
-        if (item->jid == jid) {
-            if (item->affiliation != m_room->participantPresence(jid).mucItem().affiliation()) {
-                removeRow(item->row());
-                _q_participantAdded(jid);
-            } else {
-                item->status = m_room->participantPresence(jid).availableStatusType();
-                emit dataChanged(createIndex(item), createIndex(item));
-            }
-            break;
-        }
+    ChatRoomItem *item = m_items.value(jid);
+    if (!item)
+        return;
+
+    const QXmppPresence presence = m_room->participantPresence(jid);
+    const QXmppMucItem::Affiliation affiliation = presence.mucItem().affiliation();
+    item->status = presence.availableStatusType();
+    if (!item->parent) {
+        // the participant is sorted when it gets inserted
+        item->affiliation = affiliation;
+    } else if (item->affiliation != affiliation) {
+        item->affiliation = affiliation;
+        moveItem(item, participantRow(rootItem->children, item));
+        changeItem(item);
+    } else {
+        changeItem(item);
+    }
+}
+
+/** Inserts the participants which joined since the last event loop turn,
+ *  using a single row insertion for each run of adjacent participants.
+ */
+void RoomModel::_q_participantFlush()
+{
+    std::sort(m_pendingItems.begin(), m_pendingItems.end(), participantLessThan);
+    QList<ChatModelItem*> items;
+    foreach (ChatRoomItem *item, m_pendingItems)
+        items << item;
+    m_pendingItems.clear();
+
+    const QList<ChatModelItem*> &children = rootItem->children;
+    int first = 0;
+    while (first < items.size()) {
+        const int row = participantRow(children, static_cast<ChatRoomItem*>(items.at(first)));
+        const ChatRoomItem *next = static_cast<ChatRoomItem*>(children.value(row));
+        int last = first + 1;
+        while (last < items.size() && (!next || participantLessThan(static_cast<ChatRoomItem*>(items.at(last)), next)))
+            ++last;
+        addItems(items.mid(first, last - first), rootItem, row);
+        first = last;
     }
 }
 
@@ -310,12 +463,15 @@ void RoomModel::_q_participantRemoved(const QString &jid)
     Q_ASSERT(m_room);
     //qDebug("participant removed %s", qPrintable(jid));
 
-    foreach (ChatModelItem *ptr, rootItem->children) {
-        ChatRoomItem *item = static_cast<ChatRoomItem*>(ptr);
-        if (item->jid == jid) {
-            removeRow(item->row());
-            break;
-        }
+    ChatRoomItem *item = m_items.take(jid);
+    if (!item)
+        return;
+
+    if (item->parent) {
+        removeItem(item);
+    } else {
+        m_pendingItems.removeAll(item);
+        delete item;
     }
 }
 
@@ -355,6 +511,13 @@ void RoomModel::setRoom(QXmppMucRoom *room)
         check = connect(m_room, SIGNAL(participantRemoved(QString)),
                         this, SLOT(_q_participantRemoved(QString)));
         Q_ASSERT(check);
+
+        // show the stored messages
+        ChatClient *client = qobject_cast<ChatClient*>(m_manager->parent());
+        if (client) {
+            m_historyModel->setJid(m_jid);
+            m_historyModel->setLocalAccount(client->configuration().jidBare());
+        }
     }
 
     emit roomChanged(m_room);
@@ -367,6 +530,28 @@ public:
     int affiliation;
 };
 
+// permissions are sorted by JID
+static bool permissionLessThan(const RoomPermissionItem *a, const RoomPermissionItem *b)
+{
+    return a->jid.compare(b->jid, Qt::CaseInsensitive) < 0;
+}
+
+/** Returns the row at which a permission belongs.
+ */
+static int permissionRow(const QList<ChatModelItem*> &children, const RoomPermissionItem *item)
+{
+    int first = 0;
+    int last = children.size();
+    while (first < last) {
+        const int middle = (first + last) / 2;
+        if (permissionLessThan(static_cast<RoomPermissionItem*>(children.at(middle)), item))
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return first;
+}
+
 RoomPermissionModel::RoomPermissionModel(QObject *parent)
     : ChatModel(parent),
     m_room(0)
@@ -375,37 +560,28 @@ RoomPermissionModel::RoomPermissionModel(QObject *parent)
 
 void RoomPermissionModel::setPermission(const QString &jid, int affiliation)
 {
-    // add room to list
-    int row = rootItem->children.size();
-    foreach (ChatModelItem *ptr, rootItem->children) {
-        RoomPermissionItem *item = static_cast<RoomPermissionItem*>(ptr);
-        if (item->jid == jid) {
-            if (affiliation != item->affiliation) {
-                item->affiliation = affiliation;
-                emit dataChanged(createIndex(item), createIndex(item));
-            }
-            return;
-        } else if (item->jid.compare(jid, Qt::CaseInsensitive) > 0) {
-            row = item->row();
-            break;
+    RoomPermissionItem *item = m_items.value(jid);
+    if (item) {
+        if (affiliation != item->affiliation) {
+            item->affiliation = affiliation;
+            changeItem(item);
         }
+        return;
     }
 
-    RoomPermissionItem *item = new RoomPermissionItem;
+    // add room to list
+    item = new RoomPermissionItem;
     item->affiliation = affiliation;
     item->jid = jid;
-    addItem(item, rootItem, row);
+    m_items.insert(jid, item);
+    addItem(item, rootItem, permissionRow(rootItem->children, item));
 }
 
 void RoomPermissionModel::removePermission(const QString &jid)
 {
-    foreach (ChatModelItem *ptr, rootItem->children) {
-        RoomPermissionItem *item = static_cast<RoomPermissionItem*>(ptr);
-        if (item->jid == jid) {
-            removeItem(item);
-            return;
-        }
-    }
+    RoomPermissionItem *item = m_items.take(jid);
+    if (item)
+        removeItem(item);
 }
 
 QVariant RoomPermissionModel::data(const QModelIndex &index, int role) const
@@ -423,6 +599,16 @@ QVariant RoomPermissionModel::data(const QModelIndex &index, int role) const
     return QVariant();
 }
 
+bool RoomPermissionModel::removeRows(int row, int count, const QModelIndex &parent)
+{
+    if (!parent.isValid()) {
+        const int last = qMin(row + count, rootItem->children.size());
+        for (int i = qMax(0, row); i < last; ++i)
+            m_items.remove(static_cast<RoomPermissionItem*>(rootItem->children.at(i))->jid);
+    }
+    return ChatModel::removeRows(row, count, parent);
+}
+
 QHash<int, QByteArray> RoomPermissionModel::roleNames() const
 {
     QHash<int, QByteArray> roleNames;
@@ -447,6 +633,7 @@ void RoomPermissionModel::setRoom(QXmppMucRoom *room)
 
         m_room = room;
         removeRows(0, rootItem->children.size());
+        m_affiliations.clear();
 
         if (m_room) {
             bool check;
@@ -462,27 +649,100 @@ void RoomPermissionModel::setRoom(QXmppMucRoom *room)
     }
 }
 
+/** Submits the permissions if any of them changed.
+ *
+ * The complete list is handed to the room, which only sends the
+ * affiliations which differ from the ones it received.
+ */
 bool RoomPermissionModel::submit()
 {
     if (!m_room)
         return false;
 
+    bool changed = m_items.size() != m_affiliations.size();
     QList<QXmppMucItem> permissions;
+    QHash<QString, int> affiliations;
     foreach (ChatModelItem *ptr, rootItem->children) {
         RoomPermissionItem *item = static_cast<RoomPermissionItem*>(ptr);
+        QHash<QString, int>::const_iterator it = m_affiliations.constFind(item->jid);
+        if (it == m_affiliations.constEnd() || it.value() != item->affiliation)
+            changed = true;
+        affiliations.insert(item->jid, item->affiliation);
 
         QXmppMucItem mucItem;
         mucItem.setAffiliation(static_cast<QXmppMucItem::Affiliation>(item->affiliation));
         mucItem.setJid(item->jid);
         permissions << mucItem;
     }
+    if (!changed)
+        return true;
 
-    return m_room->setPermissions(permissions);
+    if (!m_room->setPermissions(permissions))
+        return false;
+    m_affiliations = affiliations;
+    return true;
 }
 
+/** Merges the received permissions into the model.
+ *
+ * Permissions which are no longer present on the server are removed,
+ * changed affiliations are updated and new permissions are inserted with
+ * one row insertion per run of adjacent rows.
+ */
 void RoomPermissionModel::_q_permissionsReceived(const QList<QXmppMucItem> &permissions)
 {
+    QHash<QString, int> affiliations;
     foreach (const QXmppMucItem &mucItem, permissions)
-        setPermission(mucItem.jid(), mucItem.affiliation());
+        affiliations.insert(mucItem.jid(), mucItem.affiliation());
+
+    // remove permissions which were revoked
+    QList<ChatModelItem*> removed;
+    QHash<QString, int>::const_iterator it;
+    for (it = m_affiliations.constBegin(); it != m_affiliations.constEnd(); ++it) {
+        if (!affiliations.contains(it.key())) {
+            RoomPermissionItem *item = m_items.value(it.key());
+            if (item)
+                removed << item;
+        }
+    }
+    removeItems(removed);
+
+    // update the existing permissions and collect the new ones
+    QList<RoomPermissionItem*> added;
+    beginBuffering();
+    for (it = affiliations.constBegin(); it != affiliations.constEnd(); ++it) {
+        RoomPermissionItem *item = m_items.value(it.key());
+        if (item) {
+            if (item->affiliation != it.value()) {
+                item->affiliation = it.value();
+                changeItem(item);
+            }
+        } else {
+            item = new RoomPermissionItem;
+            item->affiliation = it.value();
+            item->jid = it.key();
+            m_items.insert(item->jid, item);
+            added << item;
+        }
+    }
+    endBuffering();
+    m_affiliations = affiliations;
+
+    // insert the new permissions
+    std::sort(added.begin(), added.end(), permissionLessThan);
+    QList<ChatModelItem*> items;
+    foreach (RoomPermissionItem *item, added)
+        items << item;
+
+    const QList<ChatModelItem*> &children = rootItem->children;
+    int first = 0;
+    while (first < items.size()) {
+        const int row = permissionRow(children, static_cast<RoomPermissionItem*>(items.at(first)));
+        const RoomPermissionItem *next = static_cast<RoomPermissionItem*>(children.value(row));
+        int last = first + 1;
+        while (last < items.size() && (!next || permissionLessThan(static_cast<RoomPermissionItem*>(items.at(last)), next)))
+            ++last;
+        addItems(items.mid(first, last - first), rootItem, row);
+        first = last;
+    }
 }
-
@@ -20,18 +20,36 @@
 #ifndef __WILINK_ROOMS_H__
 #define __WILINK_ROOMS_H__
 
+#include <QMap>
 #include <QSet>
+#include <QVector>
 
 #include "QXmppDataForm.h"
 #include "QXmppMucIq.h"
 #include "model.h"
 
 class ChatClient;
+class ChatRoomItem;
 class HistoryModel;
+class RoomPermissionItem;
 class QModelIndex;
 class QXmppMessage;
 class QXmppMucManager;
 class QXmppMucRoom;
+class QTimer;
+
+/** A data form field, unpacked once for display.
+ */
+class RoomConfigurationField
+{
+public:
+    QString description;
+    QString key;
+    QString label;
+    QVariantList options;
+    QXmppDataForm::Field::Type type;
+    QVariant value;
+};
 
 class RoomConfigurationModel : public QAbstractListModel
 {
@@ -66,10 +84,15 @@ private:
         DescriptionRole,
         KeyRole,
         LabelRole,
+        OptionsRole,
         TypeRole,
         ValueRole,
     };
-    QXmppDataForm m_form;
+    void clear();
+
+    QVector<RoomConfigurationField> m_fields;
+    // values edited since the form was received, by row
+    QMap<int, QVariant> m_changes;
     QXmppMucRoom *m_room;
 };
 
@@ -88,8 +111,10 @@ public:
     };
 
     RoomModel(QObject *parent = 0);
+    ~RoomModel();
 
     QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    bool removeRows(int row, int count, const QModelIndex &parent = QModelIndex());
     QHash<int, QByteArray> roleNames() const;
 
     HistoryModel *historyModel() const;
@@ -111,6 +136,7 @@ private slots:
     void _q_messageReceived(const QXmppMessage &msg);
     void _q_participantAdded(const QString &jid);
     void _q_participantChanged(const QString &jid);
+    void _q_participantFlush();
     void _q_participantRemoved(const QString &jid);
 
 private:
@@ -120,6 +146,11 @@ private:
     QString m_jid;
     QXmppMucManager *m_manager;
     QXmppMucRoom *m_room;
+
+    // participants by full JID, including those waiting to be inserted
+    QHash<QString, ChatRoomItem*> m_items;
+    QList<ChatRoomItem*> m_pendingItems;
+    QTimer *m_pendingTimer;
 };
 
 class RoomPermissionModel : public ChatModel
@@ -131,6 +162,7 @@ public:
     RoomPermissionModel(QObject *parent = 0);
 
     QVariant data(const QModelIndex &index, int role) const;
+    bool removeRows(int row, int count, const QModelIndex &parent = QModelIndex());
     QHash<int, QByteArray> roleNames() const;
 
     QXmppMucRoom *room() const;
@@ -152,6 +184,9 @@ private:
         AffiliationRole = ChatModel::UserRole,
     };
 
+    // permissions by JID, and the affiliations last received or submitted
+    QHash<QString, RoomPermissionItem*> m_items;
+    QHash<QString, int> m_affiliations;
     QXmppMucRoom *m_room;
 };
 
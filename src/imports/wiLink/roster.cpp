@@ -17,16 +17,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <QBuffer>
+#include <QDataStream>
 #include <QDesktopServices>
 #include <QDir>
 #include <QDomDocument>
-#include <QImageReader>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QList>
 #include <QMenu>
 #include <QNetworkCacheMetaData>
 #include <QNetworkDiskCache>
 #include <QPainter>
+#include <QSaveFile>
 #include <QStringList>
 #include <QTimer>
 #include <QUrl>
@@ -40,11 +42,19 @@
 #include "QXmppVCardIq.h"
 #include "QXmppVCardManager.h"
 
+#include "avatar.h"
 #include "client.h"
 #include "roster.h"
 
 static const QChar sortSeparator('\0');
 
+static const quint32 VCARD_INDEX_MAGIC = 0x574c5643;
+static const quint32 VCARD_INDEX_VERSION = 1;
+static const int VCARD_CACHE_SECONDS = 3600;
+
+static const quint32 CAPS_INDEX_MAGIC = 0x574c4350;
+static const quint32 CAPS_INDEX_VERSION = 1;
+
 static VCardCache *vcardCache = 0;
 
 // Try to read an IQ from disk cache.
@@ -87,11 +97,22 @@ public:
     QString jid;
     int messages;
     QSet<QXmppRosterManager*> rosterManagers;
+    // the roster fields last displayed, to detect changes
+    QString rosterKey;
+    // the StatusSortRole, empty until computed
+    QString sortKey;
 
 private:
     VCard *m_vcard;
 };
 
+/** Returns the roster fields which are displayed for an entry.
+ */
+static QString rosterKey(const QXmppRosterIq::Item &entry)
+{
+    return entry.name() + sortSeparator + QString::number(entry.subscriptionType()) + sortSeparator + entry.subscriptionStatus();
+}
+
 RosterItem::RosterItem()
     : m_vcard(0)
 {
@@ -112,36 +133,29 @@ VCard *RosterItem::vcard()
     return m_vcard;
 }
 
+/** Constructs a new RosterImageProvider.
+ *
+ * Images are requested from a worker thread, and read from the
+ * AvatarCache.
+ */
 RosterImageProvider::RosterImageProvider()
-    : QQuickImageProvider(Pixmap)
+    : QQuickImageProvider(Image, ForceAsynchronousImageLoading)
 {
 }
 
-QPixmap RosterImageProvider::requestPixmap(const QString &id, QSize *size, const QSize &requestedSize)
+QImage RosterImageProvider::requestImage(const QString &id, QSize *size, const QSize &requestedSize)
 {
-    QPixmap pixmap;
-
-    // read vCard image
-    QXmppVCardIq vcard;
-    if (VCardCache::instance()->get(id, &vcard)) {
-        QBuffer buffer;
-        buffer.setData(vcard.photo());
-        buffer.open(QIODevice::ReadOnly);
-        QImageReader imageReader(&buffer);
-        if (requestedSize.isValid())
-            imageReader.setScaledSize(requestedSize);
-        pixmap = QPixmap::fromImage(imageReader.read());
-    }
-    if (pixmap.isNull()) {
+    QImage image = AvatarCache::instance()->image(id, requestedSize);
+    if (image.isNull()) {
         qWarning("Could not get roster picture for %s", qPrintable(id));
-        pixmap = QPixmap(":/qml/images/peer.png");
-        if (requestedSize.isValid())
-            pixmap = pixmap.scaled(requestedSize.width(), requestedSize.height(), Qt::KeepAspectRatio);
+        image = QImage(":/qml/images/peer.png");
+        if (!requestedSize.isEmpty())
+            image = image.scaled(requestedSize, Qt::KeepAspectRatio);
     }
 
     if (size)
-        *size = pixmap.size();
-    return pixmap;
+        *size = image.size();
+    return image;
 }
 
 class RosterModelPrivate
@@ -149,11 +163,14 @@ class RosterModelPrivate
 public:
     RosterModelPrivate(RosterModel *qq);
     void clientConnected(ChatClient* client);
-    RosterItem* find(const QString &id, ChatModelItem *parent = 0);
+    RosterItem *createItem(QXmppRosterManager *rosterManager, const QString &jid);
+    RosterItem* find(const QString &id) const;
     void itemAdded(QXmppRosterManager *rosterManager, const QString &jid);
     void rosterReceived(QXmppRosterManager *rosterManager);
 
     QSet<ChatClient*> clients;
+    // roster entries by bare JID
+    QHash<QString, RosterItem*> items;
 
 private:
     RosterModel *q;
@@ -170,26 +187,9 @@ void RosterModelPrivate::clientConnected(ChatClient *client)
     VCardCache::instance()->get(client->configuration().jidBare());
 }
 
-RosterItem *RosterModelPrivate::find(const QString &id, ChatModelItem *parent)
+RosterItem *RosterModelPrivate::find(const QString &id) const
 {
-    if (!parent)
-        parent = q->rootItem;
-
-    /* look at immediate children */
-    foreach (ChatModelItem *it, parent->children) {
-        RosterItem *item = static_cast<RosterItem*>(it);
-        if (item->jid == id)
-            return item;
-    }
-
-    /* recurse */
-    foreach (ChatModelItem *it, parent->children) {
-        RosterItem *item = static_cast<RosterItem*>(it);
-        RosterItem *found = find(id, item);
-        if (found)
-            return found;
-    }
-    return 0;
+    return items.value(id);
 }
 
 /** Handles an item being added to the roster.
@@ -200,38 +200,82 @@ void RosterModelPrivate::itemAdded(QXmppRosterManager *rosterManager, const QStr
     RosterItem *item = find(jid);
     if (item) {
         item->rosterManagers << rosterManager;
+        item->rosterKey = rosterKey(rosterManager->getRosterEntry(jid));
         emit q->dataChanged(q->createIndex(item), q->createIndex(item));
         return;
     }
 
     // add a new entry
-    const QXmppRosterIq::Item entry = rosterManager->getRosterEntry(jid);
-    item = new RosterItem;
+    q->addItem(createItem(rosterManager, jid), q->rootItem);
+}
+
+/** Creates a new roster entry, which must then be added to the model.
+ */
+RosterItem *RosterModelPrivate::createItem(QXmppRosterManager *rosterManager, const QString &jid)
+{
+    RosterItem *item = new RosterItem;
     item->jid = jid;
     item->messages = 0;
     item->rosterManagers << rosterManager;
-    q->addItem(item, q->rootItem);
+    item->rosterKey = rosterKey(rosterManager->getRosterEntry(jid));
+    items.insert(jid, item);
+    return item;
 }
 
 /** Handles roster reception.
+ *
+ * The received roster is compared with the model in a single pass, then
+ * additions, changes and removals are each applied as a batch.
  */
 void RosterModelPrivate::rosterReceived(QXmppRosterManager *rosterManager)
 {
-    // make a note of existing contacts
-    int affected = 0;
-    foreach (ChatModelItem *item, q->rootItem->children) {
-        RosterItem *child = static_cast<RosterItem*>(item);
-        if (child->rosterManagers.remove(rosterManager))
-            affected++;
+    QElapsedTimer timer;
+    timer.start();
+
+    QSet<QString> received;
+    QList<ChatModelItem*> newItems;
+    foreach (const QString &jid, rosterManager->getRosterBareJids()) {
+        if (received.contains(jid))
+            continue;
+        received << jid;
+
+        RosterItem *item = find(jid);
+        if (!item) {
+            newItems << createItem(rosterManager, jid);
+            continue;
+        }
+
+        const QString key = rosterKey(rosterManager->getRosterEntry(jid));
+        bool changed = false;
+        if (!item->rosterManagers.contains(rosterManager)) {
+            item->rosterManagers << rosterManager;
+            changed = true;
+        }
+        if (key != item->rosterKey) {
+            item->rosterKey = key;
+            changed = true;
+        }
+        if (changed)
+            q->changeItem(item);
     }
 
-    // process received entries
-    foreach (const QString &jid, rosterManager->getRosterBareJids())
-        itemAdded(rosterManager, jid);
+    // entries which are no longer in this roster
+    QList<ChatModelItem*> obsolete;
+    foreach (ChatModelItem *ptr, q->rootItem->children) {
+        RosterItem *item = static_cast<RosterItem*>(ptr);
+        if (!received.contains(item->jid) &&
+            item->rosterManagers.remove(rosterManager) &&
+            item->rosterManagers.isEmpty())
+            obsolete << item;
+    }
 
-    // remove obsolete entries
-    if (affected)
-        q->_q_rosterPurge();
+    q->removeItems(obsolete);
+    q->addItems(newItems, q->rootItem);
+
+#ifdef DEBUG_ROSTER
+    qDebug("loaded roster of %i entries in %lli ms", received.size(), timer.elapsed());
+#endif
+    emit q->rosterLoaded(received.size(), timer.elapsed());
 }
 
 RosterModel::RosterModel(QObject *parent)
@@ -243,6 +287,10 @@ RosterModel::RosterModel(QObject *parent)
     connect(VCardCache::instance(), SIGNAL(cardChanged(QString)),
             this, SLOT(_q_itemChanged(QString)), Qt::QueuedConnection);
 
+    // the cache aggregates presences before notifying changes
+    connect(VCardCache::instance(), SIGNAL(presencesChanged(QStringList)),
+            this, SLOT(_q_presencesChanged(QStringList)));
+
     // monitor clients
     foreach (ChatClient *client, ChatClient::instances())
         _q_clientCreated(client);
@@ -274,7 +322,9 @@ QVariant RosterModel::data(const QModelIndex &index, int role) const
     } else if (role == StatusRole) {
         return VCardCache::instance()->presenceStatus(item->jid);
     } else if (role == StatusSortRole) {
-        return VCardCache::instance()->presenceStatus(item->jid) + sortSeparator + item->vcard()->name().toLower() + sortSeparator + item->jid.toLower();
+        if (item->sortKey.isEmpty())
+            item->sortKey = VCardCache::instance()->presenceStatus(item->jid) + sortSeparator + item->vcard()->name().toLower() + sortSeparator + item->jid.toLower();
+        return item->sortKey;
     } else if (role == SubscriptionStatusRole) {
         return VCardCache::instance()->subscriptionStatus(item->jid);
     } else if (role == SubscriptionTypeRole) {
@@ -332,6 +382,16 @@ int RosterModel::pendingMessages() const
     return pending;
 }
 
+bool RosterModel::removeRows(int row, int count, const QModelIndex &parent)
+{
+    if (!parent.isValid()) {
+        const int last = qMin(row + count, rootItem->children.size());
+        for (int i = qMax(0, row); i < last; ++i)
+            d->items.remove(static_cast<RosterItem*>(rootItem->children.at(i))->jid);
+    }
+    return ChatModel::removeRows(row, count, parent);
+}
+
 QHash<int, QByteArray> RosterModel::roleNames() const
 {
     QHash<int, QByteArray> roleNames;
@@ -373,10 +433,6 @@ void RosterModel::_q_clientCreated(ChatClient *client)
                         this, SLOT(_q_itemRemoved(QString)));
         Q_ASSERT(check);
 
-        check = connect(client->rosterManager(), SIGNAL(presenceChanged(QString,QString)),
-                        this, SLOT(_q_itemChanged(QString)));
-        Q_ASSERT(check);
-
         check = connect(client->rosterManager(), SIGNAL(rosterReceived()),
                         this, SLOT(_q_rosterReceived()));
         Q_ASSERT(check);
@@ -441,8 +497,10 @@ void RosterModel::_q_itemAdded(const QString &jid)
 void RosterModel::_q_itemChanged(const QString &jid)
 {
     RosterItem *item = d->find(jid);
-    if (item)
+    if (item) {
+        item->sortKey.clear();
         emit dataChanged(createIndex(item), createIndex(item));
+    }
 }
 
 /** Handles an item being removed from the roster.
@@ -454,20 +512,40 @@ void RosterModel::_q_itemRemoved(const QString &jid)
     RosterItem *item = d->find(jid);
     if (item) {
         item->rosterManagers.remove(rosterManager);
-        if (item->rosterManagers.isEmpty())
+        if (item->rosterManagers.isEmpty()) {
+            d->items.remove(jid);
             removeItem(item);
+        }
     }
 }
 
+/** Handles contacts' presences changing.
+ *
+ * The cache delivers a burst of presences at once, which results in a
+ * few signals which only affect the status roles.
+ */
+void RosterModel::_q_presencesChanged(const QStringList &jids)
+{
+    beginBuffering();
+    foreach (const QString &jid, jids) {
+        RosterItem *item = d->find(jid);
+        if (item) {
+            item->sortKey.clear();
+            changeItem(item, QVector<int>() << StatusRole << StatusSortRole);
+        }
+    }
+    endBuffering();
+}
+
 void RosterModel::_q_rosterPurge()
 {
-    for (int i = 0; i < rootItem->children.size(); ) {
-        RosterItem *item = static_cast<RosterItem*>(rootItem->children.at(i));
+    QList<ChatModelItem*> obsolete;
+    foreach (ChatModelItem *ptr, rootItem->children) {
+        RosterItem *item = static_cast<RosterItem*>(ptr);
         if (item->rosterManagers.isEmpty())
-            removeItem(item);
-        else
-            ++i;
+            obsolete << item;
     }
+    removeItems(obsolete);
 }
 
 void RosterModel::_q_rosterReceived()
@@ -477,17 +555,239 @@ void RosterModel::_q_rosterReceived()
         d->rosterReceived(rosterManager);
 }
 
+/** The VCardCacheEntry class holds the fields of a vCard which are needed
+ *  to display a contact, without its photo.
+ */
+class VCardCacheEntry
+{
+public:
+    VCardCacheEntry();
+    VCardCacheEntry(const QXmppVCardIq &vcard, const QDateTime &expiry);
+
+    QDateTime expiry;
+    QString fullName;
+    QString nickName;
+    QByteArray photoHash;
+    QString url;
+};
+
+VCardCacheEntry::VCardCacheEntry()
+{
+}
+
+VCardCacheEntry::VCardCacheEntry(const QXmppVCardIq &vcard, const QDateTime &expiry)
+    : expiry(expiry.toUTC())
+    , fullName(vcard.fullName())
+    , nickName(vcard.nickName())
+    , photoHash(AvatarCache::instance()->addPhoto(vcard.photo()))
+    , url(vcard.url())
+{
+}
+
+/** The VCardPresence class aggregates the presences of a bare JID.
+ */
+class VCardPresence
+{
+public:
+    class Resource
+    {
+    public:
+        ChatClient *client;
+        int priority;
+        QXmppPresence::AvailableStatusType status;
+
+        // XEP-0115 verification string, empty if the resource has none
+        QByteArray capabilities;
+        bool discovered;
+        VCard::Features features;
+    };
+
+    void update();
+
+    // available resources by full JID
+    QHash<QString, Resource> resources;
+    VCard::Features features;
+    QString status;
+};
+
+static int statusRank(QXmppPresence::AvailableStatusType type)
+{
+    if (type == QXmppPresence::Online || type == QXmppPresence::Chat)
+        return 0;
+    else if (type == QXmppPresence::Away || type == QXmppPresence::XA)
+        return 1;
+    else
+        return 2;
+}
+
+/** Updates the status from the resource with the highest priority,
+ *  preferring the most available one, and combines the features of all
+ *  the resources.
+ */
+void VCardPresence::update()
+{
+    QHash<QString, Resource>::const_iterator best = resources.constEnd();
+    QHash<QString, Resource>::const_iterator it;
+    features = 0;
+    for (it = resources.constBegin(); it != resources.constEnd(); ++it) {
+        features |= it->features;
+        if (best == resources.constEnd() || it->priority > best->priority ||
+            (it->priority == best->priority && statusRank(it->status) < statusRank(best->status)))
+            best = it;
+    }
+    status = best != resources.constEnd() ? ChatClient::statusToString(best->status) : QString("offline");
+}
+
 class VCardCachePrivate
 {
 public:
+    void loadCapabilities();
+    void loadIndex();
+    void removePresences(ChatClient *client);
+    void request(const QString &jid);
+
+    // VCard objects by JID, which are notified of changes
+    QMultiHash<QString, VCard*> cards;
+    // bare JIDs whose presence changed during this event loop turn
+    QSet<QString> presenceQueue;
+    QTimer *presenceTimer;
+
     QNetworkDiskCache *cache;
     QList<ChatClient*> clients;
-    QSet<QString> discoQueue;
-    QMap<QString, VCard::Features> features;
+    // pending disco#info requests by full JID, with the verification
+    // string they resolve
+    QHash<QString, QByteArray> discoQueue;
+    QHash<QString, QString> names;
+    QHash<QString, VCardPresence> presences;
     QSet<QString> vcardFailed;
     QSet<QString> vcardQueue;
+
+    // resident index of the stored vCards
+    QHash<QString, VCardCacheEntry> entries;
+    QString indexPath;
+    QTimer *indexTimer;
+
+    // features by XEP-0115 verification string, shared by all the
+    // resources which advertise the same capabilities
+    QHash<QByteArray, VCard::Features> capabilities;
+    QSet<QByteArray> capabilitiesQueue;
+    QString capabilitiesPath;
+    QTimer *capabilitiesTimer;
+    VCardCache *q;
 };
 
+/** Reads the entity capabilities index.
+ */
+void VCardCachePrivate::loadCapabilities()
+{
+    QFile file(capabilitiesPath);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+    if (magic != CAPS_INDEX_MAGIC || version != CAPS_INDEX_VERSION) {
+        qWarning("Could not read capabilities index %s", qPrintable(capabilitiesPath));
+        return;
+    }
+
+    capabilities.reserve(count);
+    for (quint32 i = 0; i < count; ++i) {
+        QByteArray ver;
+        quint32 features;
+        stream >> ver >> features;
+        if (stream.status() != QDataStream::Ok)
+            break;
+        capabilities.insert(ver, VCard::Features(features));
+    }
+}
+
+/** Reads the vCard index.
+ */
+void VCardCachePrivate::loadIndex()
+{
+    QFile file(indexPath);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+    if (magic != VCARD_INDEX_MAGIC || version != VCARD_INDEX_VERSION) {
+        qWarning("Could not read vCard index %s", qPrintable(indexPath));
+        return;
+    }
+
+    entries.reserve(count);
+    for (quint32 i = 0; i < count; ++i) {
+        QString jid;
+        VCardCacheEntry entry;
+        stream >> jid >> entry.expiry >> entry.fullName >> entry.nickName >> entry.photoHash >> entry.url;
+        if (stream.status() != QDataStream::Ok)
+            break;
+        entries.insert(jid, entry);
+        AvatarCache::instance()->setPhotoHash(jid, entry.photoHash);
+    }
+}
+
+/** Forgets the presences received by a client.
+ */
+void VCardCachePrivate::removePresences(ChatClient *client)
+{
+    QStringList discoChanged;
+    bool changed = false;
+    QHash<QString, VCardPresence>::iterator it = presences.begin();
+    while (it != presences.end()) {
+        const VCard::Features features = it->features;
+        QHash<QString, VCardPresence::Resource>::iterator resource = it->resources.begin();
+        while (resource != it->resources.end()) {
+            if (resource->client == client) {
+                resource = it->resources.erase(resource);
+                changed = true;
+            } else {
+                ++resource;
+            }
+        }
+        if (changed)
+            presenceQueue << it.key();
+        if (it->resources.isEmpty()) {
+            if (features)
+                discoChanged << it.key();
+            it = presences.erase(it);
+        } else {
+            it->update();
+            if (it->features != features)
+                discoChanged << it.key();
+            ++it;
+        }
+        changed = false;
+    }
+    if (!presenceQueue.isEmpty())
+        presenceTimer->start();
+    foreach (const QString &jid, discoChanged)
+        q->notifyDisco(jid);
+}
+
+/** Requests a vCard, unless it is already being requested or failed.
+ */
+void VCardCachePrivate::request(const QString &jid)
+{
+    if (vcardQueue.contains(jid) || vcardFailed.contains(jid))
+        return;
+
+    ChatClient *client = q->client(jid);
+    if (client) {
+#ifdef DEBUG_ROSTER
+        qDebug("requesting vCard %s", qPrintable(jid));
+#endif
+        vcardQueue.insert(jid);
+        client->vCardManager().requestVCard(jid);
+    }
+}
+
 VCard::VCard(QObject *parent)
     : QObject(parent),
     m_cache(0)
@@ -497,6 +797,12 @@ VCard::VCard(QObject *parent)
 #endif
 }
 
+VCard::~VCard()
+{
+    if (m_cache && !m_jid.isEmpty())
+        m_cache->d->cards.remove(m_jid, this);
+}
+
 QUrl VCard::avatar() const
 {
     return m_avatar;
@@ -523,9 +829,14 @@ QString VCard::jidForFeature(Feature feature) const
     if (m_jid.isEmpty() || !m_cache || !QXmppUtils::jidToResource(m_jid).isEmpty())
         return QString();
 
-    foreach (const QString &key, m_cache->d->features.keys()) {
-        if (QXmppUtils::jidToBareJid(key) == m_jid && (m_cache->d->features.value(key) & feature))
-            return key;
+    const QHash<QString, VCardPresence>::const_iterator presence = m_cache->d->presences.constFind(m_jid);
+    if (presence == m_cache->d->presences.constEnd() || !(presence->features & feature))
+        return QString();
+
+    QHash<QString, VCardPresence::Resource>::const_iterator it;
+    for (it = presence->resources.constBegin(); it != presence->resources.constEnd(); ++it) {
+        if (it->features & feature)
+            return it.key();
     }
     return QString();
 }
@@ -533,6 +844,14 @@ QString VCard::jidForFeature(Feature feature) const
 void VCard::setJid(const QString &jid)
 {
     if (jid != m_jid) {
+        // subscribe to the cache's changes for this JID
+        if (!m_cache)
+            m_cache = VCardCache::instance();
+        if (!m_jid.isEmpty())
+            m_cache->d->cards.remove(m_jid, this);
+        if (!jid.isEmpty())
+            m_cache->d->cards.insert(jid, this);
+
         m_jid = jid;
         emit jidChanged(m_jid);
 
@@ -576,36 +895,15 @@ void VCard::update()
 
     // fetch data
     if (!m_jid.isEmpty()) {
-        if (!m_cache) {
-            m_cache = VCardCache::instance();
-            connect(m_cache, SIGNAL(cardChanged(QString)),
-                    this, SLOT(_q_cardChanged(QString)));
-            connect(m_cache, SIGNAL(discoChanged(QString)),
-                    this, SLOT(_q_discoChanged(QString)));
-            connect(m_cache, SIGNAL(presenceChanged(QString)),
-                    this, SLOT(_q_presenceChanged(QString)));
-        }
-
-        QXmppVCardIq vcard;
-        if (m_cache->get(m_jid, &vcard)) {
+        const VCardCacheEntry *entry = m_cache->entry(m_jid);
+        if (entry) {
             newAvatar = QUrl("image://roster/" + m_jid);
-            newName = vcard.nickName();
-            if (newName.isEmpty())
-                newName = vcard.fullName();
-            newNickName = vcard.nickName();
-            newUrl = QUrl(vcard.url());
+            newNickName = entry->nickName;
+            newUrl = QUrl(entry->url);
         } else {
             newAvatar = QUrl("images/peer.png");
         }
-        foreach (ChatClient *client, m_cache->d->clients) {
-            const QString name = client->rosterManager()->getRosterEntry(QXmppUtils::jidToBareJid(m_jid)).name();
-            if (!name.isEmpty()) {
-                newName = name;
-                break;
-            }
-        }
-        if (newName.isEmpty())
-            newName = QXmppUtils::jidToUser(m_jid);
+        newName = m_cache->name(m_jid);
     }
 
     // notify changes
@@ -627,36 +925,43 @@ void VCard::update()
     }
 }
 
-void VCard::_q_cardChanged(const QString &jid)
-{
-    if (jid == m_jid)
-        update();
-}
-
-void VCard::_q_discoChanged(const QString &jid)
-{
-    if (jid == m_jid)
-        emit featuresChanged();
-}
-
-void VCard::_q_presenceChanged(const QString &jid)
-{
-    if (jid.isEmpty() || jid == m_jid)
-        emit statusChanged();
-}
-
 VCardCache::VCardCache(QObject *parent)
     : QObject(parent)
 {
     const QString dataPath = QStandardPaths::standardLocations(QStandardPaths::DataLocation)[0];
 
     d = new VCardCachePrivate;
+    d->q = this;
     d->cache = new QNetworkDiskCache(this);
     d->cache->setCacheDirectory(QDir(dataPath).filePath("cache"));
+
+    // presence changes are delivered once control returns to the event loop
+    d->presenceTimer = new QTimer(this);
+    d->presenceTimer->setInterval(0);
+    d->presenceTimer->setSingleShot(true);
+    connect(d->presenceTimer, SIGNAL(timeout()), this, SLOT(_q_presenceFlush()));
+
+    d->indexPath = QDir(dataPath).filePath("vcards.dat");
+    d->indexTimer = new QTimer(this);
+    d->indexTimer->setInterval(1000);
+    d->indexTimer->setSingleShot(true);
+    connect(d->indexTimer, SIGNAL(timeout()), this, SLOT(_q_saveIndex()));
+    d->loadIndex();
+
+    d->capabilitiesPath = QDir(dataPath).filePath("capabilities.dat");
+    d->capabilitiesTimer = new QTimer(this);
+    d->capabilitiesTimer->setInterval(1000);
+    d->capabilitiesTimer->setSingleShot(true);
+    connect(d->capabilitiesTimer, SIGNAL(timeout()), this, SLOT(_q_saveCapabilities()));
+    d->loadCapabilities();
 }
 
 VCardCache::~VCardCache()
 {
+    if (d->indexTimer->isActive())
+        _q_saveIndex();
+    if (d->capabilitiesTimer->isActive())
+        _q_saveCapabilities();
     delete d;
 }
 
@@ -675,60 +980,112 @@ ChatClient *VCardCache::client(const QString &jid) const
 
 VCard::Features VCardCache::features(const QString &jid) const
 {
-    VCard::Features features = 0;
-    foreach (ChatClient *client, d->clients) {
-        foreach (const QXmppPresence &presence, client->rosterManager()->getAllPresencesForBareJid(jid)) {
-            const QString fullJid = presence.from();
-            if (presence.type() == QXmppPresence::Available) {
-                if (d->features.contains(fullJid)) {
-                    features |= d->features.value(fullJid);
-                } else if (!d->discoQueue.contains(fullJid)) {
+    const QHash<QString, VCardPresence>::const_iterator presence = d->presences.constFind(jid);
+    if (presence == d->presences.constEnd())
+        return 0;
+
+    // resources without entity capabilities are discovered on demand
+    QHash<QString, VCardPresence::Resource>::const_iterator it;
+    for (it = presence->resources.constBegin(); it != presence->resources.constEnd(); ++it) {
+        const QString &fullJid = it.key();
+        if (!it->discovered && it->capabilities.isEmpty() && it->client && !d->discoQueue.contains(fullJid)) {
 #ifdef DEBUG_ROSTER
-                    qDebug("requesting disco %s", qPrintable(fullJid));
+            qDebug("requesting disco %s", qPrintable(fullJid));
 #endif
-                    client->discoveryManager()->requestInfo(fullJid);
-                    d->discoQueue.insert(fullJid);
-                }
-            }
+            it->client->discoveryManager()->requestInfo(fullJid);
+            d->discoQueue.insert(fullJid, QByteArray());
         }
     }
-    return features;
+    return presence->features;
 }
 
 /** Tries to get the vCard for the given JID.
  *
  *  Returns true if the vCard was found, otherwise requests the card.
  *
+ *  Only reading the full vCard into \a iq accesses the disk.
+ *
  * @param jid
  * @param iq
  */
 
 bool VCardCache::get(const QString &jid, QXmppVCardIq *iq)
 {
-    if (d->vcardQueue.contains(jid) || d->vcardFailed.contains(jid))
+    if (!entry(jid))
         return false;
+    return !iq || readIq(d->cache, QString("xmpp:%1?vcard").arg(jid), iq);
+}
 
-    if (readIq(d->cache, QString("xmpp:%1?vcard").arg(jid), iq))
-        return true;
-    ChatClient *client = this->client(jid);
-    if (client) {
-#ifdef DEBUG_ROSTER
-        qDebug("requesting vCard %s", qPrintable(jid));
-#endif
-        d->vcardQueue.insert(jid);
-        client->vCardManager().requestVCard(jid);
+/** Looks up a vCard in the resident index.
+ *
+ *  Returns 0 and requests the card if it is unknown. Expired cards are
+ *  returned, and refreshed in the background.
+ *
+ * @param jid
+ */
+const VCardCacheEntry *VCardCache::entry(const QString &jid)
+{
+    QHash<QString, VCardCacheEntry>::iterator it = d->entries.find(jid);
+    if (it == d->entries.end()) {
+        if (d->vcardQueue.contains(jid) || d->vcardFailed.contains(jid))
+            return 0;
+
+        // cards stored before the index existed are indexed once
+        const QUrl url(QString("xmpp:%1?vcard").arg(jid));
+        QXmppVCardIq vcard;
+        if (!readIq(d->cache, url, &vcard)) {
+            d->request(jid);
+            return 0;
+        }
+        it = d->entries.insert(jid, VCardCacheEntry(vcard, d->cache->metaData(url).expirationDate()));
+        AvatarCache::instance()->setPhotoHash(jid, it->photoHash);
+        d->indexTimer->start();
     }
-    return false;
+
+    if (it->expiry < QDateTime::currentDateTimeUtc())
+        d->request(jid);
+    return &it.value();
 }
 
 QUrl VCardCache::imageUrl(const QString &jid)
 {
-    if (get(jid))
+    if (entry(jid))
         return QUrl("image://roster/" + jid);
     else
         return QUrl("images/peer.png");
 }
 
+/** Returns the display name for the given JID.
+ *
+ *  The roster name takes precedence over the vCard's nickname and full
+ *  name. Names are cached until the roster entry or vCard changes.
+ *
+ * @param jid
+ */
+QString VCardCache::name(const QString &jid)
+{
+    QHash<QString, QString>::const_iterator it = d->names.constFind(jid);
+    if (it != d->names.constEnd())
+        return it.value();
+
+    QString name;
+    foreach (ChatClient *client, d->clients) {
+        name = client->rosterManager()->getRosterEntry(QXmppUtils::jidToBareJid(jid)).name();
+        if (!name.isEmpty())
+            break;
+    }
+    if (name.isEmpty()) {
+        const VCardCacheEntry *entry = this->entry(jid);
+        if (entry)
+            name = entry->nickName.isEmpty() ? entry->fullName : entry->nickName;
+    }
+    if (name.isEmpty())
+        name = QXmppUtils::jidToUser(jid);
+
+    d->names.insert(jid, name);
+    return name;
+}
+
 VCardCache *VCardCache::instance()
 {
     if (!vcardCache)
@@ -749,7 +1106,7 @@ void VCardCache::addClient(ChatClient *client)
     Q_ASSERT(check);
 
     check = connect(client, SIGNAL(disconnected()),
-                    this, SIGNAL(presenceChanged()));
+                    this, SLOT(_q_clientDisconnected()));
     Q_ASSERT(check);
 
     check = connect(client, SIGNAL(presenceReceived(QXmppPresence)),
@@ -757,11 +1114,15 @@ void VCardCache::addClient(ChatClient *client)
     Q_ASSERT(check);
 
     check = connect(client->rosterManager(), SIGNAL(itemAdded(QString)),
-                    this, SIGNAL(cardChanged(QString)));
+                    this, SLOT(_q_rosterItemChanged(QString)));
     Q_ASSERT(check);
 
     check = connect(client->rosterManager(), SIGNAL(itemChanged(QString)),
-                    this, SIGNAL(cardChanged(QString)));
+                    this, SLOT(_q_rosterItemChanged(QString)));
+    Q_ASSERT(check);
+
+    check = connect(client->rosterManager(), SIGNAL(rosterReceived()),
+                    this, SLOT(_q_rosterReceived()));
     Q_ASSERT(check);
 
     check = connect(&client->vCardManager(), SIGNAL(vCardReceived(QXmppVCardIq)),
@@ -775,30 +1136,17 @@ void VCardCache::addClient(ChatClient *client)
     d->clients << client;
 }
 
+/** Returns the status of the given bare JID's highest priority resource,
+ *  or "offline".
+ *
+ * @param jid
+ */
 QString VCardCache::presenceStatus(const QString &jid) const
 {
-    QString statusType = "offline";
-
-    foreach (ChatClient *client, d->clients) {
-        // NOTE : we test the connection status, otherwise we encounter a race
-        // condition upon disconnection, because the roster has not yet been cleared
-        if (!client->isConnected())
-            continue;
-
-        foreach (const QXmppPresence &presence, client->rosterManager()->getAllPresencesForBareJid(jid)) {
-            if (presence.type() != QXmppPresence::Available)
-                continue;
-
-            // FIXME : we should probably be using the priority rather than
-            // stop at the first available contact
-            const QString type = ChatClient::statusToString(presence.availableStatusType());
-            if (type == "available")
-                return type;
-            else
-                statusType = type;
-        }
-    }
-    return statusType;
+    QHash<QString, VCardPresence>::const_iterator it = d->presences.constFind(jid);
+    if (it == d->presences.constEnd())
+        return QLatin1String("offline");
+    return it->status;
 }
 
 QString VCardCache::subscriptionStatus(const QString &jid) const
@@ -823,13 +1171,30 @@ int VCardCache::subscriptionType(const QString &jid) const
 
 void VCardCache::_q_clientDestroyed(QObject *object)
 {
-    d->clients.removeAll(static_cast<ChatClient*>(object));
+    ChatClient *client = static_cast<ChatClient*>(object);
+    d->clients.removeAll(client);
+    d->names.clear();
+    d->removePresences(client);
+}
+
+void VCardCache::_q_clientDisconnected()
+{
+    ChatClient *client = qobject_cast<ChatClient*>(sender());
+    if (client)
+        d->removePresences(client);
 }
 
 void VCardCache::_q_discoveryInfoReceived(const QXmppDiscoveryIq &disco)
 {
     const QString jid = disco.from();
-    if (!d->discoQueue.remove(jid) || disco.type() != QXmppIq::Result)
+    QHash<QString, QByteArray>::iterator pending = d->discoQueue.find(jid);
+    if (pending == d->discoQueue.end())
+        return;
+    QByteArray ver = pending.value();
+    d->discoQueue.erase(pending);
+    if (!ver.isEmpty())
+        d->capabilitiesQueue.remove(ver);
+    if (disco.type() != QXmppIq::Result)
         return;
 
 #ifdef DEBUG_ROSTER
@@ -853,9 +1218,43 @@ void VCardCache::_q_discoveryInfoReceived(const QXmppDiscoveryIq &disco)
         if (id.name() == QLatin1String("iChatAgent"))
             features |= VCard::ChatStatesFeature;
     }
-    d->features.insert(jid, features);
 
-    emit discoChanged(QXmppUtils::jidToBareJid(jid));
+    // store the features of verified capabilities
+    if (!ver.isEmpty()) {
+        if (disco.verificationString() == ver) {
+            d->capabilities.insert(ver, features);
+            d->capabilitiesTimer->start();
+        } else {
+            qWarning("Received invalid capabilities from %s", qPrintable(jid));
+            ver.clear();
+        }
+    }
+
+    // update the resources, which for known capabilities may span contacts
+    QStringList discoChanged;
+    const QStringList bareJids = ver.isEmpty() ? QStringList(QXmppUtils::jidToBareJid(jid)) : d->presences.keys();
+    foreach (const QString &bareJid, bareJids) {
+        QHash<QString, VCardPresence>::iterator it = d->presences.find(bareJid);
+        if (it == d->presences.end())
+            continue;
+        bool changed = false;
+        QHash<QString, VCardPresence::Resource>::iterator resource;
+        for (resource = it->resources.begin(); resource != it->resources.end(); ++resource) {
+            if (!resource->discovered && (ver.isEmpty() ? resource.key() == jid : resource->capabilities == ver)) {
+                resource->discovered = true;
+                resource->features = features;
+                changed = true;
+            }
+        }
+        if (changed) {
+            const VCard::Features oldFeatures = it->features;
+            it->update();
+            if (it->features != oldFeatures)
+                discoChanged << bareJid;
+        }
+    }
+    foreach (const QString &bareJid, discoChanged)
+        notifyDisco(bareJid);
 }
 
 void VCardCache::_q_presenceReceived(const QXmppPresence &presence)
@@ -864,11 +1263,164 @@ void VCardCache::_q_presenceReceived(const QXmppPresence &presence)
     if (QXmppUtils::jidToResource(jid).isEmpty())
         return;
 
-    if ((presence.type() == QXmppPresence::Available && !d->features.contains(jid)) ||
-        (presence.type() == QXmppPresence::Unavailable && d->features.remove(jid)))
-        emit discoChanged(QXmppUtils::jidToBareJid(jid));
+    // update the aggregated presence
+    const QString bareJid = QXmppUtils::jidToBareJid(jid);
+    VCard::Features oldFeatures = 0, newFeatures = 0;
+    if (presence.type() == QXmppPresence::Available) {
+        VCardPresence::Resource resource;
+        resource.client = qobject_cast<ChatClient*>(sender());
+        resource.priority = presence.priority();
+        resource.status = presence.availableStatusType();
+        resource.discovered = false;
+        resource.features = 0;
+
+        // only SHA-1 verification strings identify a set of features
+        if (presence.capabilityHash() == QLatin1String("sha-1"))
+            resource.capabilities = presence.capabilityVer();
+
+        VCardPresence &record = d->presences[bareJid];
+        oldFeatures = record.features;
+        QHash<QString, VCardPresence::Resource>::const_iterator previous = record.resources.constFind(jid);
+        if (previous != record.resources.constEnd() && previous->discovered &&
+            previous->capabilities == resource.capabilities) {
+            resource.discovered = true;
+            resource.features = previous->features;
+        } else if (!resource.capabilities.isEmpty()) {
+            const QByteArray &ver = resource.capabilities;
+            QHash<QByteArray, VCard::Features>::const_iterator found = d->capabilities.constFind(ver);
+            if (found != d->capabilities.constEnd()) {
+                resource.discovered = true;
+                resource.features = found.value();
+            } else if (resource.client && !d->capabilitiesQueue.contains(ver)) {
+                // query each unknown verification string only once
+#ifdef DEBUG_ROSTER
+                qDebug("requesting capabilities %s", ver.toBase64().constData());
+#endif
+                resource.client->discoveryManager()->requestInfo(jid, presence.capabilityNode() + "#" + QString::fromLatin1(ver.toBase64()));
+                d->capabilitiesQueue.insert(ver);
+                d->discoQueue.insert(jid, ver);
+            }
+        }
+
+        record.resources.insert(jid, resource);
+        record.update();
+        newFeatures = record.features;
+    } else if (presence.type() == QXmppPresence::Unavailable) {
+        QHash<QString, VCardPresence>::iterator it = d->presences.find(bareJid);
+        if (it != d->presences.end() && it->resources.remove(jid)) {
+            oldFeatures = it->features;
+            if (it->resources.isEmpty()) {
+                d->presences.erase(it);
+            } else {
+                it->update();
+                newFeatures = it->features;
+            }
+        }
+    }
+
+    if (newFeatures != oldFeatures)
+        notifyDisco(bareJid);
 
-    emit presenceChanged(QXmppUtils::jidToBareJid(jid));
+    d->presenceQueue << bareJid;
+    d->presenceTimer->start();
+}
+
+void VCardCache::_q_presenceFlush()
+{
+    const QStringList jids = d->presenceQueue.toList();
+    d->presenceQueue.clear();
+
+    int notified = 0;
+    foreach (const QString &jid, jids) {
+        QMultiHash<QString, VCard*>::const_iterator it = d->cards.constFind(jid);
+        for ( ; it != d->cards.constEnd() && it.key() == jid; ++it) {
+            emit it.value()->statusChanged();
+            notified++;
+        }
+    }
+#ifdef DEBUG_ROSTER
+    qDebug("notified %i cards of %i presence changes", notified, jids.size());
+#else
+    Q_UNUSED(notified);
+#endif
+    emit presencesChanged(jids);
+}
+
+void VCardCache::_q_rosterItemChanged(const QString &jid)
+{
+    d->names.remove(jid);
+    notifyCard(jid);
+}
+
+void VCardCache::_q_rosterReceived()
+{
+    QXmppRosterManager *rosterManager = qobject_cast<QXmppRosterManager*>(sender());
+    if (!rosterManager)
+        return;
+
+    foreach (const QString &jid, rosterManager->getRosterBareJids()) {
+        if (d->names.remove(jid))
+            notifyCard(jid);
+    }
+}
+
+/** Updates the VCard objects for the given JID, then emits cardChanged().
+ */
+void VCardCache::notifyCard(const QString &jid)
+{
+    foreach (VCard *card, d->cards.values(jid))
+        card->update();
+    emit cardChanged(jid);
+}
+
+/** Notifies the VCard objects for the given bare JID that its features
+ *  changed, then emits discoChanged().
+ */
+void VCardCache::notifyDisco(const QString &jid)
+{
+    foreach (VCard *card, d->cards.values(jid))
+        emit card->featuresChanged();
+    emit discoChanged(jid);
+}
+
+void VCardCache::_q_saveCapabilities()
+{
+    d->capabilitiesTimer->stop();
+
+    QSaveFile file(d->capabilitiesPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning("Could not write capabilities index %s", qPrintable(d->capabilitiesPath));
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << CAPS_INDEX_MAGIC << CAPS_INDEX_VERSION << quint32(d->capabilities.size());
+    QHash<QByteArray, VCard::Features>::const_iterator it;
+    for (it = d->capabilities.constBegin(); it != d->capabilities.constEnd(); ++it)
+        stream << it.key() << quint32(it.value());
+    file.commit();
+}
+
+void VCardCache::_q_saveIndex()
+{
+    d->indexTimer->stop();
+
+    QSaveFile file(d->indexPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning("Could not write vCard index %s", qPrintable(d->indexPath));
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << VCARD_INDEX_MAGIC << VCARD_INDEX_VERSION << quint32(d->entries.size());
+    QHash<QString, VCardCacheEntry>::const_iterator it;
+    for (it = d->entries.constBegin(); it != d->entries.constEnd(); ++it) {
+        const VCardCacheEntry &entry = it.value();
+        stream << it.key() << entry.expiry << entry.fullName << entry.nickName << entry.photoHash << entry.url;
+    }
+    file.commit();
 }
 
 void VCardCache::_q_vCardReceived(const QXmppVCardIq& vCard)
@@ -882,8 +1434,13 @@ void VCardCache::_q_vCardReceived(const QXmppVCardIq& vCard)
         qDebug("received vCard %s", qPrintable(jid));
 #endif
         d->vcardFailed.remove(jid);
-        writeIq(d->cache, QString("xmpp:%1?vcard").arg(jid), vCard, 3600);
-        emit cardChanged(jid);
+        writeIq(d->cache, QString("xmpp:%1?vcard").arg(jid), vCard, VCARD_CACHE_SECONDS);
+        const VCardCacheEntry entry(vCard, QDateTime::currentDateTimeUtc().addSecs(VCARD_CACHE_SECONDS));
+        d->entries.insert(jid, entry);
+        AvatarCache::instance()->setPhotoHash(jid, entry.photoHash);
+        d->indexTimer->start();
+        d->names.remove(jid);
+        notifyCard(jid);
     } else if (vCard.type() == QXmppIq::Error) {
 #ifdef DEBUG_ROSTER
         qWarning("failed vCard %s", qPrintable(jid));
@@ -22,6 +22,7 @@
 
 #include <QQuickImageProvider>
 #include <QSet>
+#include <QStringList>
 #include <QUrl>
 
 #include <QXmppPresence.h>
@@ -37,13 +38,14 @@ class ChatClient;
 class RosterModel;
 class RosterModelPrivate;
 class VCardCache;
+class VCardCacheEntry;
 class VCardCachePrivate;
 
 class RosterImageProvider : public QQuickImageProvider
 {
 public:
     RosterImageProvider();
-    QPixmap requestPixmap(const QString &id, QSize *size, const QSize &requestedSize);
+    QImage requestImage(const QString &id, QSize *size, const QSize &requestedSize);
 };
 
 class RosterModel : public ChatModel
@@ -69,10 +71,12 @@ public:
     // QAbstractItemModel interface
     QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
     bool setData(const QModelIndex &index, const QVariant &value, int role = Qt::EditRole);
+    bool removeRows(int row, int count, const QModelIndex &parent = QModelIndex());
     QHash<int, QByteArray> roleNames() const;
 
 signals:
     void pendingMessagesChanged();
+    void rosterLoaded(int entries, int msecs);
 
 public slots:
     void addPendingMessage(const QString &bareJid);
@@ -86,6 +90,7 @@ private slots:
     void _q_itemAdded(const QString &jid);
     void _q_itemChanged(const QString &jid);
     void _q_itemRemoved(const QString &jid);
+    void _q_presencesChanged(const QStringList &jids);
     void _q_rosterPurge();
     void _q_rosterReceived();
 
@@ -117,6 +122,7 @@ public:
     Q_DECLARE_FLAGS(Features, Feature)
 
     VCard(QObject *parent = 0);
+    ~VCard();
 
     QUrl avatar() const;
     Features features() const;
@@ -139,11 +145,6 @@ signals:
 public slots:
     QString jidForFeature(Feature feature) const;
 
-private slots:
-    void _q_cardChanged(const QString &jid);
-    void _q_discoChanged(const QString &jid);
-    void _q_presenceChanged(const QString &jid);
-
 private:
     void update();
 
@@ -154,6 +155,7 @@ private:
     QString m_name;
     QString m_nickName;
     QUrl m_url;
+    friend class VCardCache;
 };
 
 class VCardCache : public QObject
@@ -165,6 +167,7 @@ public:
     ~VCardCache();
     
     QUrl imageUrl(const QString &jid);
+    QString name(const QString &jid);
     QString presenceStatus(const QString &jid) const;
     QString subscriptionStatus(const QString &jid) const;
     int subscriptionType(const QString &jid) const;
@@ -172,7 +175,7 @@ public:
 signals:
     void cardChanged(const QString &jid);
     void discoChanged(const QString &jid);
-    void presenceChanged(const QString &jid = QString());
+    void presencesChanged(const QStringList &jids);
 
 public slots:
     void addClient(ChatClient *client);
@@ -180,17 +183,27 @@ public slots:
 
 private slots:
     void _q_clientDestroyed(QObject *object);
+    void _q_clientDisconnected();
     void _q_discoveryInfoReceived(const QXmppDiscoveryIq &disco);
+    void _q_presenceFlush();
     void _q_presenceReceived(const QXmppPresence &presence);
+    void _q_rosterItemChanged(const QString &jid);
+    void _q_rosterReceived();
+    void _q_saveCapabilities();
+    void _q_saveIndex();
     void _q_vCardReceived(const QXmppVCardIq&);
 
 private:
     VCardCache(QObject *parent = 0);
     ChatClient *client(const QString &jid) const;
+    const VCardCacheEntry *entry(const QString &jid);
     VCard::Features features(const QString &jid) const;
+    void notifyCard(const QString &jid);
+    void notifyDisco(const QString &jid);
 
     VCardCachePrivate *d;
     friend class VCard;
+    friend class VCardCachePrivate;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(VCard::Features)
@@ -0,0 +1,609 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include <QMap>
+#include <QTimer>
+#include <QVector>
+
+#include "archive.h"
+#include "client.h"
+#include "search.h"
+
+#define SEARCH_LIMIT 50
+#define SEARCH_PREFIX_MIN_LENGTH 2
+#define SEARCH_SNIPPET_BEFORE 30
+#define SEARCH_SNIPPET_LENGTH 120
+
+static HistorySearchIndex *theIndex = 0;
+
+/** A message of the archive, whose sender and body are read from disk
+ *  when it is returned as a result.
+ */
+class HistorySearchDocument
+{
+public:
+    // empty once the conversation is removed
+    QString with;
+    qint64 msecs;
+    qint64 offset;
+    int length;
+};
+
+/** The inverted index of an account's messages.
+ */
+class HistorySearchAccount
+{
+public:
+    HistorySearchAccount();
+    void add(const QString &with, const HistoryMessage &message, qint64 offset);
+    void remove(const QString &with);
+
+    QVector<HistorySearchDocument> documents;
+    int removedDocuments;
+    // conversations which remain to be read from the archive
+    QStringList pendingConversations;
+    // documents containing each token, in increasing order
+    QMap<QString, QVector<int> > postings;
+    // documents of each conversation, in increasing order
+    QHash<QString, QVector<int> > conversations;
+
+private:
+    void compact();
+};
+
+HistorySearchAccount::HistorySearchAccount()
+    : removedDocuments(0)
+{
+}
+
+void HistorySearchAccount::add(const QString &with, const HistoryMessage &message, qint64 offset)
+{
+    const int id = documents.size();
+
+    HistorySearchDocument document;
+    document.with = with;
+    document.msecs = message.date.toMSecsSinceEpoch();
+    document.offset = offset;
+    document.length = message.body.size();
+    documents << document;
+
+    QStringList tokens = HistorySearchIndex::tokenize(message.body);
+    tokens.removeDuplicates();
+    foreach (const QString &token, tokens)
+        postings[token] << id;
+    conversations[with] << id;
+}
+
+/** Removes the documents of a conversation, reclaiming their space once
+ *  they make up a quarter of the index.
+ */
+void HistorySearchAccount::remove(const QString &with)
+{
+    pendingConversations.removeAll(with);
+    foreach (int id, conversations.take(with)) {
+        documents[id].with.clear();
+        removedDocuments++;
+    }
+    if (removedDocuments * 4 > documents.size())
+        compact();
+}
+
+/** Drops the removed documents and renumbers the others.
+ */
+void HistorySearchAccount::compact()
+{
+    QVector<int> ids(documents.size(), -1);
+    QVector<HistorySearchDocument> kept;
+    kept.reserve(documents.size() - removedDocuments);
+    for (int i = 0; i < documents.size(); ++i) {
+        if (!documents.at(i).with.isEmpty()) {
+            ids[i] = kept.size();
+            kept << documents.at(i);
+        }
+    }
+    documents = kept;
+    removedDocuments = 0;
+
+    QMap<QString, QVector<int> >::iterator it = postings.begin();
+    while (it != postings.end()) {
+        QVector<int> list;
+        foreach (int id, it.value()) {
+            if (ids.at(id) >= 0)
+                list << ids.at(id);
+        }
+        if (list.isEmpty()) {
+            it = postings.erase(it);
+        } else {
+            it.value() = list;
+            ++it;
+        }
+    }
+
+    QHash<QString, QVector<int> >::iterator conversation;
+    for (conversation = conversations.begin(); conversation != conversations.end(); ++conversation) {
+        for (int i = 0; i < conversation.value().size(); ++i)
+            conversation.value()[i] = ids.at(conversation.value().at(i));
+    }
+}
+
+class HistorySearchIndexPrivate
+{
+public:
+    HistorySearchAccount *account(const QString &account);
+
+    QHash<QString, HistorySearchAccount*> accounts;
+    QTimer *buildTimer;
+};
+
+/** Returns the index of an account, starting to build it if needed.
+ *
+ * The conversations are read from the archive one at a time when control
+ * returns to the event loop, so the index may be incomplete.
+ */
+HistorySearchAccount *HistorySearchIndexPrivate::account(const QString &account)
+{
+    HistorySearchAccount *index = accounts.value(account);
+    if (!index) {
+        index = new HistorySearchAccount;
+        index->pendingConversations = HistoryArchive::instance()->conversations(account);
+        accounts.insert(account, index);
+        if (!index->pendingConversations.isEmpty())
+            buildTimer->start();
+    }
+    return index;
+}
+
+// a matching document, before its message is read
+class HistorySearchMatch
+{
+public:
+    int id;
+    qint64 msecs;
+    float score;
+};
+
+static bool matchLessThan(const HistorySearchMatch &a, const HistorySearchMatch &b)
+{
+    if (a.score != b.score)
+        return a.score > b.score;
+    return a.msecs > b.msecs;
+}
+
+static bool sizeLessThan(const QVector<int> &a, const QVector<int> &b)
+{
+    return a.size() < b.size();
+}
+
+HistorySearchIndex::HistorySearchIndex(QObject *parent)
+    : QObject(parent)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    d = new HistorySearchIndexPrivate;
+    d->buildTimer = new QTimer(this);
+    d->buildTimer->setInterval(0);
+    check = connect(d->buildTimer, SIGNAL(timeout()),
+                    this, SLOT(_q_buildIndex()));
+    Q_ASSERT(check);
+
+    check = connect(HistoryArchive::instance(), SIGNAL(messagesAdded(QString,QString,QList<HistoryMessage>,QList<qint64>)),
+                    this, SLOT(_q_messagesAdded(QString,QString,QList<HistoryMessage>,QList<qint64>)));
+    Q_ASSERT(check);
+
+    check = connect(HistoryArchive::instance(), SIGNAL(messagesRemoved(QString,QString)),
+                    this, SLOT(_q_messagesRemoved(QString,QString)));
+    Q_ASSERT(check);
+}
+
+HistorySearchIndex::~HistorySearchIndex()
+{
+    qDeleteAll(d->accounts);
+    delete d;
+}
+
+/** Returns the HistorySearchIndex instance.
+ */
+HistorySearchIndex *HistorySearchIndex::instance()
+{
+    if (!theIndex)
+        theIndex = new HistorySearchIndex;
+    return theIndex;
+}
+
+/** Searches the messages of an account.
+ *
+ * All the terms must be found in a message for it to match, and the last
+ * term also matches words which start with it if it is at least
+ * SEARCH_PREFIX_MIN_LENGTH characters long, so that results can be shown
+ * as the user types.
+ *
+ * While the index of the account is being built, only the conversations
+ * read so far are searched and indexChanged() is emitted as more are read.
+ *
+ * @param account the bare JID of the local account
+ * @param terms the search terms, as returned by tokenize()
+ * @param with if not empty, only the messages exchanged with this contact or room are searched
+ * @param from if valid, only messages sent after this date are searched
+ * @param to if valid, only messages sent before this date are searched
+ * @param limit the maximum number of results
+ */
+QList<HistorySearchResult> HistorySearchIndex::search(const QString &account, const QStringList &terms,
+                                                      const QString &with, const QDateTime &from, const QDateTime &to,
+                                                      int limit)
+{
+    QList<HistorySearchResult> results;
+    if (account.isEmpty() || terms.isEmpty())
+        return results;
+
+    HistorySearchAccount *index = d->account(account);
+    const int documentCount = index->documents.size() - index->removedDocuments;
+
+    // collect the documents matching each term
+    QList<QVector<int> > lists;
+    float weight = 0;
+    for (int i = 0; i < terms.size(); ++i) {
+        QVector<int> list;
+        if (i < terms.size() - 1 || terms.at(i).size() < SEARCH_PREFIX_MIN_LENGTH) {
+            list = index->postings.value(terms.at(i));
+        } else {
+            // merge the documents of every word starting with the term
+            QMap<QString, QVector<int> >::const_iterator it = index->postings.lowerBound(terms.at(i));
+            for (; it != index->postings.constEnd() && it.key().startsWith(terms.at(i)); ++it)
+                list += it.value();
+            std::sort(list.begin(), list.end());
+            list.erase(std::unique(list.begin(), list.end()), list.end());
+        }
+        if (list.isEmpty())
+            return results;
+
+        // rare terms weigh more
+        weight += std::log(1.0f + float(documentCount) / list.size());
+        lists << list;
+    }
+    if (!with.isEmpty())
+        lists << index->conversations.value(with);
+
+    // intersect the lists, starting with the shortest
+    std::sort(lists.begin(), lists.end(), sizeLessThan);
+    QVector<int> candidates = lists.first();
+    for (int i = 1; i < lists.size() && !candidates.isEmpty(); ++i) {
+        QVector<int> intersection(qMin(candidates.size(), lists.at(i).size()));
+        QVector<int>::iterator end = std::set_intersection(candidates.constBegin(), candidates.constEnd(),
+                                                           lists.at(i).constBegin(), lists.at(i).constEnd(),
+                                                           intersection.begin());
+        intersection.resize(end - intersection.begin());
+        candidates = intersection;
+    }
+
+    // rank matches, favouring short and recent messages
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const qint64 fromMsecs = from.isValid() ? from.toMSecsSinceEpoch() : Q_INT64_C(0);
+    const qint64 toMsecs = to.isValid() ? to.toMSecsSinceEpoch() : Q_INT64_C(0);
+    QVector<HistorySearchMatch> matches;
+    foreach (int id, candidates) {
+        const HistorySearchDocument &document = index->documents.at(id);
+        if (document.with.isEmpty() ||
+            (from.isValid() && document.msecs < fromMsecs) ||
+            (to.isValid() && document.msecs > toMsecs))
+            continue;
+
+        const float length = 1.0f + std::log(1.0f + document.length / 40.0f);
+        const float recency = 1.0f / (1.0f + (now - document.msecs) / (365.0f * 86400000.0f));
+        HistorySearchMatch match;
+        match.id = id;
+        match.msecs = document.msecs;
+        match.score = weight / length * (0.75f + 0.25f * recency);
+        matches << match;
+    }
+
+    if (limit >= 0 && matches.size() > limit) {
+        std::partial_sort(matches.begin(), matches.begin() + limit, matches.end(), matchLessThan);
+        matches.resize(limit);
+    } else {
+        std::sort(matches.begin(), matches.end(), matchLessThan);
+    }
+
+    // only read the messages which are returned
+    HistoryArchive *archive = HistoryArchive::instance();
+    foreach (const HistorySearchMatch &match, matches) {
+        const HistorySearchDocument &document = index->documents.at(match.id);
+        HistoryMessage message;
+        if (!archive->message(account, document.with, document.offset, &message))
+            continue;
+
+        HistorySearchResult result;
+        result.with = document.with;
+        result.jid = message.jid;
+        result.date = message.date;
+        result.body = message.body;
+        result.score = match.score;
+        results << result;
+    }
+    return results;
+}
+
+/** Splits text into lowercase words.
+ *
+ * @param text
+ */
+QStringList HistorySearchIndex::tokenize(const QString &text)
+{
+    QStringList tokens;
+    int start = -1;
+    for (int i = 0; i <= text.size(); ++i) {
+        const bool letter = i < text.size() && text.at(i).isLetterOrNumber();
+        if (letter && start < 0) {
+            start = i;
+        } else if (!letter && start >= 0) {
+            tokens << text.mid(start, i - start).toLower();
+            start = -1;
+        }
+    }
+    return tokens;
+}
+
+/** Reads the next conversation which remains to be indexed.
+ */
+void HistorySearchIndex::_q_buildIndex()
+{
+    QHash<QString, HistorySearchAccount*>::const_iterator it;
+    for (it = d->accounts.constBegin(); it != d->accounts.constEnd(); ++it) {
+        HistorySearchAccount *index = it.value();
+        if (index->pendingConversations.isEmpty())
+            continue;
+
+        const QString with = index->pendingConversations.takeFirst();
+        QList<qint64> offsets;
+        const QList<HistoryMessage> messages = HistoryArchive::instance()->messages(it.key(), with, QDateTime(), -1, &offsets);
+        for (int i = 0; i < messages.size(); ++i)
+            index->add(with, messages.at(i), offsets.at(i));
+        emit indexChanged(it.key());
+        return;
+    }
+    d->buildTimer->stop();
+}
+
+void HistorySearchIndex::_q_messagesAdded(const QString &account, const QString &with, const QList<HistoryMessage> &messages, const QList<qint64> &offsets)
+{
+    // conversations which are not indexed yet will be read from the archive
+    HistorySearchAccount *index = d->accounts.value(account);
+    if (index && !index->pendingConversations.contains(with)) {
+        for (int i = 0; i < messages.size(); ++i)
+            index->add(with, messages.at(i), offsets.at(i));
+    }
+}
+
+void HistorySearchIndex::_q_messagesRemoved(const QString &account, const QString &with)
+{
+    HistorySearchAccount *index = d->accounts.value(account);
+    if (index)
+        index->remove(with);
+}
+
+/** Returns an HTML excerpt of the body around the first match, with the
+ *  matching words in bold.
+ */
+static QString snippet(const QString &body, const QStringList &terms)
+{
+    int first = -1;
+    foreach (const QString &term, terms) {
+        const int pos = body.indexOf(term, 0, Qt::CaseInsensitive);
+        if (pos >= 0 && (first < 0 || pos < first))
+            first = pos;
+    }
+
+    const int start = qMax(0, first - SEARCH_SNIPPET_BEFORE);
+    const int end = qMin(body.size(), start + SEARCH_SNIPPET_LENGTH);
+    QString html;
+    if (start > 0)
+        html += QChar(0x2026);
+
+    int pos = start;
+    while (pos < end) {
+        if (!body.at(pos).isLetterOrNumber()) {
+            html += QString(body.at(pos)).toHtmlEscaped();
+            ++pos;
+            continue;
+        }
+
+        int wordEnd = pos;
+        while (wordEnd < body.size() && body.at(wordEnd).isLetterOrNumber())
+            ++wordEnd;
+        const QString word = body.mid(pos, wordEnd - pos);
+        const QString lowerWord = word.toLower();
+
+        bool match = false;
+        for (int i = 0; i < terms.size() && !match; ++i) {
+            if (i == terms.size() - 1 && terms.at(i).size() >= SEARCH_PREFIX_MIN_LENGTH)
+                match = lowerWord.startsWith(terms.at(i));
+            else
+                match = lowerWord == terms.at(i);
+        }
+        if (match)
+            html += "<b>" + word.toHtmlEscaped() + "</b>";
+        else
+            html += word.toHtmlEscaped();
+        pos = wordEnd;
+    }
+    if (pos < body.size())
+        html += QChar(0x2026);
+    return html;
+}
+
+class HistorySearchItem : public ChatModelItem
+{
+public:
+    HistorySearchResult result;
+    QString snippet;
+};
+
+/** Constructs a new HistorySearchModel.
+ *
+ * @param parent
+ */
+HistorySearchModel::HistorySearchModel(QObject *parent)
+    : ChatModel(parent),
+    m_client(0)
+{
+    m_timer = new QTimer(this);
+    m_timer->setSingleShot(true);
+    m_timer->setInterval(100);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(refresh()));
+    connect(HistorySearchIndex::instance(), SIGNAL(indexChanged(QString)),
+            this, SLOT(_q_indexChanged(QString)));
+}
+
+ChatClient *HistorySearchModel::client() const
+{
+    return m_client;
+}
+
+void HistorySearchModel::setClient(ChatClient *client)
+{
+    if (client != m_client) {
+        m_client = client;
+        emit clientChanged(m_client);
+        m_timer->start();
+    }
+}
+
+QDateTime HistorySearchModel::from() const
+{
+    return m_from;
+}
+
+void HistorySearchModel::setFrom(const QDateTime &from)
+{
+    if (from != m_from) {
+        m_from = from;
+        emit fromChanged(m_from);
+        m_timer->start();
+    }
+}
+
+QString HistorySearchModel::jid() const
+{
+    return m_jid;
+}
+
+void HistorySearchModel::setJid(const QString &jid)
+{
+    if (jid != m_jid) {
+        m_jid = jid;
+        emit jidChanged(m_jid);
+        m_timer->start();
+    }
+}
+
+QString HistorySearchModel::query() const
+{
+    return m_query;
+}
+
+void HistorySearchModel::setQuery(const QString &query)
+{
+    if (query != m_query) {
+        m_query = query;
+        m_terms = HistorySearchIndex::tokenize(query);
+        emit queryChanged(m_query);
+        m_timer->start();
+    }
+}
+
+QDateTime HistorySearchModel::to() const
+{
+    return m_to;
+}
+
+void HistorySearchModel::setTo(const QDateTime &to)
+{
+    if (to != m_to) {
+        m_to = to;
+        emit toChanged(m_to);
+        m_timer->start();
+    }
+}
+
+QVariant HistorySearchModel::data(const QModelIndex &index, int role) const
+{
+    HistorySearchItem *item = static_cast<HistorySearchItem*>(index.internalPointer());
+    if (!index.isValid() || !item)
+        return QVariant();
+
+    if (role == ChatModel::JidRole)
+        return item->result.with;
+    else if (role == BodyRole)
+        return item->result.body;
+    else if (role == DateRole)
+        return item->result.date;
+    else if (role == FromRole)
+        return item->result.jid;
+    else if (role == ScoreRole)
+        return item->result.score;
+    else if (role == SnippetRole)
+        return item->snippet;
+    return QVariant();
+}
+
+QHash<int, QByteArray> HistorySearchModel::roleNames() const
+{
+    QHash<int, QByteArray> roleNames;
+    roleNames.insert(ChatModel::JidRole, "jid");
+    roleNames.insert(BodyRole, "body");
+    roleNames.insert(DateRole, "date");
+    roleNames.insert(FromRole, "from");
+    roleNames.insert(ScoreRole, "score");
+    roleNames.insert(SnippetRole, "snippet");
+    return roleNames;
+}
+
+void HistorySearchModel::_q_indexChanged(const QString &account)
+{
+    // show the results from newly indexed conversations
+    if (m_client && !m_terms.isEmpty() && !m_timer->isActive() &&
+        account == m_client->configuration().jidBare())
+        m_timer->start();
+}
+
+/** Runs the search again.
+ */
+void HistorySearchModel::refresh()
+{
+    m_timer->stop();
+
+    QList<HistorySearchResult> results;
+    if (m_client) {
+        results = HistorySearchIndex::instance()->search(m_client->configuration().jidBare(),
+            m_terms, m_jid, m_from, m_to, SEARCH_LIMIT);
+    }
+
+    removeRows(0, rootItem->children.size());
+    QList<ChatModelItem*> items;
+    foreach (const HistorySearchResult &result, results) {
+        HistorySearchItem *item = new HistorySearchItem;
+        item->result = result;
+        item->snippet = snippet(result.body, m_terms);
+        items << item;
+    }
+    addItems(items, rootItem);
+}
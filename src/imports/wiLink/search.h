@@ -0,0 +1,149 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_CHAT_SEARCH_H__
+#define __WILINK_CHAT_SEARCH_H__
+
+#include <QDateTime>
+#include <QStringList>
+
+#include "history.h"
+#include "model.h"
+
+class QTimer;
+class ChatClient;
+class HistorySearchIndexPrivate;
+
+/** A message which matches a search.
+ */
+class HistorySearchResult
+{
+public:
+    QString with;
+    QString jid;
+    QDateTime date;
+    QString body;
+    float score;
+};
+
+/** The HistorySearchIndex class maintains an inverted index over the
+ *  messages stored in the HistoryArchive.
+ *
+ *  The index of an account is built in the background the first time it
+ *  is searched, one conversation at a time, then kept up to date as
+ *  messages are stored.
+ *
+ *  Only the tokens, date and archive offset of each message are kept in
+ *  memory, the messages themselves being read from the archive when they
+ *  are returned.
+ */
+class HistorySearchIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    static HistorySearchIndex *instance();
+    ~HistorySearchIndex();
+
+    QList<HistorySearchResult> search(const QString &account, const QStringList &terms,
+                                      const QString &with, const QDateTime &from, const QDateTime &to,
+                                      int limit);
+
+    static QStringList tokenize(const QString &text);
+
+signals:
+    /// This signal is emitted when more of an account's messages have been indexed.
+    void indexChanged(const QString &account);
+
+private slots:
+    void _q_buildIndex();
+    void _q_messagesAdded(const QString &account, const QString &with, const QList<HistoryMessage> &messages, const QList<qint64> &offsets);
+    void _q_messagesRemoved(const QString &account, const QString &with);
+
+private:
+    HistorySearchIndex(QObject *parent = 0);
+    HistorySearchIndexPrivate *d;
+};
+
+/** The HistorySearchModel class represents the messages which match a
+ *  search query, best matches first.
+ */
+class HistorySearchModel : public ChatModel
+{
+    Q_OBJECT
+    Q_PROPERTY(ChatClient* client READ client WRITE setClient NOTIFY clientChanged)
+    Q_PROPERTY(QDateTime from READ from WRITE setFrom NOTIFY fromChanged)
+    Q_PROPERTY(QString jid READ jid WRITE setJid NOTIFY jidChanged)
+    Q_PROPERTY(QString query READ query WRITE setQuery NOTIFY queryChanged)
+    Q_PROPERTY(QDateTime to READ to WRITE setTo NOTIFY toChanged)
+
+public:
+    enum Role {
+        BodyRole = ChatModel::UserRole,
+        DateRole,
+        FromRole,
+        ScoreRole,
+        SnippetRole
+    };
+
+    HistorySearchModel(QObject *parent = 0);
+
+    ChatClient *client() const;
+    void setClient(ChatClient *client);
+
+    QDateTime from() const;
+    void setFrom(const QDateTime &from);
+
+    QString jid() const;
+    void setJid(const QString &jid);
+
+    QString query() const;
+    void setQuery(const QString &query);
+
+    QDateTime to() const;
+    void setTo(const QDateTime &to);
+
+    // QAbstractItemModel
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    QHash<int, QByteArray> roleNames() const;
+
+signals:
+    void clientChanged(ChatClient *client);
+    void fromChanged(const QDateTime &from);
+    void jidChanged(const QString &jid);
+    void queryChanged(const QString &query);
+    void toChanged(const QDateTime &to);
+
+public slots:
+    void refresh();
+
+private slots:
+    void _q_indexChanged(const QString &account);
+
+private:
+    ChatClient *m_client;
+    QDateTime m_from;
+    QString m_jid;
+    QString m_query;
+    QStringList m_terms;
+    QTimer *m_timer;
+    QDateTime m_to;
+};
+
+#endif
@@ -0,0 +1,505 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+
+#include <QAudioFormat>
+#include <QElapsedTimer>
+#include <QSysInfo>
+#include <QVector>
+
+#include "QSoundJitterBuffer.h"
+
+// length of the period which is repeated to conceal missing samples
+static const int CONCEAL_PERIOD_MS = 10;
+// concealment fades to silence after this duration
+static const int CONCEAL_MAXIMUM_MS = 60;
+// tolerance around the target before time-stretching kicks in
+static const int HYSTERESIS_MS = 20;
+// latency added to the target for each underrun
+static const int UNDERRUN_PENALTY_MS = 20;
+// the underrun penalty decays by DECAY_STEP_MS every DECAY_INTERVAL_MS
+static const int DECAY_INTERVAL_MS = 2000;
+static const int DECAY_STEP_MS = 5;
+
+class QSoundJitterBufferPrivate
+{
+public:
+    QSoundJitterBufferPrivate(QSoundJitterBuffer *qq);
+
+    int availableFrames() const;
+    int framesToMsecs(qint64 frames) const;
+    int msecsToFrames(int msecs) const;
+
+    int fetch(int maxFrames);
+    void compact();
+    void take(qint16 *out, int frames);
+    void compress(qint16 *out, int frames, int maxDrop);
+    void expand(qint16 *out, int frames, int maxInsert);
+    void conceal(qint16 *out, int frames);
+    void remember(const qint16 *out, int frames);
+    int bestOffset(const qint16 *ref, const qint16 *candidates, int minOffset, int maxOffset, int length) const;
+    void updateTarget();
+    void updateLatency();
+
+    int channels;
+    int sampleRate;
+    QIODevice *device;
+
+    QVector<qint16> samples;
+    int head;
+    QByteArray pending;
+
+    QVector<qint16> history;
+    int historyPos;
+    int concealedFrames;
+    float concealGain;
+    float concealDecay;
+
+    QElapsedTimer arrivalTimer;
+    double lastArrival;
+    int lastArrivalFrames;
+    float jitter;
+
+    int minimumLatency;
+    int maximumLatency;
+    int penalty;
+    int smoothFrames;
+    int target;
+    int underruns;
+    // whether the last read could not be fully served
+    bool starving;
+    float level;
+    int reportedLatency;
+
+private:
+    QSoundJitterBuffer *q;
+};
+
+QSoundJitterBufferPrivate::QSoundJitterBufferPrivate(QSoundJitterBuffer *qq)
+    : channels(0),
+    sampleRate(0),
+    device(0),
+    head(0),
+    historyPos(0),
+    concealedFrames(0),
+    concealGain(1.0),
+    concealDecay(1.0),
+    lastArrival(-1),
+    lastArrivalFrames(0),
+    jitter(0),
+    minimumLatency(20),
+    maximumLatency(300),
+    penalty(20),
+    smoothFrames(0),
+    target(40),
+    underruns(0),
+    starving(false),
+    level(0),
+    reportedLatency(0),
+    q(qq)
+{
+}
+
+int QSoundJitterBufferPrivate::availableFrames() const
+{
+    return (samples.size() - head) / channels;
+}
+
+int QSoundJitterBufferPrivate::framesToMsecs(qint64 frames) const
+{
+    return (frames * 1000) / sampleRate;
+}
+
+int QSoundJitterBufferPrivate::msecsToFrames(int msecs) const
+{
+    return (qint64(msecs) * sampleRate) / 1000;
+}
+
+/** Reads at most maxFrames frames from the underlying device.
+ *
+ * Returns the number of frames which were queued.
+ */
+int QSoundJitterBufferPrivate::fetch(int maxFrames)
+{
+    if (!device || maxFrames <= 0)
+        return 0;
+
+    const int frameSize = channels * sizeof(qint16);
+    const qint64 wanted = qMin(device->bytesAvailable(), qint64(maxFrames) * frameSize) - pending.size();
+    if (wanted > 0)
+        pending += device->read(wanted);
+
+    const int frames = pending.size() / frameSize;
+    if (frames > 0) {
+        const int oldSize = samples.size();
+        samples.resize(oldSize + frames * channels);
+        memcpy(samples.data() + oldSize, pending.constData(), frames * frameSize);
+        pending.remove(0, frames * frameSize);
+    }
+    return frames;
+}
+
+void QSoundJitterBufferPrivate::compact()
+{
+    if (head > 4096 && head * 2 > samples.size()) {
+        samples.remove(0, head);
+        head = 0;
+    }
+}
+
+/** Copies frames verbatim from the queue, cross-fading from the concealed
+ *  signal if we are recovering from an underrun.
+ */
+void QSoundJitterBufferPrivate::take(qint16 *out, int frames)
+{
+    const qint16 *src = samples.constData() + head;
+    memcpy(out, src, frames * channels * sizeof(qint16));
+    head += frames * channels;
+
+    if (concealedFrames) {
+        const int fadeFrames = qMin(frames, msecsToFrames(CONCEAL_PERIOD_MS) / 2);
+        QVector<qint16> tail(fadeFrames * channels);
+        conceal(tail.data(), fadeFrames);
+        for (int i = 0; i < fadeFrames; ++i) {
+            const float w = float(i + 1) / float(fadeFrames + 1);
+            for (int c = 0; c < channels; ++c) {
+                const int k = i * channels + c;
+                out[k] = qint16(out[k] * w + tail[k] * (1.0f - w));
+            }
+        }
+        concealedFrames = 0;
+        concealGain = 1.0;
+    }
+}
+
+/** Plays frames while consuming up to maxDrop extra frames from the queue,
+ *  picking the drop length which best preserves the waveform.
+ */
+void QSoundJitterBufferPrivate::compress(qint16 *out, int frames, int maxDrop)
+{
+    const qint16 *src = samples.constData() + head;
+    const int length = qMin(frames, msecsToFrames(5));
+    const int drop = bestOffset(src, src, qMax(1, maxDrop / 2), maxDrop, length);
+
+    for (int i = 0; i < frames; ++i) {
+        const float w = float(i) / float(frames);
+        for (int c = 0; c < channels; ++c) {
+            const int k = i * channels + c;
+            out[k] = qint16(src[k] * (1.0f - w) + src[k + drop * channels] * w);
+        }
+    }
+    head += (frames + drop) * channels;
+}
+
+/** Plays frames while consuming up to maxInsert fewer frames from the queue,
+ *  picking the insert length which best preserves the waveform.
+ */
+void QSoundJitterBufferPrivate::expand(qint16 *out, int frames, int maxInsert)
+{
+    const qint16 *src = samples.constData() + head;
+    const int length = qMin(frames - maxInsert, msecsToFrames(5));
+    const int insert = bestOffset(src, src, qMax(1, maxInsert / 2), maxInsert, length);
+
+    memcpy(out, src, insert * channels * sizeof(qint16));
+    for (int i = insert; i < frames; ++i) {
+        const float w = float(i - insert) / float(frames - insert);
+        for (int c = 0; c < channels; ++c) {
+            const int k = i * channels + c;
+            out[k] = qint16(src[k] * (1.0f - w) + src[k - insert * channels] * w);
+        }
+    }
+    head += (frames - insert) * channels;
+}
+
+/** Synthesises frames by repeating the last period which was played,
+ *  fading out progressively.
+ */
+void QSoundJitterBufferPrivate::conceal(qint16 *out, int frames)
+{
+    const int periodFrames = history.size() / channels;
+    const int maximumFrames = msecsToFrames(CONCEAL_MAXIMUM_MS);
+    for (int i = 0; i < frames; ++i) {
+        if (concealedFrames >= maximumFrames)
+            concealGain = 0;
+        for (int c = 0; c < channels; ++c)
+            out[i * channels + c] = qint16(history[historyPos * channels + c] * concealGain);
+        historyPos = (historyPos + 1) % periodFrames;
+        concealGain *= concealDecay;
+        concealedFrames++;
+    }
+}
+
+/** Stores the tail of the played signal for concealment purposes.
+ */
+void QSoundJitterBufferPrivate::remember(const qint16 *out, int frames)
+{
+    const int periodFrames = history.size() / channels;
+    if (frames >= periodFrames) {
+        memcpy(history.data(), out + (frames - periodFrames) * channels, history.size() * sizeof(qint16));
+    } else {
+        const int kept = (periodFrames - frames) * channels;
+        memmove(history.data(), history.constData() + frames * channels, kept * sizeof(qint16));
+        memcpy(history.data() + kept, out, frames * channels * sizeof(qint16));
+    }
+    historyPos = 0;
+}
+
+/** Returns the offset in [minOffset, maxOffset] for which the first channel
+ *  of candidates best correlates with that of ref.
+ */
+int QSoundJitterBufferPrivate::bestOffset(const qint16 *ref, const qint16 *candidates, int minOffset, int maxOffset, int length) const
+{
+    int best = maxOffset;
+    double bestScore = -2.0;
+    for (int offset = minOffset; offset <= maxOffset; ++offset) {
+        const qint16 *cand = candidates + offset * channels;
+        double cross = 0, energy = 1;
+        for (int i = 0; i < length; ++i) {
+            cross += double(ref[i * channels]) * cand[i * channels];
+            energy += double(cand[i * channels]) * cand[i * channels];
+        }
+        const double score = cross / sqrt(energy);
+        if (score > bestScore) {
+            bestScore = score;
+            best = offset;
+        }
+    }
+    return best;
+}
+
+void QSoundJitterBufferPrivate::updateTarget()
+{
+    target = qBound(minimumLatency, minimumLatency + int(2 * jitter) + penalty, maximumLatency);
+}
+
+void QSoundJitterBufferPrivate::updateLatency()
+{
+    level += (framesToMsecs(availableFrames()) - level) / 32;
+    const int latency = qRound(level / 10) * 10;
+    if (latency != reportedLatency) {
+        reportedLatency = latency;
+        emit q->latencyChanged(reportedLatency);
+    }
+}
+
+/** Constructs a new jitter buffer reading samples from the given device.
+ *
+ * @param format
+ * @param device
+ * @param parent
+ */
+QSoundJitterBuffer::QSoundJitterBuffer(const QAudioFormat &format, QIODevice *device, QObject *parent)
+    : QIODevice(parent)
+{
+    d = new QSoundJitterBufferPrivate(this);
+
+    if (format.byteOrder() != int(QSysInfo::ByteOrder) ||
+        format.codec() != "audio/pcm" ||
+        format.sampleSize() != 16 ||
+        format.channelCount() < 1 ||
+        format.sampleRate() < 1)
+    {
+        qWarning("QSoundJitterBuffer only supports 16-bit host-endian PCM data");
+        return;
+    }
+    d->channels = format.channelCount();
+    d->sampleRate = format.sampleRate();
+    d->history.fill(0, qMax(1, d->msecsToFrames(CONCEAL_PERIOD_MS)) * d->channels);
+    d->concealDecay = pow(0.5, 1.0 / qMax(1, d->msecsToFrames(CONCEAL_PERIOD_MS)));
+    d->updateTarget();
+    d->arrivalTimer.start();
+
+    d->device = device;
+    if (d->device) {
+        bool check;
+        Q_UNUSED(check);
+
+        check = connect(d->device, SIGNAL(destroyed(QObject*)),
+                        this, SLOT(_q_deviceDestroyed(QObject*)));
+        Q_ASSERT(check);
+
+        check = connect(d->device, SIGNAL(readyRead()),
+                        this, SLOT(_q_readyRead()));
+        Q_ASSERT(check);
+
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    }
+}
+
+QSoundJitterBuffer::~QSoundJitterBuffer()
+{
+    delete d;
+}
+
+bool QSoundJitterBuffer::isSequential() const
+{
+    return true;
+}
+
+/** Returns the smoothed amount of buffered audio, in milliseconds.
+ */
+int QSoundJitterBuffer::latency() const
+{
+    return d->reportedLatency;
+}
+
+/** Returns the amount of buffered audio the buffer is currently aiming for,
+ *  in milliseconds.
+ */
+int QSoundJitterBuffer::targetLatency() const
+{
+    return d->target;
+}
+
+int QSoundJitterBuffer::minimumLatency() const
+{
+    return d->minimumLatency;
+}
+
+void QSoundJitterBuffer::setMinimumLatency(int msecs)
+{
+    d->minimumLatency = qMax(0, msecs);
+    d->maximumLatency = qMax(d->minimumLatency, d->maximumLatency);
+    d->updateTarget();
+}
+
+int QSoundJitterBuffer::maximumLatency() const
+{
+    return d->maximumLatency;
+}
+
+void QSoundJitterBuffer::setMaximumLatency(int msecs)
+{
+    d->maximumLatency = qMax(0, msecs);
+    d->minimumLatency = qMin(d->minimumLatency, d->maximumLatency);
+    d->updateTarget();
+}
+
+/** Returns the number of times the buffer ran dry, a starvation spanning
+ *  several reads being counted once.
+ */
+int QSoundJitterBuffer::underrunCount() const
+{
+    return d->underruns;
+}
+
+/** Notifies the buffer that the consumer starved, for instance because the
+ *  audio device reported an underrun. The target latency is raised.
+ */
+void QSoundJitterBuffer::reportUnderrun()
+{
+    d->underruns++;
+    d->penalty = qMin(d->penalty + UNDERRUN_PENALTY_MS, d->maximumLatency);
+    d->smoothFrames = 0;
+    d->updateTarget();
+}
+
+qint64 QSoundJitterBuffer::readData(char *data, qint64 maxSize)
+{
+    if (!d->device)
+        return -1;
+
+    const int frames = maxSize / (d->channels * sizeof(qint16));
+    if (frames <= 0)
+        return 0;
+    qint16 *out = reinterpret_cast<qint16*>(data);
+
+    // top up from devices which do not signal incoming data,
+    // without ever exceeding the target
+    const int targetFrames = d->msecsToFrames(d->target);
+    d->fetch(targetFrames + frames - d->availableFrames());
+
+    const int available = d->availableFrames();
+    const int hysteresisFrames = d->msecsToFrames(HYSTERESIS_MS);
+    const int maxStretch = frames / 8;
+    if (available < frames) {
+        // not enough data, conceal the missing part, counting a single
+        // underrun until a read is fully served again
+        if (!d->starving)
+            reportUnderrun();
+        if (available > 0) {
+            d->take(out, available);
+            d->remember(out, available);
+        }
+        d->conceal(out + available * d->channels, frames - available);
+    } else if (maxStretch > 0 && !d->concealedFrames &&
+               available - frames > targetFrames + hysteresisFrames &&
+               available >= frames + maxStretch) {
+        // too much data, speed up playout
+        d->compress(out, frames, maxStretch);
+        d->remember(out, frames);
+    } else if (maxStretch > 0 && !d->concealedFrames &&
+               available < targetFrames - hysteresisFrames) {
+        // too little data, slow down playout
+        d->expand(out, frames, maxStretch);
+        d->remember(out, frames);
+    } else {
+        d->take(out, frames);
+        d->remember(out, frames);
+    }
+    d->starving = available < frames;
+    d->compact();
+
+    // let the target shrink back while playout is smooth
+    if (!d->concealedFrames) {
+        d->smoothFrames += frames;
+        if (d->smoothFrames >= d->msecsToFrames(DECAY_INTERVAL_MS)) {
+            d->smoothFrames = 0;
+            d->penalty = qMax(0, d->penalty - DECAY_STEP_MS);
+            d->updateTarget();
+        }
+    }
+    d->updateLatency();
+
+    return frames * d->channels * sizeof(qint16);
+}
+
+qint64 QSoundJitterBuffer::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+void QSoundJitterBuffer::_q_deviceDestroyed(QObject*)
+{
+    d->device = 0;
+}
+
+/** Queues incoming samples and updates the inter-arrival jitter estimate.
+ */
+void QSoundJitterBuffer::_q_readyRead()
+{
+    const int maximumFrames = d->msecsToFrames(d->maximumLatency);
+    const int frames = d->fetch(maximumFrames - d->availableFrames());
+    if (frames <= 0)
+        return;
+
+    // RFC 3550 style interarrival jitter
+    const double now = d->arrivalTimer.nsecsElapsed() / 1000000.0;
+    if (d->lastArrival >= 0) {
+        const double transit = (now - d->lastArrival) - d->framesToMsecs(d->lastArrivalFrames);
+        d->jitter += (fabs(transit) - d->jitter) / 16.0;
+    }
+    d->lastArrival = now;
+    d->lastArrivalFrames = frames;
+    d->updateTarget();
+}
@@ -0,0 +1,76 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_SOUND_JITTER_BUFFER_H__
+#define __WILINK_SOUND_JITTER_BUFFER_H__
+
+#include <QIODevice>
+
+class QAudioFormat;
+class QSoundJitterBufferPrivate;
+
+/** The QSoundJitterBuffer class acts as an adaptive playout buffer in front
+ *  of a QIODevice delivering 16-bit PCM samples.
+ *
+ *  It starts with a small target latency which grows when the buffer runs
+ *  dry or the arrival jitter increases, and slowly shrinks again while
+ *  playout is smooth. The buffer level is steered towards the target by
+ *  time-stretching, and missing samples are concealed instead of being
+ *  played as silence.
+ */
+class QSoundJitterBuffer : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    QSoundJitterBuffer(const QAudioFormat &format, QIODevice *device, QObject *parent = 0);
+    ~QSoundJitterBuffer();
+
+    bool isSequential() const;
+
+    int latency() const;
+    int targetLatency() const;
+
+    int minimumLatency() const;
+    void setMinimumLatency(int msecs);
+
+    int maximumLatency() const;
+    void setMaximumLatency(int msecs);
+
+    int underrunCount() const;
+    void reportUnderrun();
+
+signals:
+    // This signal is emitted when the buffered latency changes.
+    void latencyChanged(int msecs);
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private slots:
+    void _q_deviceDestroyed(QObject *obj);
+    void _q_readyRead();
+
+private:
+    QSoundJitterBufferPrivate *d;
+    friend class QSoundJitterBufferPrivate;
+};
+
+#endif
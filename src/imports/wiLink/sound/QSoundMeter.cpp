@@ -22,38 +22,46 @@
 #include <QAudioFormat>
 #include <QBuffer>
 #include <QSysInfo>
+#include <QTimer>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QSOUND_USE_SSE2
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define QSOUND_USE_NEON
+#endif
 
 #include "QSoundMeter.h"
 
-static int loudness(const char *data, qint64 length, qint64 offset, int sampleSize)
-{
-    const char *ptr = data;
-    int remainder = offset % sampleSize;
-    if (remainder)
-        ptr += (sampleSize - remainder);
-    const char *end = data + length;
-    remainder = (end - ptr) % sampleSize;
-    if (remainder)
-        end -= remainder;
-    qint64 sum = 0;
-    qint64 count = 0;
-    for ( ; ptr < end; ptr += sampleSize) {
-        qint16 sample = *((qint16*)ptr);
-        sum += (sample * sample);
-        count++;
-    }
-    if (!count || sum < count)
-        return 0;
-    return 5.0 * log((float)sum/(float)count);
-}
+// number of level updates per second
+static const int UPDATE_RATE = 20;
+
+// VU ballistics, expressed per update
+static const float VU_ATTACK = 0.7;
+static const float VU_RELEASE = 0.15;
+
+// peak hold duration in updates, and decay per update once it expires
+static const int PEAK_HOLD = 30;
+static const int PEAK_DECAY = 1;
 
 QSoundMeter::QSoundMeter(const QAudioFormat &format, QIODevice *device, QObject *parent)
     : QIODevice(parent),
     m_device(0),
     m_pos(0),
     m_sampleSize(0),
-    m_signalsQueued(false),
-    m_value(0)
+    m_value(0),
+    m_peak(0),
+    m_notifiedValue(0),
+    m_notifiedPeak(0),
+    m_blockSamples(1),
+    m_blockSum(0),
+    m_blockCount(0),
+    m_blockPeak(0),
+    m_ballistics(false),
+    m_level(0),
+    m_peakHold(0),
+    m_peakHoldBlocks(0)
 {
     if (format.byteOrder() != int(QSysInfo::ByteOrder) ||
         format.codec() != "audio/pcm" ||
@@ -66,8 +74,16 @@ QSoundMeter::QSoundMeter(const QAudioFormat &format, QIODevice *device, QObject
     connect(m_device, SIGNAL(destroyed(QObject*)),
             this, SLOT(_q_deviceDestroyed(QObject*)));
     m_sampleSize = format.sampleSize() / 8;
+    m_blockSamples = qMax(1, format.sampleRate() * format.channelCount() / UPDATE_RATE);
     if (m_device)
         open(device->openMode() | QIODevice::Unbuffered);
+
+    // the levels are polled, so the audio thread never calls into this one
+    m_timer = new QTimer(this);
+    m_timer->setInterval(1000 / UPDATE_RATE);
+    connect(m_timer, SIGNAL(timeout()),
+            this, SLOT(_q_emitSignals()));
+    m_timer->start();
 }
 
 int QSoundMeter::maximum()
@@ -76,6 +92,76 @@ int QSoundMeter::maximum()
     return 10.0 * log(32767.0 / sqrt(2.0));
 }
 
+/** Returns the number of times per second the level is updated.
+ */
+int QSoundMeter::updateRate()
+{
+    return UPDATE_RATE;
+}
+
+/** Adds the sum of the squares of the given samples to sumOfSquares, and
+ *  raises peak to the largest absolute sample value.
+ */
+void QSoundMeter::measure(const qint16 *samples, int count, qint64 *sumOfSquares, int *peak)
+{
+    int i = 0;
+    qint64 sum = 0;
+    int maxValue = 0;
+    int minValue = 0;
+#if defined(QSOUND_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    __m128i vmax = _mm_setzero_si128();
+    __m128i vmin = _mm_setzero_si128();
+    for ( ; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+        // each pair sum is at most 2^31, which fits in an unsigned 32-bit lane
+        const __m128i squares = _mm_madd_epi16(x, x);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(squares, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(squares, zero));
+        vmax = _mm_max_epi16(vmax, x);
+        vmin = _mm_min_epi16(vmin, x);
+    }
+    qint64 sums[2];
+    qint16 maxima[8], minima[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(sums), acc);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(maxima), vmax);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(minima), vmin);
+    sum = sums[0] + sums[1];
+    for (int k = 0; k < 8; ++k) {
+        maxValue = qMax(maxValue, int(maxima[k]));
+        minValue = qMin(minValue, int(minima[k]));
+    }
+#elif defined(QSOUND_USE_NEON)
+    int64x2_t acc = vdupq_n_s64(0);
+    int16x8_t vmax = vdupq_n_s16(0);
+    int16x8_t vmin = vdupq_n_s16(0);
+    for ( ; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(samples + i);
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+        vmax = vmaxq_s16(vmax, x);
+        vmin = vminq_s16(vmin, x);
+    }
+    qint16 maxima[8], minima[8];
+    vst1q_s16(maxima, vmax);
+    vst1q_s16(minima, vmin);
+    sum = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+    for (int k = 0; k < 8; ++k) {
+        maxValue = qMax(maxValue, int(maxima[k]));
+        minValue = qMin(minValue, int(minima[k]));
+    }
+#endif
+    for ( ; i < count; ++i) {
+        const int sample = samples[i];
+        sum += sample * sample;
+        maxValue = qMax(maxValue, sample);
+        minValue = qMin(minValue, sample);
+    }
+    *sumOfSquares += sum;
+    *peak = qMax(*peak, qMax(maxValue, -minValue));
+}
+
 qint64 QSoundMeter::pos() const
 {
     if (!m_device)
@@ -83,20 +169,65 @@ qint64 QSoundMeter::pos() const
     return m_device->pos();
 }
 
+/** Accumulates the samples into the current block, publishing a new level
+ *  each time a block is complete.
+ */
+void QSoundMeter::process(const char *data, qint64 length)
+{
+    const char *ptr = data;
+    int remainder = m_pos % m_sampleSize;
+    if (remainder)
+        ptr += (m_sampleSize - remainder);
+    const char *end = data + length;
+    remainder = (end - ptr) % m_sampleSize;
+    if (remainder)
+        end -= remainder;
+
+    const qint16 *samples = reinterpret_cast<const qint16*>(ptr);
+    int count = (end - ptr) / m_sampleSize;
+    while (count > 0) {
+        const int n = qMin(count, m_blockSamples - m_blockCount);
+        measure(samples, n, &m_blockSum, &m_blockPeak);
+        m_blockCount += n;
+        samples += n;
+        count -= n;
+        if (m_blockCount < m_blockSamples)
+            break;
+
+        int level = (m_blockSum < m_blockCount) ? 0 : int(5.0 * log(double(m_blockSum) / double(m_blockCount)));
+        int peakLevel = (m_blockPeak > 1) ? qMin(int(10.0 * log(double(m_blockPeak))), maximum()) : 0;
+        m_blockSum = 0;
+        m_blockCount = 0;
+        m_blockPeak = 0;
+
+        if (m_ballistics) {
+            m_level += (level - m_level) * (level > m_level ? VU_ATTACK : VU_RELEASE);
+            level = qRound(m_level);
+
+            if (peakLevel >= m_peakHold) {
+                m_peakHold = peakLevel;
+                m_peakHoldBlocks = PEAK_HOLD;
+            } else if (m_peakHoldBlocks > 0) {
+                m_peakHoldBlocks--;
+            } else {
+                m_peakHold = qMax(peakLevel, m_peakHold - PEAK_DECAY);
+            }
+            peakLevel = m_peakHold;
+        }
+
+        // publish the new values, which the meter's thread polls
+        m_value.storeRelease(level);
+        m_peak.storeRelease(peakLevel);
+    }
+}
+
 qint64 QSoundMeter::readData(char *data, qint64 maxSize)
 {
     if (!m_device)
         return -1;
     qint64 length = m_device->read(data, maxSize);
     if (length > 0) {
-        const int newValue = loudness(data, length, m_pos, m_sampleSize);
-        if (newValue != m_value) {
-            m_value = newValue;
-            if (!m_signalsQueued && !signalsBlocked()) {
-                m_signalsQueued = true;
-                QMetaObject::invokeMethod(this, "_q_emitSignals", Qt::QueuedConnection);
-            }
-        }
+        process(data, length);
         m_pos += length;
     }
     return length;
@@ -110,9 +241,34 @@ bool QSoundMeter::seek(qint64 pos)
     return true;
 }
 
+/** Returns the current sound level, between 0 and maximum().
+ */
 int QSoundMeter::value() const
 {
-    return m_value;
+    return m_value.load();
+}
+
+/** Returns the current peak level, between 0 and maximum().
+ */
+int QSoundMeter::peak() const
+{
+    return m_peak.load();
+}
+
+/** Returns true if VU ballistics and peak hold are applied.
+ */
+bool QSoundMeter::ballistics() const
+{
+    return m_ballistics;
+}
+
+/** Sets whether VU ballistics and peak hold are applied.
+ *
+ * @param ballistics
+ */
+void QSoundMeter::setBallistics(bool ballistics)
+{
+    m_ballistics = ballistics;
 }
 
 qint64 QSoundMeter::writeData(const char *data, qint64 maxSize)
@@ -121,14 +277,7 @@ qint64 QSoundMeter::writeData(const char *data, qint64 maxSize)
         return -1;
     qint64 length = m_device->write(data, maxSize);
     if (length > 0) {
-        const int newValue = loudness(data, length, m_pos, m_sampleSize);
-        if (newValue != m_value) {
-            m_value = newValue;
-            if (!m_signalsQueued && !signalsBlocked()) {
-                m_signalsQueued = true;
-                QMetaObject::invokeMethod(this, "_q_emitSignals", Qt::QueuedConnection);
-            }
-        }
+        process(data, length);
         m_pos += length;
     }
     return length;
@@ -141,6 +290,15 @@ void QSoundMeter::_q_deviceDestroyed(QObject*)
 
 void QSoundMeter::_q_emitSignals()
 {
-    emit valueChanged(m_value);
-    m_signalsQueued = false;
+    const int value = m_value.loadAcquire();
+    if (value != m_notifiedValue) {
+        m_notifiedValue = value;
+        emit valueChanged(value);
+    }
+
+    const int peak = m_peak.loadAcquire();
+    if (peak != m_notifiedPeak) {
+        m_notifiedPeak = peak;
+        emit peakChanged(peak);
+    }
 }
@@ -20,12 +20,19 @@
 #ifndef __WILINK_SOUND_METER_H__
 #define __WILINK_SOUND_METER_H__
 
+#include <QAtomicInt>
 #include <QIODevice>
 
 class QAudioFormat;
+class QTimer;
 
 /** The QSoundMeter class acts as a proxy to a QIODevice which evaluates the
  *  sound level as samples are read or written.
+ *
+ *  The level is computed over blocks of 1/updateRate() seconds regardless of
+ *  the size of the audio buffers, and can be read from any thread. The
+ *  meter's own thread polls it updateRate() times per second to emit the
+ *  change signals.
  */
 class QSoundMeter : public QIODevice
 {
@@ -34,12 +41,20 @@ class QSoundMeter : public QIODevice
 public:
     QSoundMeter(const QAudioFormat &format, QIODevice *device, QObject *parent = 0);
     static int maximum();
+    static int updateRate();
     qint64 pos() const;
     bool seek(qint64 pos);
     int value() const;
+    int peak() const;
+
+    bool ballistics() const;
+    void setBallistics(bool ballistics);
+
+    static void measure(const qint16 *samples, int count, qint64 *sumOfSquares, int *peak);
 
 signals:
     void valueChanged(int value);
+    void peakChanged(int peak);
 
 protected:
     qint64 readData(char *data, qint64 maxSize);
@@ -50,11 +65,30 @@ private slots:
     void _q_emitSignals();
 
 private:
+    void process(const char *data, qint64 length);
+
     QIODevice *m_device;
     qint64 m_pos;
     int m_sampleSize;
-    bool m_signalsQueued;
-    int m_value;
+    QAtomicInt m_value;
+    QAtomicInt m_peak;
+
+    // last values notified, only accessed from the meter's thread
+    int m_notifiedValue;
+    int m_notifiedPeak;
+    QTimer *m_timer;
+
+    // block accumulator
+    int m_blockSamples;
+    qint64 m_blockSum;
+    int m_blockCount;
+    int m_blockPeak;
+
+    // ballistics
+    bool m_ballistics;
+    float m_level;
+    int m_peakHold;
+    int m_peakHoldBlocks;
 };
 
 #endif
@@ -0,0 +1,331 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QAudioOutput>
+#include <QMutexLocker>
+#include <QTime>
+#include <QTimer>
+#include <QtEndian>
+
+#include "QSoundMixer.h"
+#include "QSoundResampler.h"
+#include "QSoundStream.h"
+
+// a small buffer keeps the delay before a sound starts low
+static const int OUTPUT_BUFFER_MS = 15;
+// the output is closed after this long without any sound
+static const int IDLE_TIMEOUT_MS = 60000;
+
+/** Decodes a 16-bit PCM WAV file.
+ */
+static bool decodeWav(const QByteArray &data, QAudioFormat *format, QByteArray *samples)
+{
+    if (data.size() < 12 || !data.startsWith("RIFF") || data.mid(8, 4) != "WAVE")
+        return false;
+
+    bool hasFormat = false;
+    int pos = 12;
+    while (pos + 8 <= data.size()) {
+        const QByteArray chunkId = data.mid(pos, 4);
+        const int chunkSize = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(data.constData() + pos + 4));
+        const uchar *chunk = reinterpret_cast<const uchar*>(data.constData() + pos + 8);
+        if (chunkId == "fmt " && chunkSize >= 16) {
+            if (qFromLittleEndian<quint16>(chunk) != 1 ||
+                qFromLittleEndian<quint16>(chunk + 14) != 16)
+                return false;
+            *format = QSoundStream::pcmAudioFormat(qFromLittleEndian<quint16>(chunk + 2),
+                                                   qFromLittleEndian<quint32>(chunk + 4));
+            hasFormat = true;
+        } else if (chunkId == "data" && hasFormat) {
+            *samples = data.mid(pos + 8, chunkSize);
+            if (QSysInfo::ByteOrder == QSysInfo::BigEndian) {
+                qint16 *ptr = reinterpret_cast<qint16*>(samples->data());
+                for (int i = 0; i < samples->size() / 2; ++i)
+                    ptr[i] = qFromLittleEndian(ptr[i]);
+            }
+            return format->channelCount() > 0 && format->sampleRate() > 0;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    return false;
+}
+
+/** Converts decoded samples to the given format.
+ *
+ * If the sound is to be looped, it is converted as if it were periodic so
+ * that there is no discontinuity when it wraps around.
+ */
+static QVector<qint16> convertSamples(const QAudioFormat &inputFormat, const QByteArray &data, const QAudioFormat &outputFormat, bool looped)
+{
+    const int inputChannels = inputFormat.channelCount();
+    const int outputChannels = outputFormat.channelCount();
+    const int frames = data.size() / (inputChannels * sizeof(qint16));
+    const int outputFrames = (qint64(frames) * outputFormat.sampleRate()) / inputFormat.sampleRate();
+    if (!frames || !outputFrames)
+        return QVector<qint16>();
+
+    QSoundConverter converter(inputFormat.sampleRate(), inputChannels,
+                              outputFormat.sampleRate(), outputChannels);
+    const qint16 *input = reinterpret_cast<const qint16*>(data.constData());
+    const QVector<qint16> silence((inputFormat.sampleRate() / 100) * inputChannels, 0);
+    const int passes = looped ? 3 : 1;
+
+    QVector<qint16> output(converter.outputFramesFor(passes * frames + silence.size() / inputChannels) * outputChannels);
+    int produced = 0;
+    for (int i = 0; i < passes; ++i) {
+        produced += converter.process(input, frames, output.data() + produced * outputChannels,
+                                      output.size() / outputChannels - produced);
+    }
+    produced += converter.process(silence.constData(), silence.size() / inputChannels,
+                                  output.data() + produced * outputChannels,
+                                  output.size() / outputChannels - produced);
+
+    // for looped sounds, keep the middle period
+    const int start = looped ? outputFrames : 0;
+    return output.mid(start * outputChannels, qMin(outputFrames, produced - start) * outputChannels);
+}
+
+QSoundMixer::QSoundMixer()
+    : m_output(0)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    m_idleTimer = new QTimer(this);
+    m_idleTimer->setInterval(IDLE_TIMEOUT_MS);
+    m_idleTimer->setSingleShot(true);
+    check = connect(m_idleTimer, SIGNAL(timeout()),
+                    this, SLOT(_q_idle()));
+    Q_ASSERT(check);
+}
+
+QSoundMixer::~QSoundMixer()
+{
+    _q_stop();
+}
+
+QAudioFormat QSoundMixer::format() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_format;
+}
+
+/** Sets the output device and its format, to which sounds are converted.
+ *  Any playing sound is stopped.
+ *
+ * @param device
+ * @param format
+ */
+void QSoundMixer::setOutput(const QAudioDeviceInfo &device, const QAudioFormat &format)
+{
+    QMutexLocker locker(&m_mutex);
+    if (device.deviceName() != m_device.deviceName() || format != m_format) {
+        m_device = device;
+        m_format = format;
+        m_voices.clear();
+        QMetaObject::invokeMethod(this, "_q_stop");
+    }
+}
+
+bool QSoundMixer::isSequential() const
+{
+    return true;
+}
+
+/** Starts playing the given WAV file once it has been decoded and
+ *  converted to the mixer's format in the sound thread.
+ *
+ * @param id
+ * @param url the URL of the file, used to cache the decoded sound
+ * @param data the contents of the file
+ * @param repeat
+ */
+void QSoundMixer::play(int id, const QUrl &url, const QByteArray &data, bool repeat)
+{
+    m_mutex.lock();
+    m_pendingIds << id;
+    m_mutex.unlock();
+
+    QMetaObject::invokeMethod(this, "_q_play", Qt::QueuedConnection,
+                              Q_ARG(int, id), Q_ARG(QUrl, url),
+                              Q_ARG(QByteArray, data), Q_ARG(bool, repeat));
+}
+
+/** Stops playing the sound with the given id.
+ *
+ * @param id
+ */
+void QSoundMixer::stop(int id)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pendingIds.remove(id);
+    for (int i = m_voices.size() - 1; i >= 0; --i) {
+        if (m_voices[i].id == id)
+            m_voices.removeAt(i);
+    }
+}
+
+/** Stops playing all sounds.
+ */
+void QSoundMixer::stopAll()
+{
+    QMutexLocker locker(&m_mutex);
+    m_pendingIds.clear();
+    m_voices.clear();
+}
+
+qint64 QSoundMixer::readData(char *data, qint64 maxSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    const int count = (maxSize / sizeof(qint16) / m_format.channelCount()) * m_format.channelCount();
+    qint16 *out = reinterpret_cast<qint16*>(data);
+    if (m_voices.isEmpty()) {
+        memset(out, 0, count * sizeof(qint16));
+        return count * sizeof(qint16);
+    }
+
+    m_mix.fill(0, count);
+    int *mix = m_mix.data();
+    for (int v = m_voices.size() - 1; v >= 0; --v) {
+        Voice &voice = m_voices[v];
+        const qint16 *samples = voice.samples.constData();
+        const int length = voice.samples.size();
+        int i = 0;
+        while (i < count) {
+            const int chunk = qMin(count - i, length - voice.pos);
+            for (int k = 0; k < chunk; ++k)
+                mix[i + k] += samples[voice.pos + k];
+            i += chunk;
+            voice.pos += chunk;
+            if (voice.pos < length)
+                continue;
+            if (!voice.repeat)
+                break;
+            // loop without a gap
+            voice.pos = 0;
+        }
+        if (voice.pos >= length)
+            m_voices.removeAt(v);
+    }
+
+    for (int i = 0; i < count; ++i)
+        out[i] = qBound(-32768, mix[i], 32767);
+    return count * sizeof(qint16);
+}
+
+qint64 QSoundMixer::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+/** Decodes and converts the sound if it is not cached yet, then starts
+ *  playing it unless it was stopped in the meantime.
+ */
+void QSoundMixer::_q_play(int id, const QUrl &url, const QByteArray &data, bool repeat)
+{
+    QHash<QUrl, Sample>::iterator it = m_samples.find(url);
+    if (it == m_samples.end()) {
+        Sample sample;
+        if (!decodeWav(data, &sample.format, &sample.data)) {
+            qWarning("QSoundMixer could not decode %s", qPrintable(url.toString()));
+            stop(id);
+            return;
+        }
+        it = m_samples.insert(url, sample);
+    }
+
+    // the conversions are discarded when the output format changes
+    const QAudioFormat format = this->format();
+    if (it->convertedFormat != format) {
+        it->convertedFormat = format;
+        it->once.clear();
+        it->looped.clear();
+    }
+    QVector<qint16> &samples = repeat ? it->looped : it->once;
+    if (samples.isEmpty())
+        samples = convertSamples(it->format, it->data, format, repeat);
+
+    Voice voice;
+    voice.id = id;
+    voice.samples = samples;
+    voice.pos = 0;
+    voice.repeat = repeat;
+
+    m_mutex.lock();
+    const bool started = m_pendingIds.remove(id) && !samples.isEmpty() && format == m_format;
+    if (started)
+        m_voices << voice;
+    m_mutex.unlock();
+
+    if (started)
+        _q_start();
+}
+
+/** Opens the audio output if needed, and postpones closing it.
+ */
+void QSoundMixer::_q_start()
+{
+    m_idleTimer->start();
+    if (m_output)
+        return;
+
+    m_mutex.lock();
+    const QAudioDeviceInfo device = m_device;
+    const QAudioFormat format = m_format;
+    m_mutex.unlock();
+    const int bufferSize = (qint64(format.sampleRate()) * OUTPUT_BUFFER_MS / 1000) * format.channelCount() * sizeof(qint16);
+
+    QTime tm;
+    tm.start();
+
+    m_output = new QAudioOutput(device, format, this);
+    m_output->setBufferSize(bufferSize);
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    m_output->start(this);
+
+    qDebug("QSoundMixer audio output initialized in %i ms", tm.elapsed());
+    qDebug("QSoundMixer audio output buffer size %i (asked for %i)", m_output->bufferSize(), bufferSize);
+}
+
+void QSoundMixer::_q_stop()
+{
+    if (m_output) {
+        m_output->stop();
+        delete m_output;
+        m_output = 0;
+        close();
+
+        qDebug("QSoundMixer audio output stopped");
+    }
+}
+
+void QSoundMixer::_q_idle()
+{
+    m_mutex.lock();
+    const bool idle = m_voices.isEmpty();
+    m_mutex.unlock();
+
+    if (idle)
+        _q_stop();
+    else
+        m_idleTimer->start();
+}
@@ -0,0 +1,101 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_SOUND_MIXER_H__
+#define __WILINK_SOUND_MIXER_H__
+
+#include <QAudioDeviceInfo>
+#include <QAudioFormat>
+#include <QHash>
+#include <QIODevice>
+#include <QList>
+#include <QMutex>
+#include <QSet>
+#include <QUrl>
+#include <QVector>
+
+class QAudioOutput;
+class QTimer;
+
+/** The QSoundMixer class mixes any number of sound effects into a single
+ *  persistent audio output.
+ *
+ *  play() and stop() can be called from any thread, while the mixer itself
+ *  is meant to live in the sound thread, where sounds are decoded and
+ *  converted to the output format.
+ */
+class QSoundMixer : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    QSoundMixer();
+    ~QSoundMixer();
+
+    QAudioFormat format() const;
+    void setOutput(const QAudioDeviceInfo &device, const QAudioFormat &format);
+    bool isSequential() const;
+
+    void play(int id, const QUrl &url, const QByteArray &data, bool repeat);
+    void stop(int id);
+    void stopAll();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private slots:
+    void _q_play(int id, const QUrl &url, const QByteArray &data, bool repeat);
+    void _q_start();
+    void _q_stop();
+    void _q_idle();
+
+private:
+    // a decoded sound, along with its conversions to the output format
+    struct Sample
+    {
+        QAudioFormat format;
+        QByteArray data;
+        QAudioFormat convertedFormat;
+        QVector<qint16> once;
+        QVector<qint16> looped;
+    };
+
+    struct Voice
+    {
+        int id;
+        QVector<qint16> samples;
+        int pos;
+        bool repeat;
+    };
+
+    QAudioDeviceInfo m_device;
+    QAudioFormat m_format;
+    QVector<int> m_mix;
+    mutable QMutex m_mutex;
+    QAudioOutput *m_output;
+    QTimer *m_idleTimer;
+    QList<Voice> m_voices;
+    // sounds waiting to be decoded, accessed from any thread
+    QSet<int> m_pendingIds;
+    // only accessed from the sound thread
+    QHash<QUrl, Sample> m_samples;
+};
+
+#endif
@@ -20,6 +20,7 @@
 #include <QAbstractNetworkCache>
 #include <QAudioOutput>
 #include <QIODevice>
+#include <QMap>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QNetworkRequest>
@@ -28,7 +29,9 @@
 #include <QUrl>
 #include <QVariant>
 
+#include "QSoundMixer.h"
 #include "QSoundPlayer.h"
+#include "QSoundStream.h"
 
 static QSoundPlayer *thePlayer = 0;
 
@@ -36,10 +39,20 @@ class QSoundPlayerPrivate
 {
 public:
     QSoundPlayerPrivate();
+
     QString inputName;
     QString outputName;
     QThread *soundThread;
 
+    // contents of the files, which the mixer decodes and caches
+    QHash<QUrl, QByteArray> cache;
+    bool formatValid;
+    int lastId;
+    QSoundMixer *mixer;
+    QNetworkAccessManager *network;
+    QHash<QNetworkReply*, QUrl> replies;
+    QMap<int, QPair<QUrl, bool> > pendingVoices;
+
     QList<QAudioDeviceInfo> cachedDevices(QAudio::Mode mode);
 
 private:
@@ -48,7 +61,11 @@ private:
 };
 
 QSoundPlayerPrivate::QSoundPlayerPrivate()
-    : soundThread(0)
+    : soundThread(0),
+    formatValid(false),
+    lastId(0),
+    mixer(0),
+    network(0)
 {
     availableDevicesFetched[0] = false;
     availableDevicesFetched[1] = false;
@@ -70,6 +87,8 @@ QSoundPlayer::QSoundPlayer(QObject *parent)
     d = new QSoundPlayerPrivate;
     d->soundThread = new QThread(this);
     d->soundThread->start();
+    d->mixer = new QSoundMixer;
+    d->mixer->moveToThread(d->soundThread);
 
     if (!thePlayer)
         thePlayer = this;
@@ -77,6 +96,11 @@ QSoundPlayer::QSoundPlayer(QObject *parent)
 
 QSoundPlayer::~QSoundPlayer()
 {
+    // the mixer and its audio output are destroyed in the sound thread
+    bool check = connect(d->soundThread, SIGNAL(finished()),
+                         d->mixer, SLOT(deleteLater()));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
     d->soundThread->quit();
     d->soundThread->wait();
 
@@ -138,6 +162,12 @@ void QSoundPlayer::setOutputDeviceName(const QString &name)
 {
     if (name != d->outputName) {
         d->outputName = name;
+
+        // sounds will need to be converted for the new device
+        d->mixer->stopAll();
+        QMetaObject::invokeMethod(d->mixer, "_q_stop");
+        d->formatValid = false;
+
         emit outputDeviceNameChanged();
     }
 }
@@ -154,3 +184,84 @@ QThread *QSoundPlayer::soundThread() const
 {
     return d->soundThread;
 }
+
+/** Plays the WAV file at the given URL, and returns an identifier which can
+ *  be passed to stop().
+ *
+ * The file is retrieved the first time it is played, then decoded in the
+ * sound thread and kept in memory in the output device's format so that
+ * subsequent playback starts immediately.
+ *
+ * @param url
+ * @param repeat whether to loop the sound until it is stopped
+ */
+int QSoundPlayer::play(const QUrl &url, bool repeat)
+{
+    const int id = ++d->lastId;
+
+    if (!d->formatValid) {
+        // the device is resolved here as the device list belongs to this thread
+        const QAudioDeviceInfo device = outputDevice();
+        d->mixer->setOutput(device, QSoundStream::nativeAudioFormat(device, QSoundStream::pcmAudioFormat(2, 48000)));
+        d->formatValid = true;
+    }
+
+    QHash<QUrl, QByteArray>::const_iterator it = d->cache.constFind(url);
+    if (it != d->cache.constEnd()) {
+        d->mixer->play(id, url, *it, repeat);
+        return id;
+    }
+
+    // retrieve the file
+    if (!d->replies.values().contains(url)) {
+        if (!d->network)
+            d->network = new QNetworkAccessManager(this);
+
+        QNetworkReply *reply = d->network->get(QNetworkRequest(url));
+        bool check = connect(reply, SIGNAL(finished()),
+                             this, SLOT(_q_replyFinished()));
+        Q_ASSERT(check);
+        Q_UNUSED(check);
+        d->replies.insert(reply, url);
+    }
+    d->pendingVoices.insert(id, qMakePair(url, repeat));
+    return id;
+}
+
+/** Stops the sound with the given identifier.
+ *
+ * @param id
+ */
+void QSoundPlayer::stop(int id)
+{
+    d->pendingVoices.remove(id);
+    d->mixer->stop(id);
+}
+
+void QSoundPlayer::_q_replyFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!reply || !d->replies.contains(reply))
+        return;
+
+    const QUrl url = d->replies.take(reply);
+    reply->deleteLater();
+
+    const bool loaded = reply->error() == QNetworkReply::NoError;
+    if (loaded)
+        d->cache.insert(url, reply->readAll());
+    else
+        qWarning("QSoundPlayer could not load %s", qPrintable(url.toString()));
+
+    // start the sounds which were waiting for this file
+    QMap<int, QPair<QUrl, bool> >::iterator it = d->pendingVoices.begin();
+    while (it != d->pendingVoices.end()) {
+        if (it.value().first == url) {
+            if (loaded)
+                d->mixer->play(it.key(), url, d->cache.value(url), it.value().second);
+            it = d->pendingVoices.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -25,9 +25,9 @@
 #include <QUrl>
 
 class QAudioDeviceInfo;
-class QNetworkAccessManager;
 class QSoundPlayer;
 class QSoundPlayerPrivate;
+class QThread;
 
 class QSoundPlayer : public QObject
 {
@@ -61,6 +61,13 @@ signals:
     void inputDeviceNameChanged();
     void outputDeviceNameChanged();
 
+public slots:
+    int play(const QUrl &url, bool repeat = false);
+    void stop(int id);
+
+private slots:
+    void _q_replyFinished();
+
 private:
     QSoundPlayerPrivate *d;
 };
@@ -0,0 +1,329 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+
+#include <QAudioFormat>
+#include <QSysInfo>
+#include <QVector>
+#include <QtCore/qmath.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define QSOUND_USE_SSE
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define QSOUND_USE_NEON
+#endif
+
+#include "QSoundResampler.h"
+
+// number of filter taps per polyphase branch, scaled up when decimating
+static const int FILTER_TAPS = 48;
+// Kaiser window shape parameter, about 80dB stop-band attenuation
+static const double FILTER_BETA = 8.0;
+// pass-band edge relative to the lowest Nyquist frequency
+static const double FILTER_ROLLOFF = 0.9;
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        const int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// zeroth-order modified Bessel function of the first kind
+static double bessel0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static inline float dotProduct(const float *a, const float *b, int n)
+{
+    int i = 0;
+    float sum = 0;
+#if defined(QSOUND_USE_SSE)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for ( ; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float tmp[4];
+    _mm_storeu_ps(tmp, _mm_add_ps(acc0, acc1));
+    sum = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#elif defined(QSOUND_USE_NEON)
+    float32x4_t acc = vdupq_n_f32(0);
+    for ( ; i + 4 <= n; i += 4)
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    const float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#endif
+    for ( ; i < n; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+class QSoundConverterPrivate
+{
+public:
+    int inputChannels;
+    int outputChannels;
+    int filterChannels;
+    int up;
+    int down;
+    int taps;
+    qint64 time;
+    QVector<float> coefficients;
+    QVector<QVector<float> > history;
+};
+
+/** Constructs a converter between the given formats.
+ *
+ * @param inputRate
+ * @param inputChannels
+ * @param outputRate
+ * @param outputChannels
+ */
+QSoundConverter::QSoundConverter(int inputRate, int inputChannels, int outputRate, int outputChannels)
+{
+    d = new QSoundConverterPrivate;
+    d->inputChannels = qMax(1, inputChannels);
+    d->outputChannels = qMax(1, outputChannels);
+    d->filterChannels = qMin(d->inputChannels, d->outputChannels);
+    d->time = 0;
+
+    const int divisor = gcd(qMax(1, inputRate), qMax(1, outputRate));
+    d->up = qMax(1, outputRate) / divisor;
+    d->down = qMax(1, inputRate) / divisor;
+
+    if (d->up == 1 && d->down == 1) {
+        // only the channel layout changes
+        d->taps = 1;
+        d->coefficients.fill(1.0, 1);
+    } else {
+        // design a Kaiser-windowed sinc prototype at the upsampled rate and
+        // store each polyphase branch contiguously, in reverse order
+        d->taps = FILTER_TAPS * ((d->down + d->up - 1) / d->up);
+        const int length = d->taps * d->up;
+        const double cutoff = FILTER_ROLLOFF * 0.5 / qMax(d->up, d->down);
+        const double center = (length - 1) / 2.0;
+        const double norm = bessel0(FILTER_BETA);
+        d->coefficients.resize(length);
+        for (int n = 0; n < length; ++n) {
+            const double x = n - center;
+            const double sinc = x ? sin(2.0 * M_PI * cutoff * x) / (M_PI * x) : 2.0 * cutoff;
+            const double r = x / (center + 1);
+            const double window = bessel0(FILTER_BETA * sqrt(qMax(0.0, 1.0 - r * r))) / norm;
+            const int phase = n % d->up;
+            const int tap = d->taps - 1 - n / d->up;
+            d->coefficients[phase * d->taps + tap] = d->up * sinc * window;
+        }
+    }
+
+    // prime the history so that the first output frame is centered
+    d->history.resize(d->filterChannels);
+    for (int c = 0; c < d->filterChannels; ++c)
+        d->history[c].fill(0, d->taps - 1);
+}
+
+QSoundConverter::~QSoundConverter()
+{
+    delete d;
+}
+
+/** Returns the number of input frames which are needed to produce the
+ *  given number of output frames.
+ */
+int QSoundConverter::inputFramesFor(int outputFrames) const
+{
+    if (outputFrames <= 0)
+        return 0;
+    const qint64 last = (d->time + qint64(outputFrames - 1) * d->down) / d->up;
+    return qMax(qint64(0), last + d->taps - d->history[0].size());
+}
+
+/** Returns the maximum number of output frames which can result from
+ *  queuing the given number of input frames.
+ */
+int QSoundConverter::outputFramesFor(int inputFrames) const
+{
+    return (qint64(d->history[0].size() + qMax(0, inputFrames)) * d->up) / d->down + 1;
+}
+
+/** Queues the input frames and converts as many of the queued frames as
+ *  possible, writing at most maxOutputFrames frames.
+ *
+ * Returns the number of frames written.
+ */
+int QSoundConverter::process(const qint16 *input, int inputFrames, qint16 *output, int maxOutputFrames)
+{
+    // queue input, down-mixing if needed
+    for (int c = 0; c < d->filterChannels; ++c) {
+        QVector<float> &buffer = d->history[c];
+        const int offset = buffer.size();
+        buffer.resize(offset + inputFrames);
+        float *dst = buffer.data() + offset;
+        if (d->filterChannels == 1 && d->inputChannels > 1) {
+            const float scale = 1.0f / d->inputChannels;
+            for (int i = 0; i < inputFrames; ++i) {
+                float sum = 0;
+                for (int k = 0; k < d->inputChannels; ++k)
+                    sum += input[i * d->inputChannels + k];
+                dst[i] = sum * scale;
+            }
+        } else {
+            for (int i = 0; i < inputFrames; ++i)
+                dst[i] = input[i * d->inputChannels + c];
+        }
+    }
+
+    // filter, up-mixing if needed
+    const int available = d->history[0].size();
+    int produced = 0;
+    while (produced < maxOutputFrames) {
+        const int base = d->time / d->up;
+        if (base + d->taps > available)
+            break;
+        const float *coefficients = d->coefficients.constData() + (d->time % d->up) * d->taps;
+        qint16 *dst = output + produced * d->outputChannels;
+        for (int c = 0; c < d->filterChannels; ++c) {
+            const float value = dotProduct(d->history[c].constData() + base, coefficients, d->taps);
+            dst[c] = qRound(qBound(-32768.0f, value, 32767.0f));
+        }
+        for (int c = d->filterChannels; c < d->outputChannels; ++c)
+            dst[c] = dst[c % d->filterChannels];
+        d->time += d->down;
+        produced++;
+    }
+
+    // drop consumed input
+    const int consumed = qMin(int(d->time / d->up), available);
+    if (consumed > 0) {
+        for (int c = 0; c < d->filterChannels; ++c)
+            d->history[c].remove(0, consumed);
+        d->time -= qint64(consumed) * d->up;
+    }
+    return produced;
+}
+
+/** Constructs a new resampler.
+ *
+ * @param format the format of the data read from or written to the resampler
+ * @param device the underlying device
+ * @param deviceFormat the format of the underlying device
+ * @param parent
+ */
+QSoundResampler::QSoundResampler(const QAudioFormat &format, QIODevice *device, const QAudioFormat &deviceFormat, QObject *parent)
+    : QIODevice(parent),
+    m_device(0),
+    m_channels(0),
+    m_deviceChannels(0),
+    m_readConverter(0),
+    m_writeConverter(0)
+{
+    if (format.byteOrder() != int(QSysInfo::ByteOrder) ||
+        format.codec() != "audio/pcm" ||
+        format.sampleSize() != 16 ||
+        deviceFormat.byteOrder() != int(QSysInfo::ByteOrder) ||
+        deviceFormat.codec() != "audio/pcm" ||
+        deviceFormat.sampleSize() != 16)
+    {
+        qWarning("QSoundResampler only supports 16-bit host-endian PCM data");
+        return;
+    }
+    m_device = device;
+    m_channels = format.channelCount();
+    m_deviceChannels = deviceFormat.channelCount();
+    m_readConverter = new QSoundConverter(deviceFormat.sampleRate(), m_deviceChannels,
+                                          format.sampleRate(), m_channels);
+    m_writeConverter = new QSoundConverter(format.sampleRate(), m_channels,
+                                           deviceFormat.sampleRate(), m_deviceChannels);
+    if (m_device) {
+        connect(m_device, SIGNAL(destroyed(QObject*)),
+                this, SLOT(_q_deviceDestroyed(QObject*)));
+        open(device->openMode() | QIODevice::Unbuffered);
+    }
+}
+
+QSoundResampler::~QSoundResampler()
+{
+    delete m_readConverter;
+    delete m_writeConverter;
+}
+
+bool QSoundResampler::isSequential() const
+{
+    return true;
+}
+
+qint64 QSoundResampler::readData(char *data, qint64 maxSize)
+{
+    if (!m_device)
+        return -1;
+
+    const int frameSize = m_channels * sizeof(qint16);
+    const int deviceFrameSize = m_deviceChannels * sizeof(qint16);
+    const int frames = maxSize / frameSize;
+    if (frames <= 0)
+        return 0;
+
+    const int wanted = m_readConverter->inputFramesFor(frames);
+    m_readBuffer.resize(wanted * deviceFrameSize);
+    qint64 length = wanted ? m_device->read(m_readBuffer.data(), m_readBuffer.size()) : 0;
+    if (length < 0)
+        return -1;
+
+    return m_readConverter->process(reinterpret_cast<const qint16*>(m_readBuffer.constData()), length / deviceFrameSize,
+                                    reinterpret_cast<qint16*>(data), frames) * frameSize;
+}
+
+qint64 QSoundResampler::writeData(const char *data, qint64 maxSize)
+{
+    if (!m_device)
+        return -1;
+
+    const int frameSize = m_channels * sizeof(qint16);
+    const int deviceFrameSize = m_deviceChannels * sizeof(qint16);
+    const int frames = maxSize / frameSize;
+
+    m_writeBuffer.resize(m_writeConverter->outputFramesFor(frames) * deviceFrameSize);
+    const int converted = m_writeConverter->process(reinterpret_cast<const qint16*>(data), frames,
+                                                    reinterpret_cast<qint16*>(m_writeBuffer.data()),
+                                                    m_writeBuffer.size() / deviceFrameSize);
+    if (converted > 0)
+        m_device->write(m_writeBuffer.constData(), converted * deviceFrameSize);
+    return frames * frameSize;
+}
+
+void QSoundResampler::_q_deviceDestroyed(QObject*)
+{
+    m_device = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_SOUND_RESAMPLER_H__
+#define __WILINK_SOUND_RESAMPLER_H__
+
+#include <QIODevice>
+
+class QAudioFormat;
+class QSoundConverterPrivate;
+
+/** The QSoundConverter class converts a stream of 16-bit PCM frames from one
+ *  sample rate and channel count to another using a polyphase FIR filter.
+ */
+class QSoundConverter
+{
+public:
+    QSoundConverter(int inputRate, int inputChannels, int outputRate, int outputChannels);
+    ~QSoundConverter();
+
+    int inputFramesFor(int outputFrames) const;
+    int outputFramesFor(int inputFrames) const;
+    int process(const qint16 *input, int inputFrames, qint16 *output, int maxOutputFrames);
+
+private:
+    Q_DISABLE_COPY(QSoundConverter)
+    QSoundConverterPrivate *d;
+};
+
+/** The QSoundResampler class acts as a proxy to a QIODevice which converts
+ *  samples between the device's format and the format used by the audio
+ *  backend, as samples are read or written.
+ */
+class QSoundResampler : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    QSoundResampler(const QAudioFormat &format, QIODevice *device, const QAudioFormat &deviceFormat, QObject *parent = 0);
+    ~QSoundResampler();
+
+    bool isSequential() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private slots:
+    void _q_deviceDestroyed(QObject *obj);
+
+private:
+    QIODevice *m_device;
+    int m_channels;
+    int m_deviceChannels;
+    QSoundConverter *m_readConverter;
+    QSoundConverter *m_writeConverter;
+    QByteArray m_readBuffer;
+    QByteArray m_writeBuffer;
+};
+
+#endif
@@ -17,23 +17,29 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <QAudioDeviceInfo>
 #include <QAudioInput>
 #include <QAudioOutput>
 #include <QTime>
 
+#include "QSoundJitterBuffer.h"
 #include "QSoundMeter.h"
 #include "QSoundPlayer.h"
+#include "QSoundResampler.h"
 #include "QSoundStream.h"
 
-static int bufferFor(const QAudioFormat &format)
-{
 #ifdef Q_OS_MAC
-    // 128ms at 8kHz
-    return 2048 * format.channelCount();
+static const int INPUT_BUFFER_MS = 128;
 #else
-    // 160ms at 8kHz
-    return 2560 * format.channelCount();
+static const int INPUT_BUFFER_MS = 160;
 #endif
+// the jitter buffer takes care of absorbing network jitter, so the
+// device buffer only needs to cover scheduling latency
+static const int OUTPUT_BUFFER_MS = 40;
+
+static int bufferFor(const QAudioFormat &format, int msecs)
+{
+    return (qint64(format.sampleRate()) * msecs / 1000) * format.channelCount() * (format.sampleSize() / 8);
 }
 
 class QSoundStreamPrivate
@@ -44,8 +50,11 @@ public:
     QAudioFormat audioFormat;
     QAudioInput *audioInput;
     QSoundMeter *audioInputMeter;
+    QSoundResampler *audioInputResampler;
     QAudioOutput *audioOutput;
+    QSoundJitterBuffer *audioOutputBuffer;
     QSoundMeter *audioOutputMeter;
+    QSoundResampler *audioOutputResampler;
     QIODevice *device;
     QSoundPlayer *soundPlayer;
 };
@@ -53,8 +62,11 @@ public:
 QSoundStreamPrivate::QSoundStreamPrivate()
     : audioInput(0),
     audioInputMeter(0),
+    audioInputResampler(0),
     audioOutput(0),
+    audioOutputBuffer(0),
     audioOutputMeter(0),
+    audioOutputResampler(0),
     device(0),
     soundPlayer(0)
 {
@@ -103,6 +115,23 @@ QAudioFormat QSoundStream::pcmAudioFormat(unsigned char channels, unsigned int c
     return format;
 }
 
+/** Returns the 16-bit PCM format closest to the device's native format, so
+ *  that sample rate conversion happens in our own resampler rather than in
+ *  the audio backend. If the device does not advertise a usable native
+ *  format, the fallback format is returned.
+ */
+QAudioFormat QSoundStream::nativeAudioFormat(const QAudioDeviceInfo &info, const QAudioFormat &fallback)
+{
+    const QAudioFormat preferred = info.preferredFormat();
+    if (preferred.sampleRate() <= 0 || preferred.channelCount() <= 0)
+        return fallback;
+
+    const QAudioFormat format = pcmAudioFormat(qMin(preferred.channelCount(), 2), preferred.sampleRate());
+    if (!info.isFormatSupported(format))
+        return fallback;
+    return format;
+}
+
 /** Starts audio capture.
  */
 void QSoundStream::startInput()
@@ -112,17 +141,26 @@ void QSoundStream::startInput()
     Q_ASSERT(d->device);
 
     if (!d->audioInput) {
-        const int bufferSize = bufferFor(d->audioFormat);
+        const QAudioDeviceInfo info = d->soundPlayer->inputDevice();
+        const QAudioFormat deviceFormat = nativeAudioFormat(info, d->audioFormat);
+        const int bufferSize = bufferFor(deviceFormat, INPUT_BUFFER_MS);
 
         QTime tm;
         tm.start();
 
-        d->audioInput = new QAudioInput(d->soundPlayer->inputDevice(), d->audioFormat, this);
+        d->audioInput = new QAudioInput(info, deviceFormat, this);
         check = connect(d->audioInput, SIGNAL(stateChanged(QAudio::State)),
                         this, SLOT(_q_audioInputStateChanged()));
         Q_ASSERT(check);
 
-        d->audioInputMeter = new QSoundMeter(d->audioFormat, d->device, this);
+        QIODevice *device = d->device;
+        if (deviceFormat != d->audioFormat) {
+            d->audioInputResampler = new QSoundResampler(deviceFormat, d->device, d->audioFormat, this);
+            device = d->audioInputResampler;
+        }
+
+        d->audioInputMeter = new QSoundMeter(deviceFormat, device, this);
+        d->audioInputMeter->setBallistics(true);
         check = connect(d->audioInputMeter, SIGNAL(valueChanged(int)),
                         this, SIGNAL(inputVolumeChanged(int)));
         Q_ASSERT(check);
@@ -130,7 +168,7 @@ void QSoundStream::startInput()
         d->audioInput->setBufferSize(bufferSize);
         d->audioInput->start(d->audioInputMeter);
 
-        qDebug("QSoundStream audio input initialized in %i ms", tm.elapsed());
+        qDebug("QSoundStream audio input initialized in %i ms at %i Hz", tm.elapsed(), deviceFormat.sampleRate());
         qDebug("QSoundStream audio input buffer size %i (asked for %i)", d->audioInput->bufferSize(), bufferSize);
     }
 }
@@ -145,6 +183,8 @@ void QSoundStream::stopInput()
         d->audioInput = 0;
         delete d->audioInputMeter;
         d->audioInputMeter = 0;
+        delete d->audioInputResampler;
+        d->audioInputResampler = 0;
 
         qDebug("QSoundStream audio input stopped");
 
@@ -161,17 +201,31 @@ void QSoundStream::startOutput()
     Q_ASSERT(d->device);
 
     if (!d->audioOutput) {
-        const int bufferSize = bufferFor(d->audioFormat);
+        const QAudioDeviceInfo info = d->soundPlayer->outputDevice();
+        const QAudioFormat deviceFormat = nativeAudioFormat(info, d->audioFormat);
+        const int bufferSize = bufferFor(deviceFormat, OUTPUT_BUFFER_MS);
 
         QTime tm;
         tm.start();
 
-        d->audioOutput = new QAudioOutput(d->soundPlayer->outputDevice(), d->audioFormat, this);
+        d->audioOutput = new QAudioOutput(info, deviceFormat, this);
         check = connect(d->audioOutput, SIGNAL(stateChanged(QAudio::State)),
                         this, SLOT(_q_audioOutputStateChanged()));
         Q_ASSERT(check);
 
-        d->audioOutputMeter = new QSoundMeter(d->audioFormat, d->device, this);
+        d->audioOutputBuffer = new QSoundJitterBuffer(d->audioFormat, d->device, this);
+        check = connect(d->audioOutputBuffer, SIGNAL(latencyChanged(int)),
+                        this, SLOT(_q_outputLatencyChanged()));
+        Q_ASSERT(check);
+
+        QIODevice *device = d->audioOutputBuffer;
+        if (deviceFormat != d->audioFormat) {
+            d->audioOutputResampler = new QSoundResampler(deviceFormat, d->audioOutputBuffer, d->audioFormat, this);
+            device = d->audioOutputResampler;
+        }
+
+        d->audioOutputMeter = new QSoundMeter(deviceFormat, device, this);
+        d->audioOutputMeter->setBallistics(true);
         check = connect(d->audioOutputMeter, SIGNAL(valueChanged(int)),
                         this, SIGNAL(outputVolumeChanged(int)));
         Q_ASSERT(check);
@@ -179,7 +233,7 @@ void QSoundStream::startOutput()
         d->audioOutput->setBufferSize(bufferSize);
         d->audioOutput->start(d->audioOutputMeter);
 
-        qDebug("QSoundStream audio output initialized in %i ms", tm.elapsed());
+        qDebug("QSoundStream audio output initialized in %i ms at %i Hz", tm.elapsed(), deviceFormat.sampleRate());
         qDebug("QSoundStream audio output buffer size %i (asked for %i)", d->audioOutput->bufferSize(), bufferSize);
     }
 }
@@ -194,9 +248,14 @@ void QSoundStream::stopOutput()
         d->audioOutput = 0;
         delete d->audioOutputMeter;
         d->audioOutputMeter = 0;
+        delete d->audioOutputResampler;
+        d->audioOutputResampler = 0;
+        delete d->audioOutputBuffer;
+        d->audioOutputBuffer = 0;
 
         qDebug("QSoundStream audio output stopped");
 
+        emit outputLatencyChanged(0);
         emit outputVolumeChanged(0);
     }
 }
@@ -211,6 +270,19 @@ int QSoundStream::maximumVolume() const
     return QSoundMeter::maximum();
 }
 
+/** Returns the estimated playback latency in milliseconds, which is the sum
+ *  of the jitter buffer and the audio device buffer.
+ */
+int QSoundStream::outputLatency() const
+{
+    if (!d->audioOutput || !d->audioOutputBuffer)
+        return 0;
+
+    const QAudioFormat format = d->audioOutput->format();
+    const int bytesPerSecond = format.sampleRate() * format.channelCount() * (format.sampleSize() / 8);
+    return d->audioOutputBuffer->latency() + (bytesPerSecond ? (qint64(d->audioOutput->bufferSize()) * 1000) / bytesPerSecond : 0);
+}
+
 int QSoundStream::outputVolume() const
 {
     return d->audioOutputMeter ? d->audioOutputMeter->value() : 0;
@@ -242,12 +314,19 @@ void QSoundStream::_q_audioOutputStateChanged()
            d->audioOutput->error());
 #endif
 
-    // Restart audio output if we get an underrun.
+    // The jitter buffer always delivers samples, concealing any missing
+    // ones, so an underrun means we are not being scheduled in time.
+    // Raise the jitter buffer's target instead of restarting the device.
     //
     // NOTE: seen on Linux with pulseaudio
     if (d->audioOutput->state() == QAudio::IdleState &&
             d->audioOutput->error() == QAudio::UnderrunError) {
-        qWarning("QSoundStream audio output needs restart due to buffer underrun");
-        d->audioOutput->start(d->audioOutputMeter);
+        qWarning("QSoundStream audio output buffer underrun");
+        d->audioOutputBuffer->reportUnderrun();
     }
 }
+
+void QSoundStream::_q_outputLatencyChanged()
+{
+    emit outputLatencyChanged(outputLatency());
+}
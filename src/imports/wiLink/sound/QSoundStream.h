@@ -22,6 +22,7 @@
 
 #include <QIODevice>
 
+class QAudioDeviceInfo;
 class QAudioFormat;
 class QSoundPlayer;
 class QSoundStreamPrivate;
@@ -31,6 +32,7 @@ class QSoundStream : public QObject
     Q_OBJECT
     Q_PROPERTY(int inputVolume READ inputVolume NOTIFY inputVolumeChanged)
     Q_PROPERTY(int maximumVolume READ maximumVolume CONSTANT)
+    Q_PROPERTY(int outputLatency READ outputLatency NOTIFY outputLatencyChanged)
     Q_PROPERTY(int outputVolume READ outputVolume NOTIFY outputVolumeChanged)
 
 public:
@@ -45,14 +47,19 @@ public:
 
     int inputVolume() const;
     int maximumVolume() const;
+    int outputLatency() const;
     int outputVolume() const;
 
+    static QAudioFormat nativeAudioFormat(const QAudioDeviceInfo &info, const QAudioFormat &fallback);
     static QAudioFormat pcmAudioFormat(unsigned char channels, unsigned int clockrate);
 
 signals:
     // This signal is emitted when the input volume changes.
     void inputVolumeChanged(int volume);
 
+    // This signal is emitted when the output latency changes.
+    void outputLatencyChanged(int latency);
+
     // This signal is emitted when the output volume changes.
     void outputVolumeChanged(int volume);
 
@@ -66,6 +73,7 @@ public slots:
 private slots:
     void _q_audioInputStateChanged();
     void _q_audioOutputStateChanged();
+    void _q_outputLatencyChanged();
 
 private:
     QSoundStreamPrivate *d;
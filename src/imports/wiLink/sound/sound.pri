@@ -1,15 +1,21 @@
 INCLUDEPATH += sound
 
 HEADERS += \
+    sound/QSoundJitterBuffer.h \
     sound/QSoundMeter.h \
+    sound/QSoundMixer.h \
     sound/QSoundPlayer.h \
+    sound/QSoundResampler.h \
     sound/QSoundStream.h \
     sound/QSoundTester.h \
     sound/QVideoGrabber.h \
     sound/QVideoGrabber_p.h
 SOURCES += \
+    sound/QSoundJitterBuffer.cpp \
     sound/QSoundMeter.cpp \
+    sound/QSoundMixer.cpp \
     sound/QSoundPlayer.cpp \
+    sound/QSoundResampler.cpp \
     sound/QSoundStream.cpp \
     sound/QSoundTester.cpp \
     sound/QVideoGrabber.cpp
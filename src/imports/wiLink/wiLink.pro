@@ -21,6 +21,8 @@ android {
 
 SOURCES += \
     accounts.cpp \
+    archive.cpp \
+    avatar.cpp \
     calls.cpp \
     client.cpp \
     console.cpp \
@@ -37,12 +39,15 @@ SOURCES += \
     phone/sip.cpp \
     rooms.cpp \
     roster.cpp \
+    search.cpp \
     settings.cpp \
     translations.cpp \
     updater.cpp
 
 HEADERS += \
     accounts.h \
+    archive.h \
+    avatar.h \
     calls.h \
     client.h \
     console.h \
@@ -61,6 +66,7 @@ HEADERS += \
     phone/sip_p.h \
     rooms.h \
     roster.h \
+    search.h \
     settings.h \
     translations.h \
     updater.h
@@ -2,4 +2,9 @@ TEMPLATE = subdirs
 
 SUBDIRS = 3rdparty imports app
 
+# Benchmarks, built with "qmake WILINK_TESTS=1"
+!isEmpty(WILINK_TESTS) {
+    SUBDIRS += tests/models tests/sound
+}
+
 CONFIG += ordered
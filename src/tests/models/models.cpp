@@ -0,0 +1,586 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include <QDir>
+#include <QDomDocument>
+#include <QGuiApplication>
+#include <QStandardPaths>
+#include <QXmlStreamWriter>
+#include <QtTest/QtTest>
+
+#include "QXmppMucManager.h"
+#include "QXmppRosterIq.h"
+#include "QXmppRosterManager.h"
+
+#include "archive.h"
+#include "client.h"
+#include "history.h"
+#include "models.h"
+#include "rooms.h"
+#include "roster.h"
+
+static const int HISTORY_PAGE_SIZE = 50;
+static const int HISTORY_WINDOW_BUBBLES = 300;
+static const int HISTORY_WINDOW_MESSAGES = 5000;
+static const int ROSTER_SIZE = 1000;
+static const int ROOM_SIZE = 1000;
+
+static const char *FAKE_CAPS_NODE = "http://wilink.example.com/caps";
+static const char *FAKE_DOMAIN = "example.com";
+static const char *FAKE_MUC_DOMAIN = "conference.example.com";
+
+// Counts the objects allocated with operator new. Qt's containers
+// allocate their data with malloc, so this tracks the model items,
+// nodes and objects rather than every heap allocation.
+static QAtomicInt allocationCount;
+
+void *operator new(std::size_t size)
+{
+    allocationCount.ref();
+    void *ptr = std::malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) throw()
+{
+    std::free(ptr);
+}
+
+// Hands a stanza to a client extension, as if it had been received.
+static void deliver(QXmppClientExtension *extension, const QXmppStanza &stanza)
+{
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    stanza.toXml(&writer);
+
+    QDomDocument document;
+    document.setContent(data, true);
+    extension->handleStanza(document.documentElement());
+}
+
+FakeServer::FakeServer(QObject *parent)
+    : QObject(parent)
+    , m_rooms(0)
+{
+    m_client = new ChatClient(this);
+    m_client->configuration().setJid(QString("benchmark@%1/fake").arg(FAKE_DOMAIN));
+}
+
+ChatClient *FakeServer::client() const
+{
+    return m_client;
+}
+
+/** Returns the JID of a contact in the fixtures.
+ */
+QString FakeServer::contactJid(int index)
+{
+    return QString("contact%1@%2").arg(index, 5, 10, QChar('0')).arg(FAKE_DOMAIN);
+}
+
+/** Returns the JID of a room which has not been used yet.
+ */
+QString FakeServer::newRoomJid()
+{
+    return QString("room%1@%2").arg(m_rooms++).arg(FAKE_MUC_DOMAIN);
+}
+
+/** Stores a roster in the client's roster manager, without announcing it.
+ *
+ *  Changing the generation renames one contact in ten.
+ */
+void FakeServer::setRoster(int contacts, int generation)
+{
+    QXmppRosterIq iq;
+    iq.setType(QXmppIq::Result);
+    // does not match the manager's own request, so that the roster is
+    // only announced by sendRoster()
+    iq.setId("fake-roster");
+    for (int i = 0; i < contacts; ++i) {
+        QXmppRosterIq::Item item;
+        item.setBareJid(contactJid(i));
+        if (i % 10)
+            item.setName(QString("Contact %1").arg(i));
+        else
+            item.setName(QString("Contact %1 (%2)").arg(i).arg(generation));
+        item.setSubscriptionType(QXmppRosterIq::Item::Both);
+        iq.addItem(item);
+    }
+    deliver(m_client->rosterManager(), iq);
+}
+
+/** Announces the stored roster, as on connection.
+ */
+void FakeServer::sendRoster()
+{
+    emit m_client->rosterManager()->rosterReceived();
+}
+
+/** Sends an available presence for each resource of the first contacts,
+ *  all of them advertising the same capabilities.
+ */
+void FakeServer::sendPresences(int contacts, int resources, QXmppPresence::AvailableStatusType status)
+{
+    const QByteArray ver = QByteArray(20, 'v');
+    for (int i = 0; i < contacts; ++i) {
+        for (int r = 0; r < resources; ++r) {
+            QXmppPresence presence;
+            presence.setFrom(QString("%1/resource%2").arg(contactJid(i)).arg(r));
+            presence.setAvailableStatusType(status);
+            presence.setPriority(r);
+            presence.setCapabilityHash("sha-1");
+            presence.setCapabilityNode(FAKE_CAPS_NODE);
+            presence.setCapabilityVer(ver);
+            emit m_client->presenceReceived(presence);
+        }
+    }
+}
+
+/** Sends the presences of a room's participants in a scrambled order.
+ *
+ *  When promoted is set, one participant in ten is an administrator.
+ */
+void FakeServer::sendParticipants(const QString &roomJid, int participants, bool promoted)
+{
+    for (int i = 0; i < participants; ++i) {
+        const int index = (qint64(i) * 37) % participants;
+
+        QXmppMucItem item;
+        item.setAffiliation(promoted && !(index % 10) ? QXmppMucItem::AdminAffiliation : QXmppMucItem::MemberAffiliation);
+        item.setRole(QXmppMucItem::ParticipantRole);
+
+        QXmppPresence presence;
+        presence.setFrom(QString("%1/participant%2").arg(roomJid).arg(index, 5, 10, QChar('0')));
+        presence.setMucItem(item);
+        emit m_client->presenceReceived(presence);
+    }
+}
+
+/** Sends a room's affiliation list.
+ *
+ *  Changing the generation changes one affiliation in ten.
+ */
+void FakeServer::sendPermissions(QXmppMucRoom *room, int permissions, int generation)
+{
+    QList<QXmppMucItem> items;
+    for (int i = 0; i < permissions; ++i) {
+        const int index = (qint64(i) * 37) % permissions;
+
+        QXmppMucItem item;
+        item.setJid(contactJid(index));
+        item.setAffiliation((index % 10) || !(generation % 2) ? QXmppMucItem::MemberAffiliation : QXmppMucItem::AdminAffiliation);
+        items << item;
+    }
+    emit room->permissionsReceived(items);
+}
+
+ModelSignalCounter::ModelSignalCounter(QObject *parent)
+    : QObject(parent)
+    , m_model(0)
+{
+}
+
+/** Starts recording the signals of the given model.
+ */
+void ModelSignalCounter::start(QAbstractItemModel *model)
+{
+    bool check;
+    Q_UNUSED(check);
+
+    m_model = model;
+    m_changed = 0;
+    m_inserted = 0;
+    m_insertedRows = 0;
+    m_moved = 0;
+    m_removed = 0;
+    m_removedRows = 0;
+    m_resets = 0;
+
+    check = connect(m_model, SIGNAL(dataChanged(QModelIndex,QModelIndex,QVector<int>)),
+                    this, SLOT(_q_dataChanged()));
+    Q_ASSERT(check);
+
+    check = connect(m_model, SIGNAL(modelReset()),
+                    this, SLOT(_q_modelReset()));
+    Q_ASSERT(check);
+
+    check = connect(m_model, SIGNAL(rowsInserted(QModelIndex,int,int)),
+                    this, SLOT(_q_rowsInserted(QModelIndex,int,int)));
+    Q_ASSERT(check);
+
+    check = connect(m_model, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)),
+                    this, SLOT(_q_rowsMoved(QModelIndex,int,int)));
+    Q_ASSERT(check);
+
+    check = connect(m_model, SIGNAL(rowsRemoved(QModelIndex,int,int)),
+                    this, SLOT(_q_rowsRemoved(QModelIndex,int,int)));
+    Q_ASSERT(check);
+
+    m_allocations = allocationCount.load();
+}
+
+/** Stops recording.
+ */
+void ModelSignalCounter::stop()
+{
+    m_allocations = allocationCount.load() - m_allocations;
+    if (m_model) {
+        m_model->disconnect(this);
+        m_model = 0;
+    }
+}
+
+/** Logs the recorded signals and allocations.
+ */
+void ModelSignalCounter::report(const char *operation) const
+{
+    qDebug("%s: %i rows inserted in %i signals, %i rows removed in %i signals, %i moves, %i changes, %i resets, %i allocations",
+           operation, m_insertedRows, m_inserted, m_removedRows, m_removed, m_moved, m_changed, m_resets, m_allocations);
+}
+
+void ModelSignalCounter::_q_dataChanged()
+{
+    m_changed++;
+}
+
+void ModelSignalCounter::_q_modelReset()
+{
+    m_resets++;
+}
+
+void ModelSignalCounter::_q_rowsInserted(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent);
+    m_inserted++;
+    m_insertedRows += last - first + 1;
+}
+
+void ModelSignalCounter::_q_rowsMoved(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent);
+    m_moved += last - first + 1;
+}
+
+void ModelSignalCounter::_q_rowsRemoved(const QModelIndex &parent, int first, int last)
+{
+    Q_UNUSED(parent);
+    m_removed++;
+    m_removedRows += last - first + 1;
+}
+
+void BenchmarkModels::init()
+{
+    m_server = new FakeServer;
+}
+
+void BenchmarkModels::cleanup()
+{
+    delete m_server;
+    m_server = 0;
+}
+
+void BenchmarkModels::historyPages_data()
+{
+    QTest::addColumn<int>("pages");
+
+    QTest::newRow("10 pages") << 10;
+    QTest::newRow("40 pages") << 40;
+}
+
+/** Measures adding archive pages to a conversation, from the most recent
+ *  page to the oldest one.
+ */
+void BenchmarkModels::historyPages()
+{
+    QFETCH(int, pages);
+
+    const int count = pages * HISTORY_PAGE_SIZE;
+    const QDateTime start(QDate(2015, 1, 1), QTime(0, 0), Qt::UTC);
+    QList<QList<HistoryMessage> > fixture;
+    for (int page = 0; page < pages; ++page) {
+        QList<HistoryMessage> messages;
+        for (int i = count - (page + 1) * HISTORY_PAGE_SIZE; i < count - page * HISTORY_PAGE_SIZE; ++i) {
+            HistoryMessage message;
+            message.archived = true;
+            message.body = QString("message %1").arg(i);
+            message.date = start.addSecs(i * 60);
+            message.jid = FakeServer::contactJid(i % 3);
+            message.received = (i % 3) != 0;
+            messages << message;
+        }
+        fixture << messages;
+    }
+
+    ModelSignalCounter counter;
+    QBENCHMARK {
+        HistoryModel model;
+        // keep all the bubbles, so that no page gets evicted
+        model.setMaximumBubbles(count);
+        counter.start(&model);
+        foreach (const QList<HistoryMessage> &messages, fixture)
+            model.addMessages(messages);
+        counter.stop();
+        QVERIFY(model.rowCount() > 0);
+    }
+    counter.report("archive pages");
+}
+
+/** Measures a chat room which stays open while messages keep arriving,
+ *  and checks that the messages held in memory stay capped.
+ */
+void BenchmarkModels::historyWindow()
+{
+    const QString account = QString("benchmark@%1").arg(FAKE_DOMAIN);
+    const QString roomJid = m_server->newRoomJid();
+    const QDateTime start(QDate(2015, 1, 1), QTime(0, 0), Qt::UTC);
+
+    HistoryModel model;
+    model.setMaximumBubbles(HISTORY_WINDOW_BUBBLES);
+    model.setJid(roomJid);
+    model.setLocalAccount(account);
+
+    ModelSignalCounter counter;
+    int maximumMessages = 0;
+    int sent = 0;
+    QBENCHMARK {
+        counter.start(&model);
+        for (int i = 0; i < HISTORY_WINDOW_MESSAGES; ++i, ++sent) {
+            // every message starts a new bubble
+            HistoryMessage message;
+            message.body = QString("message %1").arg(sent);
+            message.date = start.addSecs(sent * 7200);
+            message.jid = QString("%1/participant%2").arg(roomJid).arg(sent % 2);
+            message.received = true;
+            HistoryArchive::instance()->addMessage(account, roomJid, message);
+            model.addMessage(message);
+            maximumMessages = qMax(maximumMessages, model.messageCount());
+        }
+        counter.stop();
+    }
+    counter.report("history window");
+
+    QVERIFY(model.rowCount() <= HISTORY_WINDOW_BUBBLES);
+    QVERIFY(maximumMessages <= HISTORY_WINDOW_BUBBLES);
+}
+
+void BenchmarkModels::presenceStorm_data()
+{
+    QTest::addColumn<int>("contacts");
+
+    QTest::newRow("100 contacts") << 100;
+    QTest::newRow("1000 contacts") << 1000;
+}
+
+/** Measures the roster's handling of a status change of every contact,
+ *  each of them having two resources.
+ */
+void BenchmarkModels::presenceStorm()
+{
+    QFETCH(int, contacts);
+
+    m_server->setRoster(contacts);
+    RosterModel model;
+    m_server->sendRoster();
+    QCOMPARE(model.rowCount(), contacts);
+
+    ModelSignalCounter counter;
+    bool away = false;
+    QBENCHMARK {
+        away = !away;
+        counter.start(&model);
+        m_server->sendPresences(contacts, 2, away ? QXmppPresence::Away : QXmppPresence::Online);
+        QCoreApplication::processEvents();
+        counter.stop();
+    }
+    counter.report("presence storm");
+}
+
+/** Measures promoting and demoting one participant in ten in a room.
+ */
+void BenchmarkModels::roomAffiliations()
+{
+    RoomModel model;
+    model.setManager(m_server->client()->mucManager());
+    model.setJid(m_server->newRoomJid());
+    m_server->sendParticipants(model.jid(), ROOM_SIZE);
+    QCoreApplication::processEvents();
+    QCOMPARE(model.rowCount(), ROOM_SIZE);
+
+    ModelSignalCounter counter;
+    bool promoted = false;
+    QBENCHMARK {
+        promoted = !promoted;
+        counter.start(&model);
+        m_server->sendParticipants(model.jid(), ROOM_SIZE, promoted);
+        QCoreApplication::processEvents();
+        counter.stop();
+    }
+    counter.report("room affiliations");
+}
+
+void BenchmarkModels::roomJoin_data()
+{
+    QTest::addColumn<int>("participants");
+
+    QTest::newRow("100 participants") << 100;
+    QTest::newRow("1000 participants") << 1000;
+}
+
+/** Measures receiving the participant list when joining a room.
+ */
+void BenchmarkModels::roomJoin()
+{
+    QFETCH(int, participants);
+
+    ModelSignalCounter counter;
+    QBENCHMARK {
+        RoomModel model;
+        model.setManager(m_server->client()->mucManager());
+        model.setJid(m_server->newRoomJid());
+        counter.start(&model);
+        m_server->sendParticipants(model.jid(), participants);
+        QCoreApplication::processEvents();
+        counter.stop();
+        QCOMPARE(model.rowCount(), participants);
+    }
+    counter.report("room join");
+}
+
+void BenchmarkModels::roomPermissions_data()
+{
+    QTest::addColumn<int>("permissions");
+    QTest::addColumn<bool>("reload");
+
+    QTest::newRow("load 100 permissions") << 100 << false;
+    QTest::newRow("load 1000 permissions") << 1000 << false;
+    QTest::newRow("reload 1000 permissions") << 1000 << true;
+}
+
+/** Measures receiving a room's affiliation list, either in an empty model
+ *  or in a model which already holds the previous list.
+ */
+void BenchmarkModels::roomPermissions()
+{
+    QFETCH(int, permissions);
+    QFETCH(bool, reload);
+
+    QXmppMucRoom *room = m_server->client()->mucManager()->addRoom(m_server->newRoomJid());
+    RoomPermissionModel reloadModel;
+    if (reload) {
+        reloadModel.setRoom(room);
+        m_server->sendPermissions(room, permissions);
+    }
+
+    ModelSignalCounter counter;
+    int generation = 0;
+    QBENCHMARK {
+        if (reload) {
+            counter.start(&reloadModel);
+            m_server->sendPermissions(room, permissions, ++generation);
+            counter.stop();
+        } else {
+            RoomPermissionModel model;
+            model.setRoom(room);
+            counter.start(&model);
+            m_server->sendPermissions(room, permissions);
+            counter.stop();
+            QCOMPARE(model.rowCount(), permissions);
+        }
+    }
+    counter.report(reload ? "reload permissions" : "load permissions");
+}
+
+void BenchmarkModels::rosterLoad_data()
+{
+    QTest::addColumn<int>("contacts");
+
+    QTest::newRow("100 contacts") << 100;
+    QTest::newRow("1000 contacts") << 1000;
+    QTest::newRow("5000 contacts") << 5000;
+    QTest::newRow("10000 contacts") << 10000;
+}
+
+/** Measures loading a roster into an empty model, and logs the load time
+ *  which the model reports.
+ */
+void BenchmarkModels::rosterLoad()
+{
+    QFETCH(int, contacts);
+
+    m_server->setRoster(contacts);
+
+    ModelSignalCounter counter;
+    int loadTime = 0;
+    QBENCHMARK {
+        RosterModel model;
+        QSignalSpy loaded(&model, SIGNAL(rosterLoaded(int,int)));
+        counter.start(&model);
+        m_server->sendRoster();
+        counter.stop();
+        QCOMPARE(model.rowCount(), contacts);
+        QCOMPARE(loaded.size(), 1);
+        QCOMPARE(loaded.at(0).at(0).toInt(), contacts);
+        loadTime = loaded.at(0).at(1).toInt();
+    }
+    counter.report("load roster");
+    qDebug("load roster: %i entries loaded in %i ms", contacts, loadTime);
+}
+
+/** Measures receiving a roster again after one contact in ten was renamed,
+ *  including the parsing of the roster stanza.
+ */
+void BenchmarkModels::rosterReload()
+{
+    m_server->setRoster(ROSTER_SIZE);
+    RosterModel model;
+    m_server->sendRoster();
+    QCOMPARE(model.rowCount(), ROSTER_SIZE);
+
+    ModelSignalCounter counter;
+    int generation = 0;
+    QBENCHMARK {
+        m_server->setRoster(ROSTER_SIZE, ++generation);
+        counter.start(&model);
+        m_server->sendRoster();
+        counter.stop();
+    }
+    counter.report("reload roster");
+}
+
+int main(int argc, char *argv[])
+{
+    // run headless, with caches which start empty and are kept away from
+    // the user's data
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QStandardPaths::setTestModeEnabled(true);
+
+    QGuiApplication app(argc, argv);
+    const QString dataPath = QStandardPaths::writableLocation(QStandardPaths::DataLocation);
+    QDir(dataPath).removeRecursively();
+    HistoryArchive::setDataPath(QDir(dataPath).filePath("archive"));
+
+    BenchmarkModels benchmark;
+    return QTest::qExec(&benchmark, argc, argv);
+}
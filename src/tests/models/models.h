@@ -0,0 +1,127 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_TESTS_MODELS_H__
+#define __WILINK_TESTS_MODELS_H__
+
+#include <QList>
+#include <QObject>
+
+#include "QXmppPresence.h"
+
+class ChatClient;
+class QAbstractItemModel;
+class QModelIndex;
+class QXmppMucRoom;
+
+/** The FakeServer class stands in for an XMPP server.
+ *
+ *  It feeds stanzas to a ChatClient which is never connected, either
+ *  through the client's extensions or by emitting the client's signals,
+ *  so that the models see the same calls as with a real server.
+ */
+class FakeServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    FakeServer(QObject *parent = 0);
+
+    ChatClient *client() const;
+    QString newRoomJid();
+
+    void setRoster(int contacts, int generation = 0);
+    void sendRoster();
+    void sendPresences(int contacts, int resources, QXmppPresence::AvailableStatusType status);
+    void sendParticipants(const QString &roomJid, int participants, bool promoted = false);
+    void sendPermissions(QXmppMucRoom *room, int permissions, int generation = 0);
+
+    static QString contactJid(int index);
+
+private:
+    ChatClient *m_client;
+    int m_rooms;
+};
+
+/** The ModelSignalCounter class records the change notifications emitted by
+ *  a model and the allocations made during an operation.
+ */
+class ModelSignalCounter : public QObject
+{
+    Q_OBJECT
+
+public:
+    ModelSignalCounter(QObject *parent = 0);
+
+    void start(QAbstractItemModel *model);
+    void stop();
+    void report(const char *operation) const;
+
+private slots:
+    void _q_dataChanged();
+    void _q_modelReset();
+    void _q_rowsInserted(const QModelIndex &parent, int first, int last);
+    void _q_rowsMoved(const QModelIndex &parent, int first, int last);
+    void _q_rowsRemoved(const QModelIndex &parent, int first, int last);
+
+private:
+    QAbstractItemModel *m_model;
+    int m_allocations;
+    int m_changed;
+    int m_inserted;
+    int m_insertedRows;
+    int m_moved;
+    int m_removed;
+    int m_removedRows;
+    int m_resets;
+};
+
+/** The BenchmarkModels class measures the cost of loading and updating the
+ *  roster, room and history models with fixed-size synthetic fixtures.
+ *
+ *  Each benchmark reports its time through QtTest, then logs the model
+ *  signals and allocations of its last iteration.
+ */
+class BenchmarkModels : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+
+    void historyPages_data();
+    void historyPages();
+    void historyWindow();
+    void presenceStorm_data();
+    void presenceStorm();
+    void roomAffiliations();
+    void roomJoin_data();
+    void roomJoin();
+    void roomPermissions_data();
+    void roomPermissions();
+    void rosterLoad_data();
+    void rosterLoad();
+    void rosterReload();
+
+private:
+    FakeServer *m_server;
+};
+
+#endif
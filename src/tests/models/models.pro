@@ -0,0 +1,56 @@
+include(../../../wilink.pri)
+
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+QT += network quick testlib widgets xml
+
+TARGET = benchmark-models
+
+# Build the models and their dependencies from the plugin's sources.
+WILINK_DIR = ../../imports/wiLink
+INCLUDEPATH += $$WILINK_DIR $$WILINK_DIR/diagnostics
+
+HEADERS += \
+    $$WILINK_DIR/archive.h \
+    $$WILINK_DIR/avatar.h \
+    $$WILINK_DIR/client.h \
+    $$WILINK_DIR/diagnostics.h \
+    $$WILINK_DIR/diagnostics/interface.h \
+    $$WILINK_DIR/diagnostics/QXmppDiagnosticIq.h \
+    $$WILINK_DIR/diagnostics/network.h \
+    $$WILINK_DIR/diagnostics/software.h \
+    $$WILINK_DIR/diagnostics/transfer.h \
+    $$WILINK_DIR/diagnostics/wireless.h \
+    $$WILINK_DIR/history.h \
+    $$WILINK_DIR/model.h \
+    $$WILINK_DIR/rooms.h \
+    $$WILINK_DIR/roster.h \
+    models.h
+
+SOURCES += \
+    $$WILINK_DIR/archive.cpp \
+    $$WILINK_DIR/avatar.cpp \
+    $$WILINK_DIR/client.cpp \
+    $$WILINK_DIR/diagnostics.cpp \
+    $$WILINK_DIR/diagnostics/interface.cpp \
+    $$WILINK_DIR/diagnostics/QXmppDiagnosticIq.cpp \
+    $$WILINK_DIR/diagnostics/network.cpp \
+    $$WILINK_DIR/diagnostics/software.cpp \
+    $$WILINK_DIR/diagnostics/transfer.cpp \
+    $$WILINK_DIR/diagnostics/wireless.cpp \
+    $$WILINK_DIR/diagnostics/wireless_stub.cpp \
+    $$WILINK_DIR/history.cpp \
+    $$WILINK_DIR/model.cpp \
+    $$WILINK_DIR/rooms.cpp \
+    $$WILINK_DIR/roster.cpp \
+    models.cpp
+
+!isEmpty(WILINK_SYSTEM_QXMPP) {
+    INCLUDEPATH += /usr/include/qxmpp
+    LIBS += -lqxmpp
+} else {
+    include(../../3rdparty/qxmpp/qxmpp.pri)
+    INCLUDEPATH += $$QXMPP_INCLUDEPATH
+    LIBS += -L../../3rdparty/qxmpp/src $$QXMPP_LIBS
+}
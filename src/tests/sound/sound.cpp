@@ -0,0 +1,332 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+
+#include <QAudioFakeBackend>
+#include <QBuffer>
+#include <QtCore/qmath.h>
+#include <QtTest/QtTest>
+
+#include "QSoundJitterBuffer.h"
+#include "QSoundMeter.h"
+#include "QSoundPlayer.h"
+#include "QSoundResampler.h"
+#include "QSoundStream.h"
+#include "QSoundTester.h"
+#include "sound.h"
+
+// Returns a fixture consisting of silence followed by a 1 kHz tone.
+static QByteArray toneBurst(const QAudioFormat &format, int silenceMsecs, int toneMsecs)
+{
+    const int channels = format.channelCount();
+    const int silenceFrames = qint64(format.sampleRate()) * silenceMsecs / 1000;
+    const int toneFrames = qint64(format.sampleRate()) * toneMsecs / 1000;
+
+    QByteArray data((silenceFrames + toneFrames) * channels * sizeof(qint16), '\0');
+    qint16 *samples = reinterpret_cast<qint16*>(data.data()) + silenceFrames * channels;
+    for (int i = 0; i < toneFrames; ++i) {
+        const qint16 value = qint16(10000 * sin(2 * M_PI * 1000 * i / format.sampleRate()));
+        for (int c = 0; c < channels; ++c)
+            samples[i * channels + c] = value;
+    }
+    return data;
+}
+
+// Returns the time in milliseconds of the first sample above threshold.
+static int onset(const QByteArray &data, const QAudioFormat &format, int threshold)
+{
+    const qint16 *samples = reinterpret_cast<const qint16*>(data.constData());
+    const int count = data.size() / sizeof(qint16);
+    for (int i = 0; i < count; ++i) {
+        if (qAbs(int(samples[i])) > threshold)
+            return (qint64(i / format.channelCount()) * 1000) / format.sampleRate();
+    }
+    return -1;
+}
+
+// Writes frames whose value identifies the 20 ms packet they belong to.
+static void writePackets(QIODevice *device, int *position, int frames)
+{
+    QVector<qint16> samples(frames);
+    for (int i = 0; i < frames; ++i, ++*position)
+        samples[i] = qint16((*position / 160 + 1) * 32);
+    device->write(reinterpret_cast<const char*>(samples.constData()), frames * sizeof(qint16));
+}
+
+static int rms(const QByteArray &data)
+{
+    qint64 sum = 0;
+    int peak = 0;
+    const int count = data.size() / sizeof(qint16);
+    QSoundMeter::measure(reinterpret_cast<const qint16*>(data.constData()), count, &sum, &peak);
+    return count ? int(sqrt(double(sum) / count)) : 0;
+}
+
+LoopbackDevice::LoopbackDevice(QObject *parent)
+    : QIODevice(parent)
+{
+}
+
+qint64 LoopbackDevice::bytesAvailable() const
+{
+    return m_buffer.size() + QIODevice::bytesAvailable();
+}
+
+bool LoopbackDevice::isSequential() const
+{
+    return true;
+}
+
+qint64 LoopbackDevice::readData(char *data, qint64 maxSize)
+{
+    const int length = qMin(qint64(m_buffer.size()), maxSize);
+    memcpy(data, m_buffer.constData(), length);
+    m_buffer.remove(0, length);
+    return length;
+}
+
+qint64 LoopbackDevice::writeData(const char *data, qint64 maxSize)
+{
+    m_buffer.append(data, maxSize);
+    emit readyRead();
+    return maxSize;
+}
+
+void BenchmarkSound::init()
+{
+    QAudioFakeBackend::instance()->reset();
+}
+
+/** Checks the jitter buffer's depth, underrun count and output ordering
+ *  when packets arrive irregularly, with two gaps during which only a
+ *  trickle of data arrives followed by bursts.
+ */
+void BenchmarkSound::jitterBuffer()
+{
+    const QAudioFormat format = QSoundStream::pcmAudioFormat(1, 8000);
+    LoopbackDevice rtp;
+    rtp.open(QIODevice::ReadWrite);
+    QSoundJitterBuffer buffer(format, &rtp);
+
+    int written = 0;
+    int lastPacket = 0;
+    QVector<qint16> output(160);
+    for (int tick = 0; tick < 600; ++tick) {
+        // one 20 ms packet per period, except during the gaps
+        if ((tick >= 100 && tick < 130) || (tick >= 300 && tick < 330))
+            writePackets(&rtp, &written, 40);
+        else if (tick == 130 || tick == 330)
+            writePackets(&rtp, &written, 160 + 30 * 120);
+        else
+            writePackets(&rtp, &written, 160);
+
+        QCOMPARE(buffer.read(reinterpret_cast<char*>(output.data()), 320), qint64(320));
+
+        // unaltered samples must reveal packets in order
+        for (int i = 0; i < output.size(); ++i) {
+            if (output[i] > 0 && !(output[i] % 32)) {
+                const int packet = output[i] / 32;
+                QVERIFY(packet <= lastPacket + 1);
+                lastPacket = qMax(lastPacket, packet);
+            }
+        }
+    }
+
+    QCOMPARE(buffer.underrunCount(), 2);
+    QVERIFY(lastPacket > 550);
+    QVERIFY(qAbs(buffer.latency() - buffer.targetLatency()) <= 30);
+}
+
+void BenchmarkSound::meter_data()
+{
+    QTest::addColumn<int>("bufferSize");
+
+    QTest::newRow("160 bytes") << 160;
+    QTest::newRow("1024 bytes") << 1024;
+    QTest::newRow("4096 bytes") << 4096;
+}
+
+/** Measures the cost of metering the call-incoming sound.
+ */
+void BenchmarkSound::meter()
+{
+    QFETCH(int, bufferSize);
+
+    QAudioFakeBackend *backend = QAudioFakeBackend::instance();
+    QVERIFY(backend->loadFixture(WILINK_SOUNDS_DIR "/call-incoming.wav"));
+
+    QBuffer buffer;
+    buffer.setData(backend->fixture());
+    buffer.open(QIODevice::ReadOnly);
+
+    QSoundMeter meter(backend->deviceFormat(), &buffer);
+    QByteArray chunk(bufferSize, '\0');
+    QBENCHMARK {
+        meter.seek(0);
+        while (meter.read(chunk.data(), chunk.size()) > 0)
+            ;
+    }
+    QVERIFY(meter.value() >= 0);
+}
+
+void BenchmarkSound::resampler_data()
+{
+    QTest::addColumn<int>("inputRate");
+    QTest::addColumn<int>("inputChannels");
+    QTest::addColumn<int>("outputRate");
+    QTest::addColumn<int>("outputChannels");
+
+    QTest::newRow("8000/1 to 48000/2") << 8000 << 1 << 48000 << 2;
+    QTest::newRow("16000/1 to 44100/2") << 16000 << 1 << 44100 << 2;
+    QTest::newRow("48000/2 to 8000/1") << 48000 << 2 << 8000 << 1;
+    QTest::newRow("44100/1 to 16000/1") << 44100 << 1 << 16000 << 1;
+}
+
+/** Measures the cost of converting one second of audio, processed in
+ *  20 ms periods.
+ */
+void BenchmarkSound::resampler()
+{
+    QFETCH(int, inputRate);
+    QFETCH(int, inputChannels);
+    QFETCH(int, outputRate);
+    QFETCH(int, outputChannels);
+
+    const int periodFrames = inputRate / 50;
+    QVector<qint16> input(periodFrames * inputChannels);
+    for (int i = 0; i < periodFrames; ++i)
+        for (int c = 0; c < inputChannels; ++c)
+            input[i * inputChannels + c] = qint16(10000 * qSin(2 * M_PI * 1000 * i / inputRate));
+
+    QSoundConverter converter(inputRate, inputChannels, outputRate, outputChannels);
+    QVector<qint16> output(converter.outputFramesFor(periodFrames) * outputChannels);
+    int produced = 0;
+    QBENCHMARK {
+        for (int period = 0; period < 50; ++period)
+            produced += converter.process(input.constData(), periodFrames, output.data(), output.size() / outputChannels);
+    }
+    QVERIFY(produced > 0);
+}
+
+void BenchmarkSound::streamLatency_data()
+{
+    QTest::addColumn<int>("periodSize");
+    QTest::addColumn<int>("underruns");
+
+    QTest::newRow("5 ms periods") << 5 << 0;
+    QTest::newRow("10 ms periods") << 10 << 0;
+    QTest::newRow("20 ms periods") << 20 << 0;
+    QTest::newRow("10 ms periods with underruns") << 10 << 3;
+}
+
+/** Measures the capture to playback latency through an 8 kHz RTP stream.
+ *
+ * The latency is in milliseconds of audio rather than wall time, so it is
+ * logged instead of being reported as a benchmark result.
+ */
+void BenchmarkSound::streamLatency()
+{
+    QFETCH(int, periodSize);
+    QFETCH(int, underruns);
+
+    QAudioFakeBackend *backend = QAudioFakeBackend::instance();
+    const QAudioFormat format = backend->deviceFormat();
+    backend->setPeriodSize(periodSize);
+    backend->setFixture(toneBurst(format, 500, 200));
+
+    QSoundPlayer player;
+    LoopbackDevice rtp;
+    rtp.open(QIODevice::ReadWrite);
+
+    QSoundStream stream(&player);
+    stream.setDevice(&rtp);
+    stream.setFormat(1, 8000);
+    stream.startInput();
+    stream.startOutput();
+
+    backend->advance(250);
+    backend->injectUnderruns(underruns);
+    backend->advance(1000);
+
+    stream.stopOutput();
+    stream.stopInput();
+
+    const int latency = onset(backend->recording(), format, 2000) - 500;
+    QVERIFY(latency >= 0);
+    qDebug("%s: %i ms of audio latency", QTest::currentDataTag(), latency);
+}
+
+/** Measures the CPU cost of ten seconds of full-duplex streaming.
+ */
+void BenchmarkSound::stream()
+{
+    QAudioFakeBackend *backend = QAudioFakeBackend::instance();
+    QVERIFY(backend->loadFixture(WILINK_SOUNDS_DIR "/call-incoming.wav"));
+    backend->setFixtureLooping(true);
+
+    QSoundPlayer player;
+    LoopbackDevice rtp;
+    rtp.open(QIODevice::ReadWrite);
+
+    QSoundStream stream(&player);
+    stream.setDevice(&rtp);
+    stream.setFormat(1, 8000);
+    stream.startInput();
+    stream.startOutput();
+
+    QBENCHMARK {
+        backend->clearRecording();
+        backend->advance(10000);
+    }
+
+    stream.stopOutput();
+    stream.stopInput();
+
+    QVERIFY(rms(backend->recording()) > 0);
+}
+
+/** Measures the CPU cost of a full record and playback cycle of the
+ *  sound tester.
+ */
+void BenchmarkSound::tester()
+{
+    QAudioFakeBackend *backend = QAudioFakeBackend::instance();
+    QVERIFY(backend->loadFixture(WILINK_SOUNDS_DIR "/call-incoming.wav"));
+    backend->setFixtureLooping(true);
+
+    QSoundTester tester;
+    QBENCHMARK {
+        tester.start(QString(), QString());
+        QCOMPARE(tester.state(), QSoundTester::RecordingState);
+        backend->advance(tester.duration() * 1000);
+
+        QMetaObject::invokeMethod(&tester, "_q_playback");
+        QCOMPARE(tester.state(), QSoundTester::PlayingState);
+        backend->clearRecording();
+        backend->advance(tester.duration() * 1000);
+
+        QMetaObject::invokeMethod(&tester, "_q_stop");
+        QCOMPARE(tester.state(), QSoundTester::IdleState);
+    }
+
+    QVERIFY(rms(backend->recording()) > 0);
+}
+
+QTEST_GUILESS_MAIN(BenchmarkSound)
@@ -0,0 +1,67 @@
+/*
+ * wiLink
+ * Copyright (C) 2009-2015 Wifirst
+ * See AUTHORS file for a full list of contributors.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WILINK_TESTS_SOUND_H__
+#define __WILINK_TESTS_SOUND_H__
+
+#include <QIODevice>
+
+/** The LoopbackDevice class stands in for an RTP audio channel: whatever
+ *  is captured can be read back for playback.
+ */
+class LoopbackDevice : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    LoopbackDevice(QObject *parent = 0);
+    qint64 bytesAvailable() const;
+    bool isSequential() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    QByteArray m_buffer;
+};
+
+/** The BenchmarkSound class measures the latency and CPU cost of the sound
+ *  classes using the headless audio backend, so that results do not depend
+ *  on the machine's sound card or scheduling.
+ */
+class BenchmarkSound : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+
+    void jitterBuffer();
+    void meter_data();
+    void meter();
+    void resampler_data();
+    void resampler();
+    void streamLatency_data();
+    void streamLatency();
+    void stream();
+    void tester();
+};
+
+#endif
@@ -0,0 +1,37 @@
+include(../../../wilink.pri)
+
+TEMPLATE = app
+CONFIG += console testcase
+CONFIG -= app_bundle
+QT -= gui
+QT += network testlib
+
+TARGET = benchmark-sound
+
+# Build the sound classes against the headless audio backend
+# instead of QtMultimedia.
+SOUND_DIR = ../../imports/wiLink/sound
+INCLUDEPATH += $$SOUND_DIR/fake $$SOUND_DIR
+DEFINES += WILINK_SOUNDS_DIR=\\\"$$WILINK_SOURCE_TREE/src/data/qml/sounds\\\"
+
+HEADERS += \
+    $$SOUND_DIR/fake/QAudioInput \
+    $$SOUND_DIR/fake/QAudioOutput \
+    $$SOUND_DIR/QSoundJitterBuffer.h \
+    $$SOUND_DIR/QSoundMeter.h \
+    $$SOUND_DIR/QSoundMixer.h \
+    $$SOUND_DIR/QSoundPlayer.h \
+    $$SOUND_DIR/QSoundResampler.h \
+    $$SOUND_DIR/QSoundStream.h \
+    $$SOUND_DIR/QSoundTester.h \
+    sound.h
+
+SOURCES += \
+    $$SOUND_DIR/QSoundJitterBuffer.cpp \
+    $$SOUND_DIR/QSoundMeter.cpp \
+    $$SOUND_DIR/QSoundMixer.cpp \
+    $$SOUND_DIR/QSoundPlayer.cpp \
+    $$SOUND_DIR/QSoundResampler.cpp \
+    $$SOUND_DIR/QSoundStream.cpp \
+    $$SOUND_DIR/QSoundTester.cpp \
+    sound.cpp